@@ -0,0 +1,432 @@
+/*
+ * A benchmark driver for the three guttering systems. One executable runs GutterTree,
+ * StandAloneGutters and CacheGuttering on the same workload, with every GutteringConfiguration
+ * parameter settable from the command line. Every parameter takes a comma separated list of
+ * values and the driver runs every combination of them, so a sweep is a single command:
+ *
+ *   guttering_bench --system standalone,cache --nodes 131072 --updates 1000000000
+ *                   --inserters 1,4,8 --gutter_bytes 16384,32768 --csv sweep.csv
+ *
+ * Each combination reports the best of --repeats runs on stdout and, if asked, as CSV and JSON.
+ * The workload is a pool of edges from StreamGenerator (or the sequential pattern of the older
+ * experiments), generated before timing. Both directions of each edge are inserted, and the
+ * inserters cycle through the pool when the updates outnumber it.
+ *
+ * usage: guttering_bench [--PARAMETER V1,V2,...]... [--repeats N] [--csv FILE] [--json FILE]
+ *        guttering_bench --help    lists the parameters and their defaults
+ */
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../include/cache_guttering.h"
+#include "../include/gutter_tree.h"
+#include "../include/standalone_gutters.h"
+#include "../include/stream_generator.h"
+
+struct Parameter {
+  const char *name;
+  const char *default_value; // empty for the system's own default
+  const char *help;
+};
+
+// the sweepable parameters, in the order they vary: the last one varies fastest
+static const std::vector<Parameter> parameters = {
+  {"system",      "standalone", "gutter_tree, standalone or cache"},
+  {"nodes",       "131072",     "number of graph nodes"},
+  {"updates",     "100000000",  "updates to insert, both directions of updates/2 edges"},
+  {"inserters",   "1",          "inserting threads, GutterTree supports only 1"},
+  {"workers",     "1",          "consumer threads draining the work queue"},
+  {"workload",    "uniform",    "sequential, uniform, rmat or zipf"},
+  {"seed",        "1",          "seed of the workload"},
+  {"hubs",        "0",          "bursty hub nodes of the workload, 0 for none"},
+  {"pool",        "4194304",    "edges generated before timing"},
+  {"dir",         "./",         "directory of the GutterTree's data file"},
+  // GutteringConfiguration
+  {"page_factor",         "", "write granularity in pages"},
+  {"buffer_exp",          "", "log2 of the GutterTree buffer size"},
+  {"fanout",              "", "GutterTree and CacheGuttering fanout"},
+  {"queue_factor",        "", "work queue batches per worker"},
+  {"num_flushers",        "", "background flush threads"},
+  {"gutter_bytes",        "", "bytes per leaf gutter"},
+  {"wq_batch_per_elm",    "", "batches per work queue push or peek"},
+  {"batch_sort",          "", "none, flush or deferred"},
+  {"sort_threads",        "", "sorting threads when sorting is deferred"},
+  {"local_radix_bits",    "", "StandAloneGutters radix stage bits, 0 for per node"},
+  {"leaf_pool_bytes",     "", "cap on CacheGuttering leaf memory, 0 for none"},
+  {"adaptive_leaf_bytes", "", "average CacheGuttering leaf size when adaptive, 0 for off"},
+  {"memory_budget",       "", "cap on the memory of the system, 0 for none"},
+  {"prefault",            "", "1 to fault memory in at construction"},
+  {"hub_gutters",         "", "heavy hitter gutters per inserter, 0 for none"},
+  {"node_id_values",      "", "1 if values are node ids, letting CacheGuttering pack slots"},
+};
+
+// one combination of parameter values, indexed like parameters
+using Run = std::vector<std::string>;
+
+struct Options {
+  std::vector<std::vector<std::string>> values; // the values of each parameter
+  size_t repeats = 1;
+  std::string csv_file;
+  std::string json_file;
+};
+
+struct Result {
+  uint64_t updates;
+  uint64_t received;      // updates the workers took off the work queue
+  double insert_seconds;  // inserting, not counting the final flush
+  double seconds;         // inserting and force_flush()
+  size_t memory_bytes;    // memory_usage() after the flush
+};
+
+static const char *metrics[] = {"updates", "received", "insert_seconds", "seconds",
+                                "updates_per_sec", "ns_per_update", "memory_bytes"};
+
+static size_t param_index(const std::string &name) {
+  for (size_t p = 0; p < parameters.size(); p++)
+    if (name == parameters[p].name) return p;
+  return parameters.size();
+}
+
+static const std::string &get(const Run &run, const char *name) {
+  return run[param_index(name)];
+}
+
+static uint64_t get_num(const Run &run, const char *name) {
+  return std::stoull(get(run, name));
+}
+
+static double now() {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void usage_error(const std::string &msg) {
+  fprintf(stderr, "%s\n", msg.c_str());
+  fprintf(stderr, "usage: guttering_bench [--PARAMETER V1,V2,...]... [--repeats N] "
+                  "[--csv FILE] [--json FILE]\n");
+  fprintf(stderr, "parameters (default):\n");
+  for (auto &param : parameters)
+    fprintf(stderr, "  --%-20s %s (%s)\n", param.name, param.help,
+            param.default_value[0] ? param.default_value : "system default");
+  exit(EXIT_FAILURE);
+}
+
+static std::vector<std::string> split(const std::string &list) {
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) items.push_back(item);
+  return items;
+}
+
+static Options parse_options(int argc, char **argv) {
+  Options opts;
+  for (auto &param : parameters) opts.values.push_back({param.default_value});
+  for (int i = 1; i < argc; i += 2) {
+    const std::string flag = argv[i];
+    if (flag == "--help" || flag.compare(0, 2, "--") != 0) usage_error("");
+    if (i + 1 >= argc) usage_error("missing value for " + flag);
+    const std::string value = argv[i + 1];
+    const std::string name = flag.substr(2);
+    if (name == "repeats") opts.repeats = std::max(std::stoul(value), 1ul);
+    else if (name == "csv") opts.csv_file = value;
+    else if (name == "json") opts.json_file = value;
+    else if (param_index(name) < parameters.size()) {
+      opts.values[param_index(name)] = split(value);
+      if (opts.values[param_index(name)].empty()) usage_error("no values for " + flag);
+    }
+    else usage_error("unknown option " + flag);
+  }
+  return opts;
+}
+
+// every combination of the parameter values
+static std::vector<Run> sweep(const Options &opts) {
+  std::vector<Run> runs = {{}};
+  for (auto &values : opts.values) {
+    std::vector<Run> next;
+    for (auto &run : runs) {
+      for (auto &value : values) {
+        next.push_back(run);
+        next.back().push_back(value);
+      }
+    }
+    runs = next;
+  }
+  return runs;
+}
+
+using Setter = GutteringConfiguration &(GutteringConfiguration::*)(size_t);
+
+static GutteringConfiguration make_conf(const Run &run) {
+  GutteringConfiguration conf;
+  auto set = [&](const char *name, Setter setter) {
+    if (!get(run, name).empty()) (conf.*setter)(get_num(run, name));
+  };
+  set("page_factor", &GutteringConfiguration::page_factor);
+  set("buffer_exp", &GutteringConfiguration::buffer_exp);
+  set("fanout", &GutteringConfiguration::fanout);
+  set("queue_factor", &GutteringConfiguration::queue_factor);
+  set("num_flushers", &GutteringConfiguration::num_flushers);
+  set("gutter_bytes", &GutteringConfiguration::gutter_bytes);
+  set("wq_batch_per_elm", &GutteringConfiguration::wq_batch_per_elm);
+  set("sort_threads", &GutteringConfiguration::sort_threads);
+  set("local_radix_bits", &GutteringConfiguration::local_radix_bits);
+  set("leaf_pool_bytes", &GutteringConfiguration::leaf_pool_bytes);
+  set("adaptive_leaf_bytes", &GutteringConfiguration::adaptive_leaf_bytes);
+  set("memory_budget", &GutteringConfiguration::memory_budget);
+  set("hub_gutters", &GutteringConfiguration::hub_gutters);
+  const std::string &sort = get(run, "batch_sort");
+  if (sort == "none") conf.batch_sort(NO_SORT);
+  else if (sort == "flush") conf.batch_sort(SORT_ON_FLUSH);
+  else if (sort == "deferred") conf.batch_sort(SORT_DEFERRED);
+  else if (!sort.empty()) throw std::invalid_argument("unknown batch_sort " + sort);
+  if (!get(run, "prefault").empty()) conf.prefault(get(run, "prefault") != "0");
+  if (!get(run, "node_id_values").empty())
+    conf.node_id_values(get(run, "node_id_values") != "0");
+  return conf;
+}
+
+static GutteringSystem *make_system(const Run &run) {
+  const std::string &system = get(run, "system");
+  const gutter_key_t nodes = get_num(run, "nodes");
+  const uint32_t workers = get_num(run, "workers");
+  const uint32_t inserters = get_num(run, "inserters");
+  if (system == "gutter_tree")
+    return new GutterTree(get(run, "dir"), nodes, workers, make_conf(run), true);
+  if (system == "standalone")
+    return new StandAloneGutters(nodes, workers, inserters, make_conf(run));
+  if (system == "cache")
+    return new CacheGuttering(nodes, workers, inserters, make_conf(run));
+  throw std::invalid_argument("unknown system " + system);
+}
+
+// both directions of each edge of the workload
+static std::vector<update_t> make_pool(const Run &run) {
+  const std::string &workload = get(run, "workload");
+  const gutter_key_t nodes = get_num(run, "nodes");
+  const uint64_t edges = std::min(get_num(run, "pool"), (get_num(run, "updates") + 1) / 2);
+  std::vector<update_t> pool(2 * std::max(edges, uint64_t(1)));
+  if (workload == "sequential") { // the pattern of the SA_Throughput and CG_Throughput tests
+    for (uint64_t i = 0; i < pool.size() / 2; i++) {
+      pool[2 * i] = {gutter_key_t(i % nodes), gutter_value_t((nodes - 1) - (i % nodes))};
+      pool[2 * i + 1] = {gutter_key_t((nodes - 1) - (i % nodes)), gutter_value_t(i % nodes)};
+    }
+    return pool;
+  }
+  StreamGenerator::Options opts;
+  if (workload == "uniform") opts.dist(StreamGenerator::UNIFORM);
+  else if (workload == "rmat") opts.dist(StreamGenerator::RMAT);
+  else if (workload == "zipf") opts.dist(StreamGenerator::ZIPF);
+  else throw std::invalid_argument("unknown workload " + workload);
+  opts.seeded(get_num(run, "seed"));
+  if (get_num(run, "hubs") > 0) opts.bursts(get_num(run, "hubs"));
+  StreamGenerator gen(nodes, pool.size() / 2, opts);
+  gen.generate(std::thread::hardware_concurrency(), [&](size_t, uint64_t first,
+                                                        const StreamGenerator::Edge *chunk,
+                                                        size_t count) {
+    for (size_t j = 0; j < count; j++) {
+      pool[2 * (first + j)] = {chunk[j].src, chunk[j].dst};
+      pool[2 * (first + j) + 1] = {chunk[j].dst, chunk[j].src};
+    }
+  });
+  return pool;
+}
+
+static Result run_once(const Run &run, const std::vector<update_t> &pool) {
+  const uint64_t updates = get_num(run, "updates");
+  const size_t inserters = get_num(run, "inserters");
+  const size_t workers = get_num(run, "workers");
+  std::unique_ptr<GutteringSystem> gts(make_system(run));
+
+  std::atomic<uint64_t> received{0};
+  std::atomic<bool> done{false};
+  std::vector<std::thread> consumers;
+  for (size_t w = 0; w < workers; w++) {
+    consumers.emplace_back([&]() {
+      WorkQueue::DataNode *data;
+      while (true) {
+        if (gts->get_data(data)) {
+          uint64_t count = 0;
+          for (auto &batch : data->get_batches()) count += batch.upd_vec.size();
+          received += count;
+          gts->get_data_callback(data);
+        }
+        else if (done)
+          return;
+      }
+    });
+  }
+
+  // inserter t inserts updates [first, last) of the stream in runs from the pool
+  const size_t run_updates = 2048;
+  double start = now();
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < inserters; t++) {
+    threads.emplace_back([&, t]() {
+      const uint64_t first = updates * t / inserters;
+      const uint64_t last = updates * (t + 1) / inserters;
+      for (uint64_t i = first; i < last;) {
+        const size_t at = i % pool.size();
+        const size_t count = std::min(std::min(uint64_t(run_updates), last - i), pool.size() - at);
+        gts->insert_updates(pool.data() + at, count, t);
+        i += count;
+      }
+    });
+  }
+  for (auto &thr : threads) thr.join();
+  Result result;
+  result.insert_seconds = now() - start;
+  gts->force_flush();
+  result.seconds = now() - start;
+  result.memory_bytes = gts->memory_usage().total();
+
+  done = true;
+  gts->set_non_block(true); // switch to non-blocking calls in an effort to exit
+  for (auto &thr : consumers) thr.join();
+  result.updates = updates;
+  result.received = received;
+  return result;
+}
+
+static std::string metric(const Result &res, size_t m) {
+  std::ostringstream out;
+  switch (m) {
+    case 0: out << res.updates; break;
+    case 1: out << res.received; break;
+    case 2: out << res.insert_seconds; break;
+    case 3: out << res.seconds; break;
+    case 4: out << res.updates / res.seconds; break;
+    case 5: out << res.seconds * 1e9 / res.updates; break;
+    default: out << res.memory_bytes;
+  }
+  return out.str();
+}
+
+// whether value is a finite number in JSON's syntax, which has no leading zeros, bare dots, signs
+// other than minus, hex, inf or nan
+static bool json_number(const std::string &value) {
+  size_t i = value[0] == '-' ? 1 : 0;
+  auto digits = [&]() {
+    const size_t start = i;
+    while (i < value.size() && isdigit((unsigned char) value[i])) ++i;
+    return i - start;
+  };
+  const size_t start = i;
+  const size_t int_digits = digits();
+  if (int_digits == 0 || (int_digits > 1 && value[start] == '0')) return false;
+  if (i < value.size() && value[i] == '.') {
+    ++i;
+    if (digits() == 0) return false;
+  }
+  if (i < value.size() && (value[i] == 'e' || value[i] == 'E')) {
+    ++i;
+    if (i < value.size() && (value[i] == '+' || value[i] == '-')) ++i;
+    if (digits() == 0) return false;
+  }
+  if (i != value.size()) return false;
+  char *end;
+  const double number = strtod(value.c_str(), &end);
+  return *end == '\0' && std::isfinite(number);
+}
+
+static std::string json_value(const std::string &value) {
+  if (value.empty()) return "null";
+  if (json_number(value)) return value;
+  std::string quoted = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') quoted += '\\';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+int main(int argc, char **argv) {
+  Options opts = parse_options(argc, argv);
+  std::vector<Run> runs = sweep(opts);
+  std::vector<std::pair<Run, Result>> results;
+
+  std::ofstream csv;
+  if (!opts.csv_file.empty()) {
+    csv.open(opts.csv_file);
+    for (auto &param : parameters) csv << param.name << ",";
+    for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++)
+      csv << (m ? "," : "") << metrics[m];
+    csv << std::endl;
+  }
+
+  for (size_t r = 0; r < runs.size(); r++) {
+    const Run &run = runs[r];
+    std::string desc;
+    for (size_t p = 0; p < parameters.size(); p++)
+      if (opts.values[p].size() > 1 || p < param_index("dir"))
+        desc += std::string(desc.empty() ? "" : " ") + parameters[p].name + "=" + run[p];
+    printf("Run %lu/%lu: %s\n", r + 1, runs.size(), desc.c_str());
+    fflush(stdout);
+    if (get(run, "system") == "gutter_tree" && get_num(run, "inserters") != 1) {
+      printf("WARNING: GutterTree has a single inserter, skipping inserters=%s\n",
+             get(run, "inserters").c_str());
+      continue;
+    }
+
+    Result best;
+    try {
+      std::vector<update_t> pool = make_pool(run);
+      for (size_t rep = 0; rep < opts.repeats; rep++) {
+        Result res = run_once(run, pool);
+        if (get(run, "system") == "gutter_tree")
+          remove((get(run, "dir") + "gutter_tree_v0.4.data").c_str());
+        if (rep == 0 || res.seconds < best.seconds) best = res;
+      }
+    } catch (std::exception &e) {
+      printf("WARNING: run failed: %s\n", e.what());
+      continue;
+    }
+    if (best.received != best.updates)
+      printf("WARNING: inserted %lu updates but the workers received %lu\n", best.updates,
+             best.received);
+    printf("Insertions took %f seconds, %f with the final flush: average rate = %f, "
+           "memory = %lu bytes\n", best.insert_seconds, best.seconds,
+           best.updates / best.seconds, best.memory_bytes);
+    fflush(stdout);
+
+    if (csv.is_open()) {
+      for (auto &value : run) csv << value << ",";
+      for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++)
+        csv << (m ? "," : "") << metric(best, m);
+      csv << std::endl; // flushed per run, so a long sweep keeps its finished runs
+    }
+    results.emplace_back(run, best);
+  }
+
+  if (!opts.json_file.empty()) {
+    std::ofstream out(opts.json_file);
+    out << "{\n  \"context\": {\"key_bytes\": " << sizeof(gutter_key_t)
+        << ", \"value_bytes\": " << sizeof(gutter_value_t)
+        << ", \"hardware_threads\": " << std::thread::hardware_concurrency()
+        << ", \"repeats\": " << opts.repeats << "},\n  \"runs\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+      out << (i ? ",\n" : "\n") << "    {\"params\": {";
+      for (size_t p = 0; p < parameters.size(); p++)
+        out << (p ? ", " : "") << "\"" << parameters[p].name << "\": "
+            << json_value(results[i].first[p]);
+      out << "}";
+      for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++)
+        out << ", \"" << metrics[m] << "\": " << metric(results[i].second, m);
+      out << "}";
+    }
+    out << "\n  ]\n}\n";
+    printf("Wrote %lu results to %s\n", results.size(), opts.json_file.c_str());
+  }
+}
@@ -4,6 +4,7 @@
 #include <atomic>
 #include <fstream>
 #include "../include/cache_guttering.h"
+#include "../include/stream_generator.h"
 
 static bool shutdown = false;
 static constexpr uint32_t prime = 100000007;
@@ -27,7 +28,8 @@ static void querier(GutteringSystem *gts) {
   }
 }
 
-static void run_randomized(const int nodes, const unsigned long updates, const unsigned int nthreads=1) {
+static void run_randomized(const int nodes, const unsigned long updates, const unsigned int nthreads=1,
+                           const bool prefetch=true) {
   num_updates_processed = 0;
   shutdown = false;
   size_t num_workers  = 20;
@@ -46,9 +48,11 @@ static void run_randomized(const int nodes, const unsigned long updates, const u
               .queue_factor(queue_factor)
               .num_flushers(num_flushers)
               .gutter_bytes(gutter_size)
-              .wq_batch_per_elm(wq_batch);
+              .wq_batch_per_elm(wq_batch)
+              .node_id_values(true);
 
   CacheGuttering *gutters = new CacheGuttering(nodes, num_workers, nthreads, conf);
+  gutters->set_prefetch(prefetch);
 
   // create queriers
   std::thread query_threads[num_workers];
@@ -97,6 +101,9 @@ static void run_randomized(const int nodes, const unsigned long updates, const u
 
   std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
   printf("Insertions took %f seconds: average rate = %f\n", delta.count(), updates/delta.count());
+  auto l3_stats = gutters->get_level3_stats();
+  printf("Level 3 flushes deferred = %lu, blocked = %lu, lock wait = %f seconds\n",
+         l3_stats.deferred, l3_stats.blocked, l3_stats.wait_seconds);
 
   for (size_t t = 0; t < num_workers; t++)
     query_threads[t].join();
@@ -118,7 +125,8 @@ static void run_test(const int nodes, const unsigned long updates, const unsigne
               .queue_factor(8)
               .num_flushers(2)
               .gutter_bytes(32 * 1024)
-              .wq_batch_per_elm(8);
+              .wq_batch_per_elm(8)
+              .node_id_values(true);
   CacheGuttering *gutters = new CacheGuttering(nodes, num_workers, nthreads, conf);
 
   // create queriers
@@ -166,6 +174,58 @@ static void run_test(const int nodes, const unsigned long updates, const unsigne
   shutdown = true;
   gutters->set_non_block(true); // switch to non-blocking calls in an effort to exit
   
+  std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+  printf("Insertions took %f seconds: average rate = %f\n", delta.count(), updates/delta.count());
+  auto l3_stats = gutters->get_level3_stats();
+  printf("Level 3 flushes deferred = %lu, blocked = %lu, lock wait = %f seconds\n",
+         l3_stats.deferred, l3_stats.blocked, l3_stats.wait_seconds);
+
+  for (size_t t = 0; t < num_workers; t++)
+    query_threads[t].join();
+
+  std::cout << "Number of updates processed according to queriers = " << num_updates_processed << std::endl;
+  delete gutters;
+}
+
+// inserts a synthetic stream from StreamGenerator, both directions of every edge
+static void run_stream(const int nodes, const unsigned long updates, const unsigned int nthreads,
+                       const StreamGenerator::Options &opts) {
+  num_updates_processed = 0;
+  shutdown = false;
+  size_t num_workers = 20;
+  auto conf = GutteringConfiguration()
+              .page_factor(1)
+              .buffer_exp(20)
+              .fanout(64)
+              .queue_factor(8)
+              .num_flushers(2)
+              .gutter_bytes(32 * 1024)
+              .wq_batch_per_elm(8)
+              .node_id_values(true);
+  CacheGuttering *gutters = new CacheGuttering(nodes, num_workers, nthreads, conf);
+
+  // create queriers
+  std::thread query_threads[num_workers];
+  for (size_t t = 0; t < num_workers; t++) {
+    query_threads[t] = std::thread(querier, gutters);
+  }
+
+  StreamGenerator gen(nodes, updates, opts);
+  auto start = std::chrono::steady_clock::now();
+  gen.generate(nthreads, [&](size_t thr, uint64_t, const StreamGenerator::Edge *edges,
+                             size_t count) {
+    std::vector<update_t> run(2 * count);
+    for (size_t j = 0; j < count; j++) {
+      run[2 * j] = {edges[j].src, edges[j].dst};
+      run[2 * j + 1] = {edges[j].dst, edges[j].src};
+    }
+    gutters->insert_updates(run.data(), run.size(), thr);
+  });
+
+  gutters->force_flush();
+  shutdown = true;
+  gutters->set_non_block(true); // switch to non-blocking calls in an effort to exit
+
   std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
   printf("Insertions took %f seconds: average rate = %f\n", delta.count(), updates/delta.count());
 
@@ -263,3 +323,41 @@ TEST(CG_Throughput_Rand, kron18_48threads) {
   run_randomized(262144, 17891985703, 48);
   ASSERT_EQ(num_updates_processed, 17891985703 * 2);
 }
+
+// software prefetching in the flush loops against the plain loops. Leaf scatter is latency bound
+// for large graphs
+TEST(CG_Prefetch, kron17_10threads_prefetch) {
+  run_randomized(131072, 4474931789, 10, true);
+  ASSERT_EQ(num_updates_processed, 4474931789 * 2);
+}
+TEST(CG_Prefetch, kron17_10threads_no_prefetch) {
+  run_randomized(131072, 4474931789, 10, false);
+  ASSERT_EQ(num_updates_processed, 4474931789 * 2);
+}
+TEST(CG_Prefetch, kron20_10threads_prefetch) {
+  run_randomized(1048576, 4474931789, 10, true);
+  ASSERT_EQ(num_updates_processed, 4474931789 * 2);
+}
+TEST(CG_Prefetch, kron20_10threads_no_prefetch) {
+  run_randomized(1048576, 4474931789, 10, false);
+  ASSERT_EQ(num_updates_processed, 4474931789 * 2);
+}
+
+// skewed streams from StreamGenerator. Generation runs inside the inserting threads, so these
+// include its cost
+TEST(CG_Stream, kron17_rmat_10threads) {
+  run_stream(131072, 1000000000, 10, StreamGenerator::Options().dist(StreamGenerator::RMAT));
+  ASSERT_EQ(num_updates_processed, 1000000000ul * 2);
+}
+TEST(CG_Stream, kron17_zipf_10threads) {
+  run_stream(131072, 1000000000, 10, StreamGenerator::Options().dist(StreamGenerator::ZIPF));
+  ASSERT_EQ(num_updates_processed, 1000000000ul * 2);
+}
+TEST(CG_Stream, kron17_churn_10threads) {
+  run_stream(131072, 1000000000, 10, StreamGenerator::Options().churn(0.3));
+  ASSERT_EQ(num_updates_processed, 1000000000ul * 2);
+}
+TEST(CG_Stream, kron17_bursts_10threads) {
+  run_stream(131072, 1000000000, 10, StreamGenerator::Options().bursts(16));
+  ASSERT_EQ(num_updates_processed, 1000000000ul * 2);
+}
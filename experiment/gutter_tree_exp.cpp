@@ -12,35 +12,23 @@
 static bool shutdown = false;
 static std::atomic<uint64_t> upd_processed;
 
-// queries the buffer tree and verifies that the data
-// returned makes sense
+// queries the buffer tree and counts the updates it returns
 // Should be run in a seperate thread
-void querier(GutterTree *gt) {
-  data_ret_t data;
+static void querier(GutterTree *gt) {
+  WorkQueue::DataNode *data;
   while(true) {
-  bool valid = gt->get_data(data);
-  if (valid) {
-    std::vector<size_t> updates = data.second;
-    // verify that the updates are all between the correct nodes
-    upd_processed += updates.size();
-  }
-  else if(shutdown)
-    return;
+    bool valid = gt->get_data(data);
+    if (valid) {
+      for (const auto &batch : data->get_batches())
+        upd_processed += batch.upd_vec.size();
+      gt->get_data_callback(data);
+    }
+    else if(shutdown)
+      return;
   }
 }
 
-void write_configuration(uint32_t buffer_exp, uint32_t fanout, int queue_factor, 
-                        int page_factor, int num_threads, float gutter_factor) {
-  std::ofstream conf("./buffering.conf");
-  conf << "buffer_exp=" << buffer_exp << std::endl;
-  conf << "branch=" << fanout << std::endl;
-  conf << "queue_factor=" << queue_factor << std::endl;
-  conf << "page_factor=" << page_factor << std::endl;
-  conf << "num_threads=" << num_threads << std::endl;
-  conf << "gutter_factor=" << gutter_factor << std::endl;
-}
-
-void progress(const uint64_t num_updates) {
+static void progress(const uint64_t num_updates) {
   while(true) {
     sleep(5);
     uint64_t cur = upd_processed.load();
@@ -59,16 +47,22 @@ void progress(const uint64_t num_updates) {
 // this test only works if the depth of the tree does not exceed 1
 // and no work is claimed off of the work queue
 // to work correctly num_updates must be a multiple of nodes
-void run_test(const int nodes, const uint64_t num_updates, const uint64_t buffer_exp, 
+static void run_test(const int nodes, const uint64_t num_updates, const uint64_t buffer_exp,
  const int branch_factor, const int threads=1, const int flushers=1, const float gut_factor=1) {
   printf("Running Test: nodes=%i num_updates=%lu buffer_size 2^%lu branch_factor %i\n",
      nodes, num_updates, buffer_exp, branch_factor);
 
-  write_configuration(buffer_exp, branch_factor, 8, 5, flushers, gut_factor); //8=queue_factor, 5=page_factor
+  auto conf = GutteringConfiguration()
+              .buffer_exp(buffer_exp)
+              .fanout(branch_factor)
+              .queue_factor(8)
+              .page_factor(5)
+              .num_flushers(flushers)
+              .gutter_bytes(gut_factor * 32 * KB); // gut_factor times the default gutter
 
   // define the location of the GutterTree here for experiments
   // for our throughput tests we place this upon a fast SSD
-  GutterTree *gt = new GutterTree("/mnt/ssd1/test_", nodes, threads, true);
+  GutterTree *gt = new GutterTree("/mnt/ssd1/test_", nodes, threads, conf, true);
   shutdown = false;
   upd_processed = 0;
 
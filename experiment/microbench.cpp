@@ -0,0 +1,333 @@
+/*
+ * Microbenchmarks of the components of the guttering systems. Each benchmark times one component
+ * in isolation and reports the best of several runs as ns per update and GB/s, both on stdout
+ * and as JSON, so that versions can be compared.
+ *
+ * usage: guttering_microbench [--json FILE] [--filter SUBSTRING] [--scale X] [--repeats N]
+ *                             [--threads T1,T2,...]
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../include/buffer_control_block.h"
+#include "../include/cache_guttering.h"
+#include "../include/gutter_tree.h"
+#include "../include/standalone_gutters.h"
+#include "../include/work_queue.h"
+
+struct BenchResult {
+  std::string name;
+  std::map<std::string, size_t> params;
+  size_t updates; // per run
+  size_t bytes;   // per run
+  double seconds; // the best run
+};
+
+struct BenchOptions {
+  std::string json_file = "microbench.json";
+  std::string filter;
+  double scale = 1;
+  size_t repeats = 3;
+  std::vector<size_t> threads;
+};
+
+static double now() {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// a fixed pseudo random stream of updates to nodes [0, nodes)
+static std::vector<update_t> random_updates(size_t count, gutter_key_t nodes) {
+  std::vector<update_t> upds(count);
+  uint64_t x = 0x9E3779B97F4A7C15ull;
+  for (auto &upd : upds) {
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    upd.first = x % nodes;
+    upd.second = (x >> 32) % nodes;
+  }
+  return upds;
+}
+
+// consumes the batches of a guttering system until stopped
+class Drain {
+ public:
+  Drain(GutteringSystem &gts) : gts(gts), thr([this]() {
+    WorkQueue::DataNode *data;
+    while (true) {
+      if (this->gts.get_data(data))
+        this->gts.get_data_callback(data);
+      else if (done)
+        return;
+    }
+  }) {}
+  ~Drain() {
+    done = true;
+    gts.set_non_block(true);
+    thr.join();
+  }
+ private:
+  GutteringSystem &gts;
+  std::atomic<bool> done{false};
+  std::thread thr;
+};
+
+// keep the compiler from discarding the computation of value
+template <typename T>
+static inline void do_not_optimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class MicroBench {
+ public:
+  MicroBench(BenchOptions opts) : opts(opts) {}
+
+  // time fn, which returns the updates and bytes it processed, opts.repeats times
+  void run(const std::string &name, std::map<std::string, size_t> params,
+           std::function<std::pair<size_t, size_t>(double &seconds)> fn) {
+    std::string full = name;
+    for (auto &param : params) full += " " + param.first + "=" + std::to_string(param.second);
+    if (full.find(opts.filter) == std::string::npos) return;
+
+    BenchResult result{name, params, 0, 0, 1e300};
+    for (size_t r = 0; r < opts.repeats; r++) {
+      double seconds = 0;
+      std::pair<size_t, size_t> work = fn(seconds);
+      result.updates = work.first;
+      result.bytes = work.second;
+      result.seconds = std::min(result.seconds, seconds);
+    }
+    printf("%-60s %10.2f ns/update %8.3f GB/s\n", full.c_str(),
+           result.seconds * 1e9 / result.updates, result.bytes / result.seconds / 1e9);
+    fflush(stdout);
+    results.push_back(result);
+  }
+
+  size_t scaled(size_t count) { return std::max(size_t(count * opts.scale), size_t(1)); }
+
+  void write_json() {
+    std::ofstream out(opts.json_file);
+    out << "{\n  \"context\": {\"key_bytes\": " << sizeof(gutter_key_t)
+        << ", \"value_bytes\": " << sizeof(gutter_value_t)
+        << ", \"hardware_threads\": " << std::thread::hardware_concurrency()
+        << ", \"repeats\": " << opts.repeats << "},\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+      const BenchResult &res = results[i];
+      out << (i ? ",\n" : "\n") << "    {\"name\": \"" << res.name << "\", \"params\": {";
+      bool first = true;
+      for (auto &param : res.params) {
+        out << (first ? "" : ", ") << "\"" << param.first << "\": " << param.second;
+        first = false;
+      }
+      out << "}, \"updates\": " << res.updates << ", \"bytes\": " << res.bytes
+          << ", \"seconds\": " << res.seconds
+          << ", \"ns_per_update\": " << res.seconds * 1e9 / res.updates
+          << ", \"gb_per_sec\": " << res.bytes / res.seconds / 1e9 << "}";
+    }
+    out << "\n  ]\n}\n";
+    printf("Wrote %lu results to %s\n", results.size(), opts.json_file.c_str());
+  }
+
+  BenchOptions opts;
+ private:
+  std::vector<BenchResult> results;
+};
+
+// the partitioning function of the GutterTree
+static void bench_which_child(MicroBench &bench) {
+  const gutter_key_t nodes = 1 << 20;
+  const size_t count = bench.scaled(1 << 24);
+  std::vector<update_t> upds = random_updates(1 << 20, nodes);
+  for (size_t fanout : {16, 64, 512}) {
+    bench.run("which_child", {{"fanout", fanout}}, [&](double &seconds) {
+      uint64_t sum = 0;
+      double start = now();
+      for (size_t i = 0; i < count; i++)
+        sum += GutterTree::which_child(upds[i & (upds.size() - 1)].first, 0, nodes - 1, fanout);
+      seconds = now() - start;
+      do_not_optimize(sum);
+      return std::make_pair(count, count * sizeof(gutter_key_t));
+    });
+  }
+}
+
+// partitioning a root buffer into its children, including the writes of full pages
+static void bench_do_flush(MicroBench &bench) {
+  const gutter_key_t nodes = 1 << 16;
+  std::vector<update_t> upds = random_updates(1 << 20, nodes);
+  for (size_t fanout : {16, 64}) {
+    auto conf = GutteringConfiguration().fanout(fanout).buffer_exp(20).gutter_bytes(8 << 10);
+    GutterTree gt("./microbench_", nodes, 1, conf, true);
+    const size_t runs = bench.scaled(64);
+    bench.run("do_flush", {{"fanout", fanout}}, [&](double &seconds) {
+      double start = now();
+      size_t bytes = gt.flush_root_isolated(upds, runs) * runs;
+      seconds = now() - start;
+      return std::make_pair(bytes / GutterTree::serial_update_size, bytes);
+    });
+  }
+}
+
+// writes of flushed pages to a block below the roots
+static void bench_bcb_write(MicroBench &bench) {
+  const gutter_key_t nodes = 1 << 16;
+  auto conf = GutteringConfiguration().fanout(64).buffer_exp(20).gutter_bytes(8 << 10);
+  GutterTree gt("./microbench_", nodes, 1, conf, true);
+  BufferControlBlock *bcb = gt.buffers[gt.get_fanout()]; // the first block of level 1
+  std::vector<char> page(gt.get_page_size());
+  const size_t writes = bench.scaled(1 << 16);
+  bench.run("BufferControlBlock::write", {{"page_bytes", page.size()}}, [&](double &seconds) {
+    double start = now();
+    for (size_t w = 0; w < writes; w++) {
+      if (bcb->size() + page.size() > gt.get_buffer_size()) bcb->set_size(0);
+      bcb->write(&gt, page.data(), page.size());
+    }
+    seconds = now() - start;
+    bcb->set_size(0);
+    return std::make_pair(writes * page.size() / GutterTree::serial_update_size,
+                          writes * page.size());
+  });
+}
+
+// pushes and peeks of full batches with P producers and C consumers
+static void bench_work_queue(MicroBench &bench) {
+  const size_t batch_elms = 1024;
+  for (size_t producers : bench.opts.threads) {
+    for (size_t consumers : bench.opts.threads) {
+      const size_t pushes = bench.scaled(1 << 16) / producers;
+      bench.run("WorkQueue::push/peek", {{"producers", producers}, {"consumers", consumers}},
+                [&](double &seconds) {
+        WorkQueue wq(8 * consumers, batch_elms, 1);
+        std::atomic<size_t> received{0};
+        std::atomic<bool> done{false};
+        double start = now();
+        std::vector<std::thread> threads;
+        for (size_t c = 0; c < consumers; c++) {
+          threads.emplace_back([&]() {
+            WorkQueue::DataNode *data;
+            while (true) {
+              if (wq.peek(data)) {
+                received += data->get_batches()[0].upd_vec.size();
+                wq.peek_callback(data);
+              }
+              else if (done)
+                return;
+            }
+          });
+        }
+        std::vector<std::thread> producer_threads;
+        for (size_t p = 0; p < producers; p++) {
+          producer_threads.emplace_back([&, p]() {
+            std::vector<update_batch> batches(1);
+            for (size_t i = 0; i < pushes; i++) {
+              batches[0].node_idx = p;
+              batches[0].upd_vec.resize(batch_elms);
+              wq.push(batches);
+            }
+          });
+        }
+        for (auto &thr : producer_threads) thr.join();
+        done = true;
+        wq.set_non_block(true);
+        for (auto &thr : threads) thr.join();
+        seconds = now() - start;
+        return std::make_pair(size_t(received), received * sizeof(gutter_value_t));
+      });
+    }
+  }
+}
+
+// inserts into a guttering system from T threads, not counting the final flush. Gutters are
+// kept small so that a gutter per node fits in memory, and faulted in before timing
+static constexpr size_t insert_gutter_bytes = 4 << 10;
+static GutteringConfiguration insert_conf() {
+  return GutteringConfiguration().gutter_bytes(insert_gutter_bytes).prefault(true)
+                                 .node_id_values(true);
+}
+static void bench_insert(MicroBench &bench, const std::string &name,
+                         std::function<GutteringSystem *(gutter_key_t, size_t)> make) {
+  const gutter_key_t nodes = 1 << 18;
+  std::vector<update_t> upds = random_updates(1 << 20, nodes);
+  for (size_t inserters : bench.opts.threads) {
+    const size_t per_thread = bench.scaled(1 << 24) / inserters;
+    bench.run(name, {{"nodes", nodes}, {"inserters", inserters},
+                     {"gutter_bytes", insert_gutter_bytes}}, [&](double &seconds) {
+      std::unique_ptr<GutteringSystem> gts(make(nodes, inserters));
+      size_t count;
+      {
+        Drain drain(*gts);
+        double start = now();
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < inserters; t++) {
+          threads.emplace_back([&, t]() {
+            for (size_t i = 0; i < per_thread; i++)
+              gts->insert(upds[(i + t * 7919) & (upds.size() - 1)], t);
+          });
+        }
+        for (auto &thr : threads) thr.join();
+        seconds = now() - start;
+        count = per_thread * inserters;
+        gts->force_flush();
+      }
+      return std::make_pair(count, count * sizeof(update_t));
+    });
+  }
+}
+
+static void usage_error(const std::string &msg) {
+  fprintf(stderr, "%s\n", msg.c_str());
+  fprintf(stderr, "usage: guttering_microbench [--json FILE] [--filter SUBSTRING] [--scale X] "
+                  "[--repeats N] [--threads T1,T2,...]\n");
+  exit(EXIT_FAILURE);
+}
+
+static BenchOptions parse_options(int argc, char **argv) {
+  BenchOptions opts;
+  for (int i = 1; i < argc; i += 2) {
+    std::string flag = argv[i];
+    if (i + 1 >= argc) usage_error("missing value for " + flag);
+    std::string value = argv[i + 1];
+    if (flag == "--json") opts.json_file = value;
+    else if (flag == "--filter") opts.filter = value;
+    else if (flag == "--scale") opts.scale = std::stod(value);
+    else if (flag == "--repeats") opts.repeats = std::stoul(value);
+    else if (flag == "--threads") {
+      std::stringstream list(value);
+      std::string thr;
+      while (std::getline(list, thr, ',')) opts.threads.push_back(std::stoul(thr));
+    }
+    else usage_error("unknown option " + flag);
+  }
+  if (opts.threads.empty()) {
+    opts.threads.push_back(1);
+    size_t hw = std::thread::hardware_concurrency();
+    if (hw > 1) opts.threads.push_back(hw);
+  }
+  return opts;
+}
+
+int main(int argc, char **argv) {
+  MicroBench bench(parse_options(argc, argv));
+  bench_which_child(bench);
+  bench_do_flush(bench);
+  bench_bcb_write(bench);
+  bench_work_queue(bench);
+  bench_insert(bench, "CacheGuttering::insert", [](gutter_key_t nodes, size_t inserters) {
+    return new CacheGuttering(nodes, 1, inserters, insert_conf());
+  });
+  bench_insert(bench, "StandAloneGutters::insert", [](gutter_key_t nodes, size_t inserters) {
+    return new StandAloneGutters(nodes, 1, inserters, insert_conf());
+  });
+  bench.write_json();
+  remove("./microbench_gutter_tree_v0.4.data");
+}
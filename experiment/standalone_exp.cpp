@@ -4,6 +4,7 @@
 #include <atomic>
 #include <fstream>
 #include "../include/standalone_gutters.h"
+#include "../include/stream_generator.h"
 
 static bool shutdown = false;
 static constexpr uint32_t prime = 100000007;
@@ -123,6 +124,44 @@ void run_test(const int nodes, const unsigned long updates, const unsigned int n
   delete gutters;
 }
 
+// inserts a synthetic stream from StreamGenerator, both directions of every edge
+void run_stream(const int nodes, const unsigned long updates, const unsigned int nthreads,
+                const StreamGenerator::Options &opts) {
+  shutdown = false;
+  // 40 is num workers
+  StandAloneGutters *gutters = new StandAloneGutters(nodes, 40, nthreads,
+                                                     GutteringConfiguration().queue_factor(2));
+
+  // create queriers
+  std::thread query_threads[40];
+  for (int t = 0; t < 40; t++) {
+    query_threads[t] = std::thread(querier, gutters);
+  }
+
+  StreamGenerator gen(nodes, updates, opts);
+  auto start = std::chrono::steady_clock::now();
+  gen.generate(nthreads, [&](size_t thr, uint64_t, const StreamGenerator::Edge *edges,
+                             size_t count) {
+    std::vector<update_t> run(2 * count);
+    for (size_t j = 0; j < count; j++) {
+      run[2 * j] = {edges[j].src, edges[j].dst};
+      run[2 * j + 1] = {edges[j].dst, edges[j].src};
+    }
+    gutters->insert_updates(run.data(), run.size(), thr);
+  });
+
+  gutters->force_flush();
+  shutdown = true;
+  gutters->set_non_block(true); // switch to non-blocking calls in an effort to exit
+
+  std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+  printf("Insertions took %f seconds: average rate = %f\n", delta.count(), updates/delta.count());
+
+  for (int t = 0; t < 40; t++)
+    query_threads[t].join();
+  delete gutters;
+}
+
 TEST(SA_Throughput, kron15_10threads) {
   run_test(32768, 280025434, 10);
 }
@@ -164,3 +203,17 @@ TEST(SA_Throughput_Rand, kron18_10threads) {
 TEST(SA_Throughput_Rand, kron18_20threads) {
   run_randomized(262144, 17891985703, 20);
 }
+
+// skewed streams from StreamGenerator
+TEST(SA_Stream, kron17_rmat_10threads) {
+  run_stream(131072, 1000000000, 10, StreamGenerator::Options().dist(StreamGenerator::RMAT));
+}
+TEST(SA_Stream, kron17_zipf_10threads) {
+  run_stream(131072, 1000000000, 10, StreamGenerator::Options().dist(StreamGenerator::ZIPF));
+}
+TEST(SA_Stream, kron17_churn_10threads) {
+  run_stream(131072, 1000000000, 10, StreamGenerator::Options().churn(0.3));
+}
+TEST(SA_Stream, kron17_bursts_10threads) {
+  run_stream(131072, 1000000000, 10, StreamGenerator::Options().bursts(16));
+}
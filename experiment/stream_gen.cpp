@@ -0,0 +1,101 @@
+/*
+ * Writes a synthetic graph stream to a binary edge file that EdgeStreamIngestor reads.
+ *
+ * usage: guttering_stream_gen --nodes N --edges M --out FILE [--dist rmat|zipf|uniform]
+ *          [--seed S] [--rmat A,B,C] [--zipf EXPONENT] [--deletes FRACTION] [--window RECORDS]
+ *          [--hubs H] [--burst-period RECORDS] [--burst-fraction F] [--threads T] [--ids 4|8]
+ *          [--stats 1]
+ */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../include/stream_generator.h"
+
+static void usage_error(const std::string &msg) {
+  fprintf(stderr, "%s\n", msg.c_str());
+  fprintf(stderr, "usage: guttering_stream_gen --nodes N --edges M --out FILE "
+                  "[--dist rmat|zipf|uniform] [--seed S] [--rmat A,B,C] [--zipf EXPONENT] "
+                  "[--deletes FRACTION] [--window RECORDS] [--hubs H] [--burst-period RECORDS] "
+                  "[--burst-fraction F] [--threads T] [--ids 4|8] [--stats 1]\n");
+  exit(EXIT_FAILURE);
+}
+
+// print the degree skew of the stream
+static void print_stats(const StreamGenerator &gen, size_t threads) {
+  std::vector<std::atomic<uint64_t>> degree(gen.num_nodes());
+  std::atomic<uint64_t> deletions{0};
+  gen.generate(threads, [&](size_t, uint64_t, const StreamGenerator::Edge *edges, size_t count) {
+    for (size_t j = 0; j < count; j++) {
+      degree[edges[j].src].fetch_add(1, std::memory_order_relaxed);
+      degree[edges[j].dst].fetch_add(1, std::memory_order_relaxed);
+      if (edges[j].deletion) deletions.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+  std::vector<uint64_t> sorted(degree.begin(), degree.end());
+  std::sort(sorted.begin(), sorted.end(), std::greater<uint64_t>());
+  const size_t top = std::max(sorted.size() / 100, size_t(1));
+  uint64_t top_sum = 0;
+  for (size_t i = 0; i < top; i++) top_sum += sorted[i];
+  const size_t touched = sorted.size() - std::count(sorted.begin(), sorted.end(), 0);
+  printf("Deletions = %lu, nodes touched = %lu, max degree = %lu, average degree = %.2f\n",
+         deletions.load(), touched, sorted[0], 2.0 * gen.num_edges() / gen.num_nodes());
+  printf("Top 1%% of nodes hold %.2f%% of the endpoints\n",
+         100.0 * top_sum / (2.0 * gen.num_edges()));
+}
+
+int main(int argc, char **argv) {
+  uint64_t nodes = 0, edges = 0;
+  std::string out;
+  size_t threads = std::thread::hardware_concurrency();
+  size_t id_bytes = 4;
+  bool stats = false;
+  StreamGenerator::Options opts;
+  for (int i = 1; i < argc; i += 2) {
+    const std::string flag = argv[i];
+    if (i + 1 >= argc) usage_error("missing value for " + flag);
+    const std::string value = argv[i + 1];
+    if (flag == "--nodes") nodes = std::stoull(value);
+    else if (flag == "--edges") edges = std::stoull(value);
+    else if (flag == "--out") out = value;
+    else if (flag == "--seed") opts.seed = std::stoull(value);
+    else if (flag == "--threads") threads = std::stoul(value);
+    else if (flag == "--ids") id_bytes = std::stoul(value);
+    else if (flag == "--stats") stats = value != "0";
+    else if (flag == "--zipf") opts.zipf_exponent = std::stod(value);
+    else if (flag == "--deletes") opts.delete_fraction = std::stod(value);
+    else if (flag == "--window") opts.churn_window = std::stoul(value);
+    else if (flag == "--hubs") opts.burst_hubs = std::stoul(value);
+    else if (flag == "--burst-period") opts.burst_period = std::stoul(value);
+    else if (flag == "--burst-fraction") opts.burst_fraction = std::stod(value);
+    else if (flag == "--rmat") {
+      if (sscanf(value.c_str(), "%lf,%lf,%lf", &opts.rmat_a, &opts.rmat_b, &opts.rmat_c) != 3)
+        usage_error("--rmat takes A,B,C");
+    }
+    else if (flag == "--dist") {
+      if (value == "rmat") opts.distribution = StreamGenerator::RMAT;
+      else if (value == "zipf") opts.distribution = StreamGenerator::ZIPF;
+      else if (value == "uniform") opts.distribution = StreamGenerator::UNIFORM;
+      else usage_error("unknown distribution " + value);
+    }
+    else usage_error("unknown option " + flag);
+  }
+  if (nodes == 0 || edges == 0 || out.empty())
+    usage_error("--nodes, --edges and --out are required");
+  if (nodes > std::numeric_limits<gutter_key_t>::max())
+    usage_error("--nodes " + std::to_string(nodes) + " does not fit in a " +
+                std::to_string(8 * sizeof(gutter_key_t)) + " bit gutter_key_t");
+
+  StreamGenerator gen(nodes, edges, opts);
+  double seconds = gen.write_file(out, threads,
+                                  EdgeStreamIngestor::Format::graph_zeppelin().ids(id_bytes));
+  const double bytes = 12 + edges * (1 + 2.0 * id_bytes);
+  printf("Wrote %lu records to %s in %f seconds: %.3f GB/s\n", edges, out.c_str(), seconds,
+         bytes / seconds / 1e9);
+  if (stats) print_stats(gen, threads);
+}
@@ -3,9 +3,12 @@
 #include <string>
 #include <mutex>
 #include <condition_variable>
+#include <type_traits>
 #include "types.h"
 
-typedef uint32_t buffer_id_t;
+// buffer ids only need to be wider than 32 bits when the keys are
+typedef std::conditional<(sizeof(gutter_key_t) > sizeof(uint32_t)), uint64_t, uint32_t>::type
+  buffer_id_t;
 typedef uint64_t File_Pointer;
 
 class GutterTree;
@@ -51,9 +54,12 @@ public:
   buffer_id_t first_child = 0;
   uint16_t children_num = 0;     // and the number of children
 
+  // written since the last force flush, and so in its subtree's dirty list
+  bool dirty = false;
+
   // information about what keys this node will store
-  node_id_t min_key;
-  node_id_t max_key;
+  gutter_key_t min_key;
+  gutter_key_t max_key;
 
   /**
    * Generates metadata and file handle for a new buffer.
@@ -96,8 +102,9 @@ public:
   }
 
   inline void print() {
-    printf("buffer %u: storage_ptr = %lu, offset = %lu, min_key=%u, max_key=%u, first_child=%u, #children=%u\n", 
-      id, storage_ptr, file_offset, min_key, max_key, first_child, children_num);
+    printf("buffer %lu: storage_ptr = %lu, offset = %lu, min_key=%lu, max_key=%lu, first_child=%lu, #children=%u\n", 
+      (uint64_t)id, storage_ptr, file_offset, (uint64_t)min_key, (uint64_t)max_key,
+      (uint64_t)first_child, children_num);
   }
 
   static std::condition_variable buffer_ready;
@@ -6,6 +6,7 @@
 #include <queue>
 #include <atomic>
 #include <thread>
+#include "buffer_control_block.h"
 
 class GutterTree;
 struct flush_struct;
@@ -15,7 +16,7 @@ public:
   static std::condition_variable flush_ready;
   static bool shutdown;
   static bool force_flush;
-  static std::queue<uint32_t> flush_queue;
+  static std::queue<buffer_id_t> flush_queue;
   static std::mutex queue_lock;
 
   BufferFlusher(uint32_t id, GutterTree *gt);
@@ -1,7 +1,11 @@
 #pragma once
 #include "guttering_system.h"
-#include <array>
+#include "cache_info.h"
+#include "write_combining.h"
+#include "hub_gutters.h"
+#include <atomic>
 #include <cassert>
+#include <memory>
 
 // gcc seems to be one of few complilers where log2 is a constexpr 
 // so this is a log2 function that is constexpr (bad performance, only use at compile time)
@@ -15,29 +19,29 @@ constexpr int log2_constexpr(size_t num) {
 class CacheGuttering : public GutteringSystem {
  private:
   size_t inserters;
-  node_id_t num_nodes;
-
-  // TODO: use cmake to establish some compiler constants for these variables
-  // currently these are the values for bigboi
-  static constexpr size_t cache_line     = 64; // number of bytes in a cache_line
-  static constexpr size_t block_size     = 8 * cache_line;
-  static constexpr double buffer_growth_factor = 2;
-
-  // basic 'tree' params
-  static constexpr size_t level1_fanout       = 16;
-  static constexpr size_t level1_bufs         = 8; // number of root buffers. Must be power of 2
-  static constexpr size_t level1_elms_per_buf = level1_fanout * block_size / sizeof(update_t);
-  static constexpr size_t level2_bufs         = level1_bufs * level1_fanout;
-  static constexpr size_t level2_elms_per_buf = level1_elms_per_buf * buffer_growth_factor;
-  static constexpr size_t level3_bufs         = level2_bufs * level1_fanout * buffer_growth_factor;
-  static constexpr size_t level3_elms_per_buf = level2_elms_per_buf * buffer_growth_factor;
-  static constexpr size_t max_level4_bufs     = level3_bufs * level1_fanout * buffer_growth_factor * buffer_growth_factor;
+  gutter_key_t num_nodes;
+
+  // Geometry of the thread local levels, fit to the caches of the machine (see CacheInfo).
+  // Level 1 gutters fill about twice the L1 data cache and level 2 gutters about twice the L2.
+  // Level 3 gutters, which are much larger than any private cache, keep their original
+  // proportions to level 1.
+  static constexpr size_t level1_bufs = 8; // number of root buffers. Must be power of 2
+  static constexpr size_t buffer_growth_factor = 2;
+  const size_t cache_line;                 // number of bytes in a cache_line
+  const size_t block_size;
+  const size_t level1_fanout;
+  const size_t level1_elms_per_buf;
+  const size_t level2_bufs;
+  const size_t level2_elms_per_buf;
+  const size_t level3_bufs;
+  const size_t level3_elms_per_buf;
+  const size_t max_level4_bufs;
 
   // bit length variables
-  static constexpr int level1_bits = log2_constexpr(level1_bufs);
-  static constexpr int level2_bits = log2_constexpr(level2_bufs);
-  static constexpr int level3_bits = log2_constexpr(level3_bufs);
-  static constexpr int level4_bits = log2_constexpr(max_level4_bufs);
+  const int level1_bits;
+  const int level2_bits;
+  const int level3_bits;
+  const int level4_bits;
 
   // bit position variables. Depend upon num_nodes
   const int level1_pos;
@@ -50,52 +54,189 @@ class CacheGuttering : public GutteringSystem {
   size_t level4_elms_per_buf = 0;
 
   // offset for insertion re-labelling
-  node_id_t relabelling_offset = 0;
+  gutter_key_t relabelling_offset = 0;
+
+  // Packed slots. When the configuration declares that values are node ids (node_id_values), a
+  // level whose gutter index implies the high bits of the key stores each update as one
+  // gutter_key_t word: the remaining key bits followed by the value. This doubles the updates
+  // held per cache line. Chosen per level from num_nodes.
+  const int value_bits;        // bits needed to represent a value in [0, num_nodes)
+  gutter_key_t value_mask;
+  bool level1_packed = false;
+  bool level2_packed = false;
+  bool level3_packed = false;
+  bool any_packed = false;
+  size_t level1_slots = level1_elms_per_buf; // updates a level gutter may hold
+  size_t level2_slots = level2_elms_per_buf;
+  size_t level3_slots = level3_elms_per_buf;
+
+  // decide which levels are packed. Packing is only allowed if values are known to fit
+  void set_packing(bool allow);
+
+  // Level 4 gutters are sized to their capacity up front, leaf gutters when they are first
+  // written, so that they may be written with non-temporal stores. num_elms counts the valid
+  // entries. Level 4 buffers are cache line aligned. Leaf buffers are swapped into WorkQueue
+  // batches, so they keep the batches' allocator and only their first line may be partial
+  struct RAM_Gutter {
+    std::vector<update_t, LineAlignedAllocator<update_t>> buffer;
+    size_t num_elms = 0;
+  };
+  struct Leaf_Gutter {
+    std::vector<gutter_value_t> buffer;
+    uint32_t num_elms = 0;
+    bool dirty = false; // in the dirty list of its level 3 range
+  };
 
-  using RAM_Gutter  = std::vector<update_t>;
-  using Leaf_Gutter = std::vector<node_id_t>;
-  template <size_t num_slots>
+  // Software prefetching in the flush loops. While writing update i a loop prefetches the
+  // destination of update i + distance. Distances grow with the latency of the destinations
+  static constexpr size_t level1_prefetch = 4;  // level 1 to level 2, mostly in the L2 cache
+  static constexpr size_t level2_prefetch = 8;  // level 2 to level 3
+  static constexpr size_t leaf_prefetch   = 16; // level 3 and 4 to level 4 and leaf gutters
+  bool prefetch = false;
+
+  // Scatter into level 4 and leaf gutters through write combining buffers and non-temporal
+  // stores, keeping the thread local levels in cache. Enabled when the leaves exceed the LLC.
+  bool stream_writes = false;
+  size_t leaf_wc_slots = 0; // leaves a thread may stage at once
   struct Cache_Gutter {
-    std::array<update_t, num_slots> data;
+    update_t *data;      // slots of this gutter within its level's slab
     size_t num_elms = 0;
-    size_t max_elms = 3*num_slots / 4 + rand() % (num_slots/4);
+    size_t max_elms = 0;
+
+    // view of data as packed words, two per update_t slot
+    gutter_key_t *words() { return reinterpret_cast<gutter_key_t *>(data); }
   };
+
+  // store and load the updates of a level gutter in its packed or unpacked form
+  inline void put(Cache_Gutter &gutter, const update_t &upd, bool packed, int pos);
+  inline update_t get(Cache_Gutter &gutter, size_t i, gutter_key_t idx, bool packed, int pos);
+  // mask that turns a packed word of a parent level into one of a child level at pos
+  inline gutter_key_t repack_mask(int pos);
+  // prefetch the next free slot of a level gutter
+  inline void prefetch_slot(Cache_Gutter &gutter, bool packed);
   struct WQ_Buffer {
     std::vector<update_batch> batches;
     size_t size = 0;
   };
 
+ public:
+  // contention on the level 3 locks
+  struct Level3_Stats {
+    size_t deferred = 0;     // flushes deferred because their lock was held
+    size_t blocked = 0;      // flushes that waited for their lock
+    double wait_seconds = 0; // total time spent waiting
+  };
+ private:
+  static constexpr size_t max_deferred_l3 = 8; // per thread
+
   class InsertThread {
    private:
     CacheGuttering &CGsystem; // reference to associated CacheGuttering system
 
-    // thread local gutters
-    std::array<Cache_Gutter<level1_elms_per_buf>, level1_bufs> level1_gutters;
-    std::array<Cache_Gutter<level2_elms_per_buf>, level2_bufs> level2_gutters;
-    std::array<Cache_Gutter<level3_elms_per_buf>, level3_bufs> level3_gutters;
+    // thread local gutters, each level's gutters share one contiguous slab
+    std::vector<update_t> level1_slab;
+    std::vector<update_t> level2_slab;
+    std::vector<update_t> level3_slab;
+    std::vector<Cache_Gutter> level1_gutters;
+    std::vector<Cache_Gutter> level2_gutters;
+    std::vector<Cache_Gutter> level3_gutters;
 
-   public:
-    InsertThread(CacheGuttering &CGsystem) : CGsystem(CGsystem) {
-      local_wq_buffer.batches.resize(CGsystem.wq_batch_per_elm);
-      for (auto &batch : local_wq_buffer.batches)
-        batch.upd_vec.reserve(CGsystem.leaf_gutter_size);
+    // Partition kernel shared by the level 1, 2 and 3 flushes. One pass over the parent finds
+    // the child of every update and counts the updates per child. Children without room are
+    // flushed, then the updates are copied, and full children are flushed once the parent is
+    // drained
+    struct Partition_Scratch {
+      std::vector<uint16_t> child;  // child of every update, relative to the parent's first
+      std::vector<uint32_t> count;  // number of updates per child
+      uint32_t max_count = 0;
     };
+    Partition_Scratch level1_part; // one per level, the flushes of a level recurse into the next
+    Partition_Scratch level2_part;
+    Partition_Scratch level3_part;
+    void partition(Cache_Gutter &gutter, bool packed, int pos, int child_pos,
+                   Partition_Scratch &part);
+    // partition a level 3 gutter into the level 4 gutters. Returns false, having moved nothing,
+    // if a level 4 gutter could not hold all its updates
+    bool partition_l3(const gutter_key_t idx, Cache_Gutter &l3_gutter);
+
+    // Level 3 flushes whose lock is held by another thread are deferred rather than waited for.
+    // The slots of a deferred gutter are swapped for a spare set, and deferred flushes are
+    // retried after this thread's next successful flush. A thread only blocks once
+    // max_deferred_l3 flushes are pending. Deferral may reorder the updates of a node
+    std::vector<update_t> overflow_slab;                          // backs the spare slots
+    std::vector<update_t *> spare_l3;
+    std::vector<std::pair<gutter_key_t, Cache_Gutter>> deferred_l3;
+
+    // scatter a level 3 gutter into the level 4 or leaf gutters, lock must be held
+    void scatter_l3(const gutter_key_t idx, Cache_Gutter &l3_gutter);
+    // flush the deferred level 3 gutters whose locks are free, or all of them if block
+    void retry_deferred_l3(bool block = false);
+
+    // write combining buffers for leaf and level 4 writes, used if stream_writes
+    WriteCombiningBuffer<gutter_value_t> leaf_wc;
+    WriteCombiningBuffer<update_t> level4_wc;
+
+    // Leaf buffers not in use, taken by a leaf on its first write and returned when it is
+    // emitted. When the pool is empty and the cap is reached a leaf is emitted early: one from
+    // the level 3 range holding key base, whose lock this thread holds, or else from the next
+    // level 3 range after evict_cursor whose lock is free
+    std::vector<std::vector<gutter_value_t>> leaf_pool;
+    gutter_key_t evict_cursor = 0;
+    void acquire_leaf(Leaf_Gutter &leaf, gutter_key_t base);
+    // A clock hand sweeps the dirty list of a level 3 range, whose lock must be held, and the
+    // fullest of the first evict_candidates leaves with data it passes is chosen. At most
+    // evict_scan entries are visited, so an eviction costs the same however large the range
+    static constexpr size_t evict_scan = 64;
+    static constexpr size_t evict_candidates = 4;
+    Leaf_Gutter *evict_candidate(gutter_key_t l3_idx, gutter_key_t &key);
+
+    // write an update to its leaf, pushing the leaf to the work queue once full
+    inline void write_leaf(const update_t &upd, gutter_key_t base);
+    // prefetch the descriptor (ahead == 2) or the next free slot (ahead == 1) of a gutter
+    inline void prefetch_leaf(gutter_key_t key, int ahead);
+    inline void prefetch_level4(gutter_key_t idx, int ahead);
+    // write out the staged updates of a leaf or level 4 gutter
+    void commit_leaf(gutter_key_t key, size_t slot, gutter_key_t base);
+    void commit_level4(gutter_key_t idx, size_t slot);
+    // write out every staged leaf with a key in [base, base + range)
+    void drain_leaves(gutter_key_t base, size_t range);
+
+    // carve a slab into bufs gutters of elms slots each
+    static void init_level(std::vector<update_t> &slab, std::vector<Cache_Gutter> &gutters,
+                           size_t bufs, size_t elms);
+
+   public:
+    // a shared_only thread only flushes the shared levels and has no local levels or write
+    // combining buffers, just its wq buffer and leaf pool
+    InsertThread(CacheGuttering &CGsystem, bool shared_only = false);
 
     // insert an update into the local buffers
     void insert(update_t upd);
 
+    // (re)draw the flush thresholds of the local gutters, must be empty
+    void reset_thresholds();
+
     // functions for flushing local buffers
-    void flush_buf_l1(const node_id_t idx);
-    void flush_buf_l2(const node_id_t idx);
-    void flush_buf_l3(const node_id_t idx);
-    void flush_buf_l4(const node_id_t idx);
+    void flush_buf_l1(const gutter_key_t idx);
+    void flush_buf_l2(const gutter_key_t idx);
+    void flush_buf_l3(const gutter_key_t idx);
+    void flush_buf_l4(const gutter_key_t idx);
     void flush_all(); // flush entire structure
-    void wq_push_helper(node_id_t node_idx, Leaf_Gutter &leaf);
+    void flush_range(gutter_key_t lo, gutter_key_t hi); // flush the local gutters of [lo, hi]
+    void release_leaf_pool(); // free the pooled leaf buffers
+    void flush_level3_range(const gutter_key_t idx); // flush the level 4 and leaves below idx
+    inline void mark_dirty(gutter_key_t key, Leaf_Gutter &leaf);
+    void wq_push_helper(gutter_key_t node_idx, Leaf_Gutter &leaf);
     void flush_wq_buf();
 
+    // bytes of the thread local levels and buffers
+    size_t memory_bytes();
+
     // Buffer for performing batch push to work queue
     WQ_Buffer local_wq_buffer;
 
+    Level3_Stats level3_stats;
+
     // no copying for you
     InsertThread(const InsertThread &) = delete;
     InsertThread &operator=(const InsertThread &) = delete;
@@ -111,36 +252,103 @@ class CacheGuttering : public GutteringSystem {
   RAM_Gutter *level4_gutters = nullptr; // additional RAM layer if necessary
   Leaf_Gutter *leaf_gutters;          // final layer that holds node gutters
 
+  // the leaves of each level 3 range that were written since the last force_flush(), guarded by
+  // the range's level 3 flush lock
+  std::vector<std::vector<gutter_key_t>> dirty_leaves;
+  std::vector<size_t> evict_hands; // the clock hand of each dirty list, for evict_candidate()
+  std::atomic<size_t> leaf_buffers{0}; // leaf buffers allocated, in use or pooled
+
+  // count a new leaf buffer against leaf_cap. Returns false if the cap is reached
+  bool reserve_leaf_buffer();
+  // leaf_pool_bytes, lowered to what the memory budget leaves for the leaves. 0 for no cap
+  size_t leaf_cap;
+
+  // Adaptive leaf sizing, if adaptive_leaf_bytes is set. Each group of 2^leaf_group_bits nodes
+  // has a budget of leaf_slots_avg slots per node. Once a group has emitted a few budgets worth
+  // of updates, the thread that crossed the mark splits the budget among the group's leaves in
+  // proportion to the square root of their recent update counts, which minimizes the number of
+  // batches for that memory. A new capacity applies from a leaf's next buffer. The statistics
+  // are approximate, so they are relaxed atomics rather than guarded by the level 3 locks
+  static constexpr int leaf_group_bits = 12;
+  size_t leaf_slots_avg; // average leaf capacity, leaf_gutter_size if fixed
+  std::unique_ptr<std::atomic<uint32_t>[]> leaf_capacity; // per node, null if fixed
+  std::unique_ptr<std::atomic<uint32_t>[]> leaf_updates;  // per node, halved at each rebalance
+  std::unique_ptr<std::atomic<size_t>[]> group_emitted;   // per group, since its rebalance
+  void count_emitted(gutter_key_t key, size_t num_elms);
+  void rebalance_leaves(gutter_key_t group);
+  size_t leaf_slots(gutter_key_t key) {
+    return leaf_capacity ? leaf_capacity[key].load(std::memory_order_relaxed) : leaf_gutter_size;
+  }
+  size_t leaf_bytes() { return leaf_slots_avg * sizeof(gutter_value_t); } // average
+
   friend class InsertThread;
 
   std::vector<InsertThread> insert_threads; // vector of InsertThreads
+  std::unique_ptr<InsertThread> async_flusher; // shared_only, flushes for flush_async()
+  std::vector<HubGutters> hubs;                // per inserter, if hub_gutters is set
+
+  // flush the local levels of an InsertThread down to the shared levels
+  void hand_off(size_t thr);
+  // flush the level 4 gutters and the leaves written since the last flush
+  void flush_shared();
+  // the memory the system holds with leaf_bytes_total bytes of leaf buffers
+  MemoryUsage memory_plan(size_t leaf_bytes_total);
  public:
+
   /**
    * Constructs a new guttering systems using a tree like structure for cache efficiency.
    * @param nodes       number of nodes in the graph.
    * @param workers     the number of workers which will be removing batches
    * @param inserters   the number of inserter buffers
+   * @param conf        the configuration of the guttering system
+   * @param caches      the caches to fit the thread local gutters to. Detected if not given
+   * @throw MemoryBudgetError if the system does not fit the memory budget with a leaf buffer
+   *        per inserter.
    */
-  CacheGuttering(node_id_t nodes, uint32_t workers, uint32_t inserters,
-                 GutteringConfiguration conf);
-  CacheGuttering(node_id_t nodes, uint32_t workers, uint32_t inserters) : 
+  CacheGuttering(gutter_key_t nodes, uint32_t workers, uint32_t inserters,
+                 GutteringConfiguration conf, const CacheInfo &caches);
+  CacheGuttering(gutter_key_t nodes, uint32_t workers, uint32_t inserters,
+                 GutteringConfiguration conf) :
+    CacheGuttering(nodes, workers, inserters, conf, CacheInfo::detect()) {};
+  CacheGuttering(gutter_key_t nodes, uint32_t workers, uint32_t inserters) : 
     CacheGuttering(nodes, workers, inserters, GutteringConfiguration()) {};
 
   ~CacheGuttering();
 
   /**
    * Puts an update into the data structure.
-   * @param upd the edge update.1
+   * @throw std::out_of_range if slots are packed (node_id_values) and upd.second is not a node id.
+   * @param upd the edge update.
    * @param which, which thread is inserting this update
    * @return nothing.
    */
   insert_ret_t insert(const update_t &upd, size_t which) { 
     assert(which < inserters);
+    check_epoch(which);
+    if (hub_gutters > 0 && hubs[which].insert(upd, wq)) return;
     insert_threads[which].insert(upd);
   }
   
   // pure virtual functions don't like default params, so default to 'which' of 0
-  insert_ret_t insert(const update_t &upd) { insert_threads[0].insert(upd); }
+  insert_ret_t insert(const update_t &upd) {
+    check_epoch(0);
+    if (hub_gutters > 0 && hubs[0].insert(upd, wq)) return;
+    insert_threads[0].insert(upd);
+  }
+
+  size_t num_inserters() const { return inserters; }
+  gutter_key_t first_node() const { return relabelling_offset; }
+
+  // insert a run of updates, checking the flush epoch once
+  insert_ret_t insert_updates(const update_t *upds, size_t count, size_t which) {
+    assert(which < inserters);
+    check_epoch(which);
+    InsertThread &thr = insert_threads[which];
+    for (size_t i = 0; i < count; i++) {
+      if (hub_gutters > 0 && hubs[which].insert(upds[i], wq)) continue;
+      thr.insert(upds[i]);
+    }
+  }
 
   /**
    * Flushes all pending buffers. When this function returns there are no more updates in the
@@ -149,20 +357,53 @@ class CacheGuttering : public GutteringSystem {
    */
   flush_ret_t force_flush();
 
+  /**
+   * Flushes the updates of the nodes in [lo, hi] from the level 1 to 4 gutters that cover them
+   * and from their leaf gutters. Node ids are given as to insert(). Call while no insertions are
+   * in progress.
+   * @return nothing.
+   */
+  flush_ret_t flush_nodes(gutter_key_t lo, gutter_key_t hi);
+
   /**
    * Set the "offset" for incoming edges. That is, if we set an offset of x, an incoming edge
    * {i,j} will be stored internally as an edge {i - x, j}. Use only for integration with
    * distributed guttering. If you don't know what that means, don't use this function!
+   * Must be called before any insertions.
    * 
    * @param offset 
    * @return a reference to the parent CacheGuttering object.
    */
-  CacheGuttering& set_offset(node_id_t offset) { relabelling_offset = offset; return *this; }
+  CacheGuttering& set_offset(gutter_key_t offset) {
+    relabelling_offset = offset;
+    set_packing(false); // values may be global ids beyond num_nodes, even at offset 0
+    return *this;
+  }
+
+  /**
+   * Contention on the level 3 locks summed over all inserters. Call while no insertions are in
+   * progress, for example after force_flush().
+   * @return the level 3 lock statistics.
+   */
+  Level3_Stats get_level3_stats();
+
+  // bytes of leaf gutter buffers allocated so far
+  size_t leaf_buffer_bytes() { return leaf_buffers * leaf_bytes(); }
+
+  MemoryUsage memory_usage();
+
+  /**
+   * Enable or disable software prefetching in the flush loops. Disabled by default, compare
+   * with the CG_Prefetch experiments on the target machine.
+   * @param enabled whether to prefetch.
+   * @return a reference to the parent CacheGuttering object.
+   */
+  CacheGuttering& set_prefetch(bool enabled) { prefetch = enabled; return *this; }
 
   /*
    * Helper function for tracing a root to leaf path. Prints path to stdout
    * @param src   the node id to trace
    */
-  void print_r_to_l(node_id_t src);
+  void print_r_to_l(gutter_key_t src);
   void print_fanouts();
 };
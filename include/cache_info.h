@@ -0,0 +1,20 @@
+#pragma once
+#include <cstddef>
+
+/*
+ * Sizes of the data caches of the machine, used to fit the thread local gutters of
+ * CacheGuttering to the caches. The defaults are the machine the original geometry was tuned for.
+ */
+struct CacheInfo {
+  size_t line_size = 64;               // bytes in a cache line
+  size_t l1d_size  = 32 * 1024;        // per core level 1 data cache
+  size_t l2_size   = 1024 * 1024;      // per core level 2 cache
+  size_t l3_size   = 32 * 1024 * 1024; // last level cache
+
+  /*
+   * Detects the caches of cpu0. Reads sysfs on Linux and falls back to sysconf, then to the
+   * defaults for any size that cannot be found.
+   * @return the detected cache sizes.
+   */
+  static CacheInfo detect();
+};
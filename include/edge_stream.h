@@ -0,0 +1,104 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "guttering_system.h"
+
+/*
+ * Reads a binary file of edge updates and inserts them into a guttering system from several
+ * threads. The records after the file's header are split into one contiguous range per thread,
+ * and each thread inserts its range as inserter t with insert_updates(), in runs that stay
+ * cache resident. Threads either read their range with double buffered pread() calls, the next
+ * block being read while the current one is parsed, or parse a read only mapping of the file.
+ *
+ * A record is an optional flag byte, 0 for an insertion and 1 for a deletion, followed by the
+ * two endpoints of the edge in native byte order. Guttering does not tell insertions from
+ * deletions, both toggle the edge in a sketch, so the flag is only counted.
+ */
+class EdgeStreamIngestor {
+ public:
+  struct Format {
+    size_t header_bytes = 0; // bytes skipped at the start of the file
+    size_t id_bytes = 4;     // bytes per endpoint, 4 or 8
+    bool flag_byte = false;  // each record starts with an insert/delete byte
+    bool both_directions = true; // an edge (u, v) updates both u and v, else only u
+    bool node_count = false; // the header starts with the graph's 4 byte node count
+
+    Format &header(size_t bytes) { header_bytes = bytes; return *this; }
+    Format &ids(size_t bytes) { id_bytes = bytes; return *this; }
+    Format &flags(bool flag) { flag_byte = flag; return *this; }
+    Format &directed(bool one_direction) { both_directions = !one_direction; return *this; }
+    Format &counted(bool has_count) { node_count = has_count; return *this; }
+    size_t record_bytes() const { return (flag_byte ? 1 : 0) + 2 * id_bytes; }
+
+    // a 4 byte node count and an 8 byte edge count, then flagged records of 4 byte ids
+    static Format graph_zeppelin() {
+      return Format().header(12).ids(4).flags(true).counted(true);
+    }
+  };
+
+  // parses count records into a run of updates, returning the updates and counting deletions.
+  // Throws std::runtime_error on an endpoint outside [first, first + nodes)
+  using Parser = size_t (*)(const char *data, size_t count, update_t *run, size_t &deletions,
+                            uint64_t first, uint64_t nodes);
+
+  struct Stats {
+    size_t bytes = 0;     // record bytes read
+    size_t edges = 0;
+    size_t deletions = 0; // records flagged as deletions
+    size_t updates = 0;   // updates inserted
+    double seconds = 0;
+    double gb_per_sec() const { return seconds > 0 ? bytes / seconds / 1e9 : 0; }
+  };
+
+  /**
+   * Opens an edge file.
+   * @param path      the file.
+   * @param format    the layout of the file.
+   * @throw std::runtime_error if the file cannot be opened, is not a whole number of records or
+   *                            is too short for its node count.
+   */
+  EdgeStreamIngestor(const std::string &path, Format format);
+  EdgeStreamIngestor(const std::string &path) : EdgeStreamIngestor(path, Format()) {};
+  ~EdgeStreamIngestor();
+
+  /**
+   * Inserts every edge of the file. Thread t inserts as inserter t, so the system needs at least
+   * threads inserters. Endpoints must be nodes of the system.
+   * @param gts       the guttering system.
+   * @param threads   the number of inserting threads.
+   * @param use_mmap  parse a mapping of the file instead of reading it.
+   * @return what was read and how fast.
+   * @throw std::runtime_error if a read fails, the system has fewer inserters than threads or
+   *                            fewer nodes than the header's node count, or an endpoint is not a
+   *                            node of the system. Edges before the bad one may be inserted.
+   */
+  Stats ingest(GutteringSystem &gts, size_t threads, bool use_mmap = false);
+
+  size_t num_edges() const { return records; }
+  // the node count of the header, 0 if the format has none
+  uint64_t num_nodes() const { return header_nodes; }
+
+  // no copying for you
+  EdgeStreamIngestor(const EdgeStreamIngestor &) = delete;
+  EdgeStreamIngestor &operator=(const EdgeStreamIngestor &) = delete;
+
+ private:
+  static constexpr size_t block_bytes = 4 << 20; // bytes per read, rounded down to records
+  static constexpr size_t run_edges = 1024;      // edges per insert_updates() call
+
+  const std::string path;
+  const Format format;
+  Parser parse;
+  int fd = -1;
+  size_t records = 0;
+  uint64_t header_nodes = 0;
+
+  // insert the records [first, first + count) as inserter thr
+  void read_range(GutteringSystem &gts, size_t thr, size_t first, size_t count, Stats &stats);
+  void map_range(GutteringSystem &gts, size_t thr, const char *data, size_t count,
+                 Stats &stats);
+  // parse count records and insert them in runs of run_edges
+  void insert_records(GutteringSystem &gts, size_t thr, const char *data, size_t count,
+                      update_t *run, Stats &stats);
+};
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <limits>
 #include <mutex>
 #include <math.h>
 #include "types.h"
@@ -26,6 +27,7 @@ private:
 
   // memory for flushing
   flush_struct *flush_data;
+  flush_struct *async_flush_data = nullptr; // for flush_async(), allocated on first use
 
   /*
    * Functions for flushing the roots of our subtrees and for the BufferFlushers to call.
@@ -46,17 +48,28 @@ private:
    * @param level       the level of the buffer being flushed (0 is root)
    * @returns nothing
    */
-  flush_ret_t do_flush(flush_struct &flush_from, uint32_t size, uint32_t begin, 
-    node_id_t min_key, node_id_t max_key, uint16_t options, uint8_t level);
+  flush_ret_t do_flush(flush_struct &flush_from, uint32_t size, buffer_id_t begin, 
+    gutter_key_t min_key, gutter_key_t max_key, uint16_t options, uint8_t level);
 
-  void mem_to_wq(node_id_t node_idx, char *mem_addr, uint32_t size);
+  void mem_to_wq(gutter_key_t node_idx, char *mem_addr, uint32_t size);
+
+  // flush every subtree. Inserts go straight to the locked roots, so there is nothing to hand
+  // off and the subtrees are flushed while inserts continue
+  void flush_shared();
+
+  // flush the children of a block that hold keys in [lo, hi], and then their children
+  void flush_path(BufferControlBlock *bcb, gutter_key_t lo, gutter_key_t hi);
+
+  // the memory the tree holds with the given numbers of blocks and flush structs. The buffers
+  // of the non-root blocks are on disk
+  MemoryUsage memory_plan(size_t blocks, size_t flush_structs);
 
   /*
    * Variables which track universal information about the buffer tree which
    * we would like to be accesible to all the bufferControlBlocks
    */
   uint8_t  max_level;    // max depth of the tree
-  uint32_t num_nodes;    // number of unique ids to buffer
+  gutter_key_t num_nodes; // number of unique ids to buffer
   uint64_t backing_EOF;  // file to write tree to
   uint64_t leaf_size;    // size of a leaf buffer
 
@@ -68,6 +81,10 @@ private:
   // Buffer Flusher threads
   BufferFlusher **flushers;
 
+  // for each root, the blocks of each level of its subtree that were written since the last
+  // force flush. Guarded by the root's flush lock
+  std::vector<std::vector<std::vector<buffer_id_t>>> dirty_bcbs;
+
 public:
   /**
    * Generates a new homebrew buffer tree.
@@ -79,10 +96,11 @@ public:
    * @param conf    (optional) defines the configuration for the gutter tree to pull from
    * 
    * @throw GTFileOpenError if the backing file cannot be opened.
+   * @throw MemoryBudgetError if the tree does not fit the memory budget.
    */
-  GutterTree(std::string dir, node_id_t nodes, int workers, GutteringConfiguration conf, 
+  GutterTree(std::string dir, gutter_key_t nodes, int workers, GutteringConfiguration conf, 
     bool reset=false);
-  GutterTree(std::string dir, node_id_t nodes, int workers, bool reset=false) :
+  GutterTree(std::string dir, gutter_key_t nodes, int workers, bool reset=false) :
     GutterTree(dir, nodes, workers, GutteringConfiguration(), reset) {};
   ~GutterTree();
 
@@ -92,6 +110,8 @@ public:
    * @return nothing.
    */
   insert_ret_t insert(const update_t &upd);
+  // inserts lock the root they write to, so any number of threads may insert
+  size_t num_inserters() const { return std::numeric_limits<size_t>::max(); }
 
   /**
    * Flushes the entire tree down to the leaves.
@@ -99,6 +119,14 @@ public:
    */
   flush_ret_t force_flush();
 
+  /**
+   * Flushes the root to leaf paths of the nodes in [lo, hi] down to the leaves.
+   * @return nothing.
+   */
+  flush_ret_t flush_nodes(gutter_key_t lo, gutter_key_t hi);
+
+  MemoryUsage memory_usage();
+
   /**
    * Functions for flushing bcbs or subtrees of the graph
    * @param flush_from      The memory to use when flushing - associated with a given thread
@@ -109,11 +137,29 @@ public:
   flush_ret_t flush_subtree(flush_struct &flush_from, BufferControlBlock *bcb);
   flush_ret_t flush_control_block(flush_struct &flush_from, BufferControlBlock *bcb);
 
+  /*
+   * Add a non-root block to its subtree's dirty list. Called by the block on its first write
+   * since the last force flush, while the root's flush lock is held
+   * @param bcb   the block that was written
+   */
+  void mark_dirty(BufferControlBlock *bcb);
+
   /*
    * Access the maximum number of updates per gutter added to the work queue
    */
   int upds_per_gutter() { return (leaf_size + page_size) / serial_update_size; }
 
+  /*
+   * Testing hook, times do_flush() in isolation. Fill the first root's buffer with upds, keys
+   * mapped into the root's range, and flush it into its children runs times, emptying the
+   * children between runs so that only the root is partitioned. Call on an idle tree, the
+   * updates are lost.
+   * @param upds    the updates, repeated to fill the buffer.
+   * @param runs    the number of flushes.
+   * @return the bytes flushed per run.
+   */
+  size_t flush_root_isolated(const std::vector<update_t> &upds, size_t runs);
+
   /*
    * Function to convert an update_t to a char array
    * @param   dst the memory location to put the serialized data
@@ -143,7 +189,31 @@ public:
    * @param location data to pull from
    * @return the key pulled from the data
    */
-  static node_id_t load_key(char *location);
+  static gutter_key_t load_key(char *location);
+
+  /*
+   * Determine which child of a block holds a key
+   * The first (total % options) children hold one more key than the rest
+   * @param key       the key
+   * @param min_key   the smallest key of the block
+   * @param max_key   the largest key of the block
+   * @param options   the number of children of the block
+   * @return the index of the child among the block's children
+   */
+  static inline uint32_t which_child(gutter_key_t key, gutter_key_t min_key,
+                                     gutter_key_t max_key, uint16_t options) {
+    gutter_key_t total = max_key - min_key + 1;
+    gutter_key_t div   = total / options;
+
+    uint32_t larger_kids      = total % options;
+    gutter_key_t larger_count = larger_kids * (div + 1);
+    gutter_key_t idx = key - min_key;
+
+    if (idx >= larger_count)
+      return ((idx - larger_count) / div) + larger_kids;
+    else
+      return idx / (div + 1);
+  }
 
   /*
    * Creates the entire buffer tree to produce a tree of depth log_B(N)
@@ -162,14 +232,13 @@ public:
   inline uint32_t get_buffer_size()  { return buffer_size; };
   inline uint64_t get_leaf_size()    { return leaf_size; };
   inline uint32_t get_fanout()       { return fanout; };
-  inline uint32_t get_num_nodes()    { return num_nodes; };
   inline uint64_t get_file_size()    { return backing_EOF; };
   inline uint32_t get_queue_factor() { return queue_factor; };
 
   inline int get_fd()       { return backing_store; };
   inline char * get_cache() { return cache; };
 
-  static const uint32_t serial_update_size = sizeof(node_id_t) + sizeof(node_id_t); // size in bytes of an update
+  static const uint32_t serial_update_size = sizeof(gutter_key_t) + sizeof(gutter_value_t); // size in bytes of an update
 };
 
 struct flush_struct {
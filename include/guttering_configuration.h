@@ -3,6 +3,8 @@
 #include <iostream>
 #include <string>
 
+#include "work_queue.h"
+
 // forward declaration
 class GutteringSystem;
 
@@ -29,6 +31,34 @@ private:
   // number of batches placed into or removed from the queue in one push or peek operation
   size_t _wq_batch_per_elm = uninit_param;
 
+  // if and where the destinations of each batch are sorted (a BatchSortMode)
+  size_t _batch_sort = uninit_param;
+
+  // number of threads sorting batches when sorting is deferred
+  size_t _sort_threads = uninit_param;
+
+  // StandAloneGutters stages each inserter's updates in 2^bits radix buckets, 0 for per node
+  size_t _local_radix_bits = uninit_param;
+
+  // cap on the memory of CacheGuttering's leaf gutter buffers, 0 for no cap
+  size_t _leaf_pool_bytes = uninit_param;
+
+  // average size of CacheGuttering's leaf gutters in bytes when each leaf is sized by its update
+  // rate, 0 for leaves of gutter_bytes
+  size_t _adaptive_leaf_bytes = uninit_param;
+
+  // cap on the memory of the guttering system in bytes, 0 for no cap
+  size_t _memory_budget = uninit_param;
+
+  // if memory should be faulted in when the guttering system is constructed
+  size_t _prefault = uninit_param;
+
+  // number of heavy hitter nodes given gutters of their own per inserter, 0 for none
+  size_t _hub_gutters = uninit_param;
+
+  // if every value is a node id below num_nodes, which lets CacheGuttering pack its slots
+  size_t _node_id_values = uninit_param;
+
   friend class GutteringSystem;
 
 public:
@@ -43,6 +73,15 @@ public:
   GutteringConfiguration& num_flushers(size_t num_flushers);
   GutteringConfiguration& gutter_bytes(size_t gutter_bytes);
   GutteringConfiguration& wq_batch_per_elm(size_t wq_batch_per_elm);
+  GutteringConfiguration& batch_sort(BatchSortMode batch_sort);
+  GutteringConfiguration& sort_threads(size_t sort_threads);
+  GutteringConfiguration& local_radix_bits(size_t local_radix_bits);
+  GutteringConfiguration& leaf_pool_bytes(size_t leaf_pool_bytes);
+  GutteringConfiguration& adaptive_leaf_bytes(size_t adaptive_leaf_bytes);
+  GutteringConfiguration& memory_budget(size_t memory_budget);
+  GutteringConfiguration& prefault(bool prefault);
+  GutteringConfiguration& hub_gutters(size_t hub_gutters);
+  GutteringConfiguration& node_id_values(bool node_id_values);
 
   // getters
   size_t get_page_size()        { return _page_size; }
@@ -52,6 +91,15 @@ public:
   size_t get_num_flushers()     { return _num_flushers; }
   size_t get_gutter_bytes()     { return _gutter_bytes; }
   size_t get_wq_batch_per_elm() { return _wq_batch_per_elm; }
+  BatchSortMode get_batch_sort(){ return (BatchSortMode) _batch_sort; }
+  size_t get_sort_threads()     { return _sort_threads; }
+  size_t get_local_radix_bits() { return _local_radix_bits; }
+  size_t get_leaf_pool_bytes()  { return _leaf_pool_bytes; }
+  size_t get_adaptive_leaf_bytes() { return _adaptive_leaf_bytes; }
+  size_t get_memory_budget()    { return _memory_budget; }
+  bool get_prefault()           { return _prefault; }
+  size_t get_hub_gutters()      { return _hub_gutters; }
+  bool get_node_id_values()     { return _node_id_values; }
 
   friend std::ostream& operator<<(std::ostream& out, GutteringConfiguration conf);
 
@@ -1,15 +1,56 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
 
 #include "guttering_configuration.h"
 #include "types.h"
 #include "work_queue.h"
+#include "shm_work_queue.h"
+
+// Bytes of memory held by a guttering system, by component
+struct MemoryUsage {
+  size_t work_queue = 0; // batches preallocated by the work queue
+  size_t gutters    = 0; // per node buffers: gutters, leaf gutters, or the GutterTree root cache
+  size_t local      = 0; // per inserter buffers: local stages, cache levels, and hub gutters
+  size_t internal   = 0; // the rest: level 4 gutters, flush buffers, and per node metadata
+  size_t total() const { return work_queue + gutters + local + internal; }
+};
+
+inline std::ostream& operator<<(std::ostream& out, const MemoryUsage &usage) {
+  out << "work queue " << usage.work_queue << ", gutters " << usage.gutters << ", local "
+      << usage.local << ", internal " << usage.internal << ", total " << usage.total()
+      << " bytes";
+  return out;
+}
+
+class MemoryBudgetError : public std::exception {
+private:
+  const std::string message;
+
+public:
+  MemoryBudgetError(std::string message) :
+    message(message) {}
+
+  virtual const char *what() const throw() {
+    return message.c_str();
+  }
+};
 
 class GutteringSystem {
  public:
   // Constructor for programmatic configuration
-  GutteringSystem(node_id_t num_nodes, int workers, GutteringConfiguration conf,
+  GutteringSystem(gutter_key_t num_nodes, int workers, GutteringConfiguration conf,
                   bool page_slots = false)
       : page_size((conf.set_defaults())._page_size),  // set defaults first to default init params
         buffer_size(conf._buffer_size),
@@ -17,11 +58,18 @@ class GutteringSystem {
         num_flushers(conf._num_flushers),
         queue_factor(conf._queue_factor),
         wq_batch_per_elm(conf._wq_batch_per_elm),
+        local_radix_bits(conf._local_radix_bits),
+        leaf_pool_bytes(conf._leaf_pool_bytes),
+        adaptive_leaf_bytes(conf._adaptive_leaf_bytes),
+        prefault(conf._prefault),
+        hub_gutters(conf._hub_gutters),
+        node_id_values(conf._node_id_values),
+        memory_budget(conf._memory_budget),
         num_nodes(num_nodes),
-        leaf_gutter_size(conf._gutter_bytes / sizeof(node_id_t)),
+        leaf_gutter_size(conf._gutter_bytes / sizeof(gutter_value_t)),
         wq(workers * queue_factor,
-           page_slots ? leaf_gutter_size + page_size / sizeof(node_id_t) : leaf_gutter_size,
-           wq_batch_per_elm) {
+           page_slots ? leaf_gutter_size + page_size / sizeof(gutter_value_t) : leaf_gutter_size,
+           wq_batch_per_elm, (BatchSortMode) conf._batch_sort, conf._sort_threads) {
     std::cout << conf << std::endl;
   }
   virtual ~GutteringSystem(){};
@@ -34,16 +82,91 @@ class GutteringSystem {
     (void)(thr);
   }
 
+  /*
+   * Insert a run of updates from one inserter. Systems override this to pay their per call
+   * costs once per run rather than once per update.
+   * @param upds    the updates.
+   * @param count   the number of updates.
+   * @param thr     the inserter.
+   */
+  virtual insert_ret_t insert_updates(const update_t *upds, size_t count, size_t thr) {
+    for (size_t i = 0; i < count; i++) insert(upds[i], thr);
+  }
+
   // force all data out of buffers
   virtual flush_ret_t force_flush() = 0;
 
+  /*
+   * Force the updates of the nodes in [lo, hi] out of the buffers, taking only the buffers on
+   * their paths. Other updates in those buffers move down with them. Call while no insertions
+   * are in progress, like force_flush().
+   * @param lo  the first node to flush.
+   * @param hi  the last node to flush.
+   */
+  virtual flush_ret_t flush_nodes(gutter_key_t lo, gutter_key_t hi) = 0;
+
+  /*
+   * The memory held by the guttering system, by component. Buffers that are allocated on
+   * demand, like CacheGuttering's leaves, count as they are allocated.
+   */
+  virtual MemoryUsage memory_usage() = 0;
+
+  /*
+   * Start a flush of every update inserted before the call and return without waiting for it.
+   * Inserts may continue during the flush and are left for the next one. Each inserter hands
+   * its thread local buffers to the flush at its next insert, so an inserter that stops
+   * inserting must call pause_inserter() or the flush waits for it. Flushes run one at a time,
+   * do not call force_flush() until the returned future is ready.
+   * @return a future that is ready once the updates are in the work queue.
+   */
+  std::future<void> flush_async() {
+    const uint64_t epoch = flush_epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+    return std::async(std::launch::async, [this, epoch]() {
+      std::lock_guard<std::mutex> flush_lk(async_flush_lock);
+      {
+        std::unique_lock<std::mutex> lk(epoch_lock);
+        epoch_joined.wait(lk, [&]() {
+          for (size_t i = 0; i < num_inserter_epochs; i++) {
+            uint64_t seen = inserter_epochs[i].seen.load(std::memory_order_acquire);
+            if (seen != inserter_paused && seen < epoch) return false;
+          }
+          return true;
+        });
+      }
+      flush_shared();
+    });
+  }
+
+  /*
+   * Hand the thread local buffers of an inserter to the guttering system and let asynchronous
+   * flushes proceed without it until its next insert. Called by the inserter.
+   * @param thr   the inserter that is pausing.
+   */
+  void pause_inserter(size_t thr) {
+    if (thr >= num_inserter_epochs) return;
+    hand_off(thr);
+    std::lock_guard<std::mutex> lk(epoch_lock);
+    inserter_epochs[thr].seen.store(inserter_paused, std::memory_order_release);
+    epoch_joined.notify_all();
+  }
+
   // get the size of a work queue elmement in bytes
-  size_t gutter_size() { return leaf_gutter_size * sizeof(node_id_t); }
+  size_t gutter_size() { return leaf_gutter_size * sizeof(gutter_value_t); }
+
+  // the system holds the nodes first_node() to first_node() + get_num_nodes() - 1
+  gutter_key_t get_num_nodes() const { return num_nodes; }
+  virtual gutter_key_t first_node() const { return 0; }
+  // the number of threads that may insert at once, thread t passing t to insert(upd, thr)
+  virtual size_t num_inserters() const { return 1; }
 
   // get data out of the guttering system either one gutter at a time or in a batched fashion
   bool get_data(WorkQueue::DataNode *&data) { return wq.peek(data); }
   void get_data_callback(WorkQueue::DataNode *data) { wq.peek_callback(data); }
   void set_non_block(bool block) { wq.set_non_block(block); }  // set non-blocking calls in wq
+
+  // hand every batch to a shared memory work queue for consumers in other processes, rather
+  // than to get_data(). Call before the first insert
+  void set_shm_queue(ShmWorkQueue &queue) { wq.set_sink(&queue); }
  protected:
   // parameters of the GutteringSystem, defined by the GutteringConfiguration param or config file
   const size_t page_size;         // guttertree -- write granularity
@@ -52,8 +175,98 @@ class GutteringSystem {
   const size_t num_flushers;      // guttertree -- the number of flush threads
   const size_t queue_factor;      // total number of batches in queue is this factor * num_workers
   const size_t wq_batch_per_elm;  // number of batches each queue element holds
+  const size_t local_radix_bits;  // standalone -- radix bits of the local stage, 0 for per node
+  const size_t leaf_pool_bytes;   // cacheguttering -- cap on leaf gutter memory, 0 for none
+  const size_t adaptive_leaf_bytes; // cacheguttering -- average adaptive leaf size, 0 for fixed
+  const bool prefault;            // fault in memory at construction rather than on first insert
+  const size_t hub_gutters;       // standalone, cacheguttering -- heavy hitters per inserter
+  const bool node_id_values;      // cacheguttering -- values are node ids, so slots may be packed
+  const size_t memory_budget;     // cap on the memory of the system, 0 for none
 
-  const node_id_t num_nodes;
-  const node_id_t leaf_gutter_size;
+  const gutter_key_t num_nodes;
+  const size_t leaf_gutter_size;
   WorkQueue wq;
+
+  // Epochs of flush_async(). Every call starts a new flush epoch. An inserter records the last
+  // epoch it joined, by handing off its thread local buffers, and a flush of an epoch waits
+  // until every inserter has joined it or is paused. Inserters start paused.
+  static constexpr uint64_t inserter_paused = (uint64_t) -1;
+  struct InserterEpoch {
+    std::atomic<uint64_t> seen{inserter_paused};
+    char pad[64 - sizeof(std::atomic<uint64_t>)]; // keep inserters off each other's cache lines
+  };
+  std::atomic<uint64_t> flush_epoch{0};
+  std::unique_ptr<InserterEpoch[]> inserter_epochs;
+  size_t num_inserter_epochs = 0;
+  std::mutex epoch_lock;                    // guards joining an epoch against a waiting flush
+  std::condition_variable epoch_joined;
+  std::mutex async_flush_lock;              // one asynchronous flush at a time
+
+  /*
+   * Fail fast if a system would need more memory than the budget. Called by the constructors
+   * before their large allocations.
+   * @param usage   the memory the system needs.
+   * @throw MemoryBudgetError if usage exceeds memory_budget.
+   */
+  void check_memory_budget(const std::string &system, const MemoryUsage &usage) {
+    if (memory_budget == 0 || usage.total() <= memory_budget) return;
+    std::ostringstream msg;
+    msg << system << " needs more than the memory budget of " << memory_budget
+        << " bytes: " << usage;
+    throw MemoryBudgetError(msg.str());
+  }
+
+  // track the epochs of the given number of inserters, called by systems with local buffers
+  void init_inserter_epochs(size_t inserters) {
+    inserter_epochs.reset(new InserterEpoch[inserters]);
+    num_inserter_epochs = inserters;
+  }
+
+  // join the current flush epoch if the inserter has not. Called at the start of an insert
+  inline void check_epoch(size_t thr) {
+    if (inserter_epochs[thr].seen.load(std::memory_order_relaxed) !=
+        flush_epoch.load(std::memory_order_relaxed))
+      join_epoch(thr);
+  }
+  void join_epoch(size_t thr) {
+    const uint64_t epoch = flush_epoch.load(std::memory_order_acquire);
+    hand_off(thr);
+    std::lock_guard<std::mutex> lk(epoch_lock);
+    inserter_epochs[thr].seen.store(epoch, std::memory_order_release);
+    epoch_joined.notify_all();
+  }
+
+  // move the thread local buffers of an inserter into the shared buffers. Called by the inserter
+  virtual void hand_off(size_t thr) { (void) thr; }
+
+  // Push the data of the shared buffers to the work queue while inserts continue. Called by
+  // flush_async() once every inserter has handed off its thread local buffers
+  virtual void flush_shared() = 0;
+
+  /*
+   * Run body(lo, hi) over disjoint ranges covering [0, n), one per available core. Used to
+   * build per node structures at construction. Small n runs on the calling thread.
+   */
+  template <class Body>
+  static void parallel_init(size_t n, Body body, size_t min_per_thread = 1 << 14) {
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+    threads = std::max(std::min(threads, n / min_per_thread), size_t(1));
+    if (threads == 1) {
+      body(size_t(0), n);
+      return;
+    }
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++)
+      pool.emplace_back(body, n * t / threads, n * (t + 1) / threads);
+    body(size_t(0), n / threads);
+    for (auto &thr : pool) thr.join();
+  }
+
+  // touch every page of [data, data + bytes) so that the pages are mapped before first use
+  static void prefault_pages(void *data, size_t bytes) {
+    static const size_t os_page = sysconf(_SC_PAGE_SIZE);
+    volatile char *ptr = static_cast<char *>(data);
+    for (size_t off = 0; off < bytes; off += os_page)
+      ptr[off] = ptr[off];
+  }
 };
@@ -0,0 +1,96 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "types.h"
+#include "work_queue.h"
+
+/*
+ * Heavy hitter detection for one inserter, and gutters dedicated to the heavy hitters (hubs).
+ * A count-min sketch over a sample of the inserts estimates how often each node is updated.
+ * A node that receives at least 1 / 2^hub_share_bits of the updates becomes a hub, up to
+ * max_hubs at a time. The updates of a hub go to a gutter of its own that is pushed straight to
+ * the work queue once full, so hubs skip the shared buffers that every inserter contends on.
+ * Every window the sketch decays, and hubs whose share fell below the threshold are flushed and
+ * dropped.
+ */
+class HubGutters {
+ private:
+  static constexpr size_t sample_period  = 16;      // sample one in this many inserts on average
+  static constexpr int    sketch_bits    = 12;      // 2^bits counters per row
+  static constexpr size_t sketch_width   = size_t(1) << sketch_bits;
+  static constexpr size_t sketch_depth   = 2;
+  static constexpr size_t window         = 1 << 16; // samples between reevaluations
+  static constexpr int    hub_share_bits = 10;      // hubs take 1/1024 of the updates or more
+  static constexpr uint32_t no_hub = UINT32_MAX;
+
+  struct Hub {
+    gutter_key_t key;
+    std::vector<gutter_value_t> buffer;
+    size_t hits = 0; // inserts in this window
+  };
+  // hubs are found through a direct mapped table indexed by the low bits of the key, so that a
+  // node that is not a hub costs one lookup. Two hubs may not share a slot
+  struct Slot {
+    gutter_key_t key = 0;
+    uint32_t hub = no_hub;
+  };
+
+  const size_t max_hubs;
+  const size_t gutter_elms;
+  std::vector<Hub> hubs;
+  std::vector<Slot> slots;
+  size_t slot_mask;
+  std::vector<uint16_t> sketch; // sketch_depth rows of sketch_width counters
+  size_t until_sample = sample_period;
+  uint64_t rng_state = 0x2545F4914F6CDD1Dull; // the gaps between samples are random so that
+                                              // periodic streams are not sampled in step
+  size_t samples = 0;           // in this window
+  std::vector<update_batch> batch_vec;
+
+  // count a sampled key and promote it if it is frequent enough
+  void sample(gutter_key_t key);
+  // decay the sketch and drop the hubs that fell below the threshold
+  void end_window(WorkQueue &wq);
+  // push a hub's buffer to the work queue
+  void push(Hub &hub, WorkQueue &wq);
+  void remove(size_t idx, WorkQueue &wq);
+
+ public:
+  /**
+   * @param max_hubs      the maximum number of hubs at a time.
+   * @param gutter_elms   the capacity of a hub gutter, at most the work queue's batch size.
+   */
+  HubGutters(size_t max_hubs, size_t gutter_elms);
+
+  /**
+   * Append the update to its hub gutter if its key is a hub, otherwise sample it.
+   * @return true if the update was taken.
+   */
+  inline bool insert(const update_t &upd, WorkQueue &wq) {
+    const Slot &slot = slots[upd.first & slot_mask];
+    if (slot.hub != no_hub && slot.key == upd.first) {
+      Hub &hub = hubs[slot.hub];
+      hub.buffer.push_back(upd.second);
+      ++hub.hits;
+      if (hub.buffer.size() == gutter_elms) push(hub, wq);
+      return true;
+    }
+    if (--until_sample == 0) {
+      sample(upd.first);
+      if (samples == window) end_window(wq);
+    }
+    return false;
+  }
+
+  // push every hub gutter holding data to the work queue
+  void flush(WorkQueue &wq);
+  // push the gutters of the hubs in [lo, hi] to the work queue
+  void flush_range(gutter_key_t lo, gutter_key_t hi, WorkQueue &wq);
+
+  // the nodes that are currently hubs
+  std::vector<gutter_key_t> get_hubs();
+
+  // a bound on the bytes held by one inserter's hub gutters
+  static size_t memory_bytes(size_t max_hubs, size_t gutter_elms);
+};
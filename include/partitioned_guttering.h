@@ -0,0 +1,148 @@
+#pragma once
+#include <sys/types.h>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include "guttering_system.h"
+
+/*
+ * Router front end that partitions a stream across guttering systems in worker processes on
+ * this host. The nodes are split into contiguous ranges, one per partition, and each partition
+ * runs its own guttering system in a forked worker process together with the threads that
+ * consume its batches. The router ships updates to the workers over shared memory rings of page
+ * sized blocks, one single producer single consumer ring per worker. A worker that dies takes
+ * only its partition down: the router marks the partition failed and drops its updates.
+ *
+ * Workers are forked by the constructor, so construct the router before starting any threads.
+ * insert(), force_flush() and finish() must be called from a single thread.
+ */
+class PartitionedGuttering {
+ public:
+  // builds the guttering system of a partition in its worker process. The system takes the
+  // global ids of the nodes [first, first + nodes), for example a CacheGuttering with
+  // set_offset(first)
+  using SystemFactory = std::function<GutteringSystem *(gutter_key_t first, gutter_key_t nodes)>;
+  // called by the consumer threads of a worker process for every batch of its system
+  using BatchConsumer = std::function<void(const update_batch &batch)>;
+
+  // a factory of CacheGuttering systems with a single inserter and the partition's offset
+  static SystemFactory cache_guttering(uint32_t workers,
+                                       GutteringConfiguration conf = GutteringConfiguration());
+
+  /**
+   * Forks a worker process per partition.
+   * @param num_nodes     number of nodes in the graph.
+   * @param partitions    the number of worker processes, at most num_nodes.
+   * @param make_system   builds the guttering system of a partition, called in its worker.
+   * @param consume       consumes the batches of a partition, called in its worker.
+   * @param consumers     the number of consumer threads per worker.
+   * @param ring_blocks   the number of blocks in each ring.
+   * @throw std::runtime_error if the rings cannot be mapped or the workers cannot be forked.
+   */
+  PartitionedGuttering(gutter_key_t num_nodes, size_t partitions, SystemFactory make_system,
+                       BatchConsumer consume, size_t consumers = 1, size_t ring_blocks = 64);
+  ~PartitionedGuttering();
+
+  // route an update to the ring of its partition
+  inline void insert(const update_t &upd) {
+    Partition &part = parts[partition_of(upd.first)];
+    if (part.slots == nullptr && !open_block(part)) {
+      ++dropped;
+      return;
+    }
+    part.slots[part.count++] = upd;
+    if (part.count == block_slots) publish(part);
+  }
+
+  /**
+   * Ships every pending block and waits until each worker has force flushed its guttering
+   * system, so that every update inserted so far is in a worker's work queue.
+   * @return nothing.
+   */
+  flush_ret_t force_flush();
+
+  /**
+   * Ends the stream. Each worker flushes its guttering system, waits for its consumers to drain
+   * the work queue and exits. Called by the destructor if not called before.
+   * @return the number of partitions whose worker failed.
+   */
+  size_t finish();
+
+  // the partitions whose worker died or exited with an error
+  std::vector<size_t> failed_partitions();
+
+  // updates dropped because their partition had failed
+  size_t dropped_updates() { return dropped; }
+
+  size_t partition_of(gutter_key_t key) { return key / part_nodes; }
+  size_t num_partitions() { return parts.size(); }
+
+  // no copying for you
+  PartitionedGuttering(const PartitionedGuttering &) = delete;
+  PartitionedGuttering &operator=(const PartitionedGuttering &) = delete;
+
+ private:
+  enum BlockKind : uint32_t { DATA, FLUSH, END };
+  struct BlockHeader {
+    uint32_t kind;
+    uint32_t count; // updates following the header
+  };
+
+  // Head of a ring in shared memory, followed by ring_blocks blocks. The router publishes
+  // blocks by advancing head and the worker frees them by advancing tail
+  struct Ring {
+    std::atomic<uint64_t> head{0};
+    char pad0[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> tail{0};
+    char pad1[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> flushed{0}; // FLUSH blocks the worker has completed
+  };
+
+  struct Partition {
+    gutter_key_t first;
+    gutter_key_t nodes;
+    Ring *ring = nullptr;     // start of the shared mapping
+    char *blocks = nullptr;
+    pid_t pid = -1;
+    uint64_t head = 0;        // the router's copy of ring->head
+    update_t *slots = nullptr; // the open block, if any
+    size_t count = 0;         // updates in the open block
+    uint64_t flushes = 0;     // FLUSH blocks sent
+    bool failed = false;
+    bool exited = false;
+  };
+
+  const size_t ring_blocks;
+  size_t block_bytes;   // a page
+  size_t block_slots;   // updates per block
+  size_t ring_bytes;    // the shared mapping of a ring
+  gutter_key_t part_nodes;
+  std::vector<Partition> parts;
+  SystemFactory make_system;
+  BatchConsumer consume;
+  const size_t consumers;
+  const pid_t router_pid;
+  size_t dropped = 0;
+  bool finished = false;
+
+  BlockHeader *block(const Partition &part, uint64_t idx) {
+    return reinterpret_cast<BlockHeader *>(part.blocks + (idx % ring_blocks) * block_bytes);
+  }
+
+  // wait for a free block and open it. Returns false if the partition failed
+  bool open_block(Partition &part);
+  // publish the open block to the worker
+  void publish(Partition &part);
+  // publish the open block, if any, then a control block. Returns false if the partition failed
+  bool send_control(Partition &part, BlockKind kind);
+  // check on the worker of a partition, marking it failed if it exited. Returns true if alive
+  bool alive(Partition &part);
+  // wait for the worker to exit and record how it did
+  void reap(Partition &part);
+  // unmap the shared ring of every partition that has one
+  void unmap_rings();
+
+  // the main loop of a worker process, never returns
+  void run_worker(Partition &part);
+};
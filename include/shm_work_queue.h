@@ -0,0 +1,152 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "types.h"
+#include "work_queue.h"
+
+// thrown when attaching to a segment whose creator has not finished setting it up. Retry
+class ShmNotReady : public std::runtime_error {
+ public:
+  explicit ShmNotReady(const std::string &message) : std::runtime_error(message) {}
+};
+
+/*
+ * A work queue in a named POSIX shared memory segment, so that the consumers of a guttering
+ * system may be other processes, even in another language runtime. Consumers read the values of
+ * a batch in place, without copies. The producer copies each batch into a slot once.
+ *
+ * The segment is laid out as follows, at offsets from its start:
+ *   Header                 0
+ *   free ring cells        cells_offset,                          num_slots Cells
+ *   ready ring cells       cells_offset + num_slots * sizeof(Cell), num_slots Cells
+ *   slots                  slots_offset, num_slots slots of slot_bytes each. A slot is a
+ *                          SlotHeader followed by up to slot_values values
+ * Both rings are bounded multi producer multi consumer queues of slot indices (Vyukov). A cell
+ * holds a sequence number and a slot index. Pushing at position pos waits for seq == pos, writes
+ * the index and stores seq = pos + 1. Popping at pos waits for seq == pos + 1, reads the index
+ * and stores seq = pos + num_slots. Producers pop a slot from the free ring, fill it and push it
+ * to the ready ring. Consumers pop from the ready ring and push the slot back to the free ring
+ * once they are done with it. Indices and sequence numbers are 64 bit integers and every atomic
+ * is lock free, so the layout may be read from any language with shared memory atomics.
+ */
+class ShmWorkQueue {
+ public:
+  static constexpr uint64_t magic_number = 0x3151574D48535447ull; // "GTSHMWQ1"
+  static constexpr uint32_t layout_version = 2;
+
+  struct RingHead {
+    std::atomic<uint64_t> enqueue_pos{0};
+    char pad0[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> dequeue_pos{0};
+    char pad1[64 - sizeof(std::atomic<uint64_t>)];
+  };
+  struct Header {
+    std::atomic<uint64_t> magic{0}; // written last by the creator
+    uint32_t version;
+    uint32_t key_bytes;   // sizeof(gutter_key_t)
+    uint32_t value_bytes; // sizeof(gutter_value_t)
+    uint32_t creator_pid; // the process that created the segment, written first
+    uint64_t num_slots;   // a power of 2
+    uint64_t slot_values; // the largest batch a slot holds
+    uint64_t slot_bytes;
+    uint64_t cells_offset;
+    uint64_t slots_offset;
+    std::atomic<uint32_t> closed{0}; // set by the producer once no more batches will come
+    char pad1[64 - sizeof(std::atomic<uint32_t>)];
+    RingHead free_ring;
+    RingHead ready_ring;
+  };
+  struct Cell {
+    std::atomic<uint64_t> seq;
+    uint64_t slot;
+  };
+  struct SlotHeader {
+    uint64_t node_idx;
+    uint64_t count;
+  };
+
+  // a batch in the shared segment, valid until it is passed to peek_callback()
+  struct Batch {
+    gutter_key_t node_idx;
+    const gutter_value_t *values;
+    size_t count;
+    uint64_t slot;
+  };
+
+  /**
+   * Creates the named segment. A segment of the same name is replaced only if it is stale, left
+   * behind by a creator process that no longer runs. The creator removes the name when it is
+   * destroyed.
+   * @param name          the name of the segment, for example "/gutters".
+   * @param num_slots     the number of batches the queue holds, rounded up to a power of 2.
+   * @param slot_values   the largest batch, at least the guttering system's batch size.
+   * @throw std::runtime_error if the segment cannot be created or is in use.
+   */
+  ShmWorkQueue(const std::string &name, size_t num_slots, size_t slot_values);
+
+  /**
+   * Attaches to a segment created by another process.
+   * @param name          the name the creator was given.
+   * @throw ShmNotReady if the creator has not finished setting up the segment.
+   * @throw std::runtime_error if there is no such segment, its layout does not match or its
+   *                           rings and slots do not fit in it.
+   */
+  ShmWorkQueue(const std::string &name);
+  ~ShmWorkQueue();
+
+  /*
+   * Copy the non-empty batches into slots, waiting for free slots if the queue is full. The
+   * vectors are cleared. Safe to call from many threads. Batches are delivered unsorted
+   * @param upd_vec_batch  the batches to push.
+   * @throw WriteTooBig if a batch does not fit in a slot.
+   */
+  void push(std::vector<update_batch> &upd_vec_batch);
+
+  // tell the consumers that no more batches will come. Called by the producer
+  void close();
+
+  /*
+   * Take a batch from the queue, waiting until one is ready
+   * @param batch   where to place the batch.
+   * @return true if there was a batch, false if the queue is closed and empty, or empty and
+   *         this process set non-blocking peeks.
+   */
+  bool peek(Batch &batch);
+
+  // return the slot of a batch to the producers
+  void peek_callback(const Batch &batch);
+
+  // set non-blocking peeks in this process
+  void set_non_block(bool block) { non_block = block; }
+
+  size_t num_slots() { return header->num_slots; }
+  size_t slot_values() { return header->slot_values; }
+
+  // no copying for you
+  ShmWorkQueue(const ShmWorkQueue &) = delete;
+  ShmWorkQueue &operator=(const ShmWorkQueue &) = delete;
+
+ private:
+  const std::string name;
+  const bool creator;
+  size_t segment_bytes = 0;
+  char *segment = nullptr;
+  Header *header = nullptr;
+  Cell *free_cells = nullptr;
+  Cell *ready_cells = nullptr;
+  std::atomic<bool> non_block{false};
+
+  SlotHeader *slot(uint64_t idx) {
+    return reinterpret_cast<SlotHeader *>(segment + header->slots_offset +
+                                          idx * header->slot_bytes);
+  }
+  // push or pop a slot index, false if the ring is full or empty
+  bool enqueue(RingHead &ring, Cell *cells, uint64_t value);
+  bool dequeue(RingHead &ring, Cell *cells, uint64_t &value);
+  // map the segment of the open descriptor fd
+  void map(int fd, size_t bytes);
+};
@@ -1,33 +1,117 @@
 #pragma once
+#include <atomic>
+#include <memory>
+
 #include "work_queue.h"
 #include "types.h"
 #include "guttering_system.h"
+#include "hub_gutters.h"
 
 /**
  * In-memory wrapper to offer the same interface as a buffer tree.
  */
 class StandAloneGutters : public GutteringSystem {
 private:
-  struct Gutter { 
-    std::mutex mux;
-    std::vector<node_id_t> buffer;
+  // A fixed capacity gutter appended to without locks. Inserters reserve slots by adding to
+  // reserved and publish them by adding to committed. The inserter that commits the last slot
+  // swaps the full buffer for its spare, reopens the gutter, and then pushes the full buffer.
+  // Inserters that find the gutter full wait for it to reopen.
+  struct Gutter {
+    std::atomic<uint32_t> reserved{0};  // slots handed out, at least leaf_gutter_size when full
+    std::atomic<uint32_t> committed{0}; // slots written
+    gutter_value_t *buffer = nullptr;   // leaf_gutter_size slots
+  };
+  // a buffer to swap into a completed gutter and the batch that carries it to the work queue.
+  // The push counts let flush_async() wait for the pushes of gutters completed before it
+  struct Spare {
+    gutter_value_t *buffer;
+    std::vector<update_batch> batch_vec;
+    std::atomic<uint64_t> pushes_begun{0};
+    std::atomic<uint64_t> pushes_done{0};
   };
   static constexpr uint8_t local_buf_size = 8;
   struct LocalGutter {
 		uint8_t count = 0;
-    node_id_t buffer[local_buf_size];
+    gutter_value_t buffer[local_buf_size];
+  };
+  // With local_radix_bits set, each inserter stages its updates in a fixed number of buckets
+  // chosen by the high bits of the key instead of one LocalGutter per node. The stage takes
+  // radix_stage_bytes no matter the number of nodes and stays cache resident.
+  static constexpr size_t radix_stage_bytes = 256 * 1024;
+  static constexpr size_t gutter_prefetch = 8; // updates ahead to prefetch when moving a bucket
+  static constexpr size_t budget_radix_bits = 8; // used if local gutters exceed memory_budget
+  struct RadixStage {
+    std::vector<update_t> slots;  // bucket_size slots per bucket
+    std::vector<uint32_t> counts;
   };
   uint32_t buffer_size; // size of a buffer (including metadata)
   std::vector<Gutter> gutters; // gutters containing updates
   const uint32_t inserters;
+  std::unique_ptr<gutter_value_t[]> slab; // the gutter and spare buffers, mapped on first touch
+  std::vector<Spare> spares; // one per inserter or force_flush thread, the last for flush_async
+
+  // Nodes that may hold data, so that force_flush() skips the rest. A gutter's bit is set by
+  // the first write after it is emptied, and a local gutter's bit when it takes its first value.
+  // Bits are cleared by force_flush().
+  std::vector<std::atomic<uint64_t>> dirty_gutters;
+  std::vector<std::vector<uint64_t>> dirty_local; // per inserter
   std::vector<std::vector<LocalGutter>> local_buffers; // array dump of numbers for performance:
-  
+  std::vector<RadixStage> radix_stages;                // per inserter, replaces local_buffers
+  std::vector<HubGutters> hubs;                        // per inserter, if hub_gutters is set
+  size_t radix_bits = 0; // local_radix_bits, or budget_radix_bits to fit memory_budget
+  int radix_shift = 0;
+  size_t bucket_size = 0;
+
   /**
-   * Puts an update into the data structure from the local buffer. Must hold both buffer locks
-   * @param upd the edge update.
+   * Puts an update into the data structure from the local buffer.
+   * @param which     the inserter whose local buffer to empty.
+   * @param gutterid  the node of the local buffer.
+   * @param spare     the spare of the calling thread.
    * @return nothing.
    */
-  insert_ret_t insert_batch(size_t which, node_id_t gutterid);
+  insert_ret_t insert_batch(size_t which, gutter_key_t gutterid, Spare &spare);
+  // insert an update once the flush epoch has been checked
+  inline void insert_unchecked(const update_t &upd, size_t which);
+
+  /**
+   * Appends values to a gutter. If the calling thread fills the gutter it swaps in its spare
+   * buffer and pushes the full buffer to the work queue.
+   * @param gutterid  the gutter to append to.
+   * @param values    the values to append.
+   * @param count     the number of values.
+   * @param spare     the spare of the calling thread.
+   */
+  void append(gutter_key_t gutterid, const gutter_value_t *values, size_t count, Spare &spare);
+
+  // call f(node) for every node whose bit is set and clear the bits
+  template <class Bitmap, class F>
+  static void for_each_dirty(Bitmap &bitmap, size_t word, F f);
+
+  // prefetch the next free slot of a gutter for writing
+  inline void prefetch_slot(gutter_key_t gutterid);
+
+  // push count values of a gutter's buffer to the work queue
+  void push_buffer(gutter_key_t gutterid, const gutter_value_t *buffer, size_t count,
+                   Spare &spare);
+
+  /**
+   * Moves a bucket of a radix stage into the gutters. The updates are grouped by node so that
+   * the updates of a node are appended together.
+   * @param stage   the radix stage of the calling inserter.
+   * @param bucket  the bucket to empty.
+   * @param spare   the spare of the calling inserter.
+   */
+  void flush_bucket(RadixStage &stage, size_t bucket, Spare &spare);
+
+  // move the local gutters or radix stage of an inserter into the gutters
+  void hand_off(size_t which);
+
+  // push the data of a gutter to the work queue while other threads may append to it
+  void drain_gutter(gutter_key_t gutterid, Spare &spare);
+  void flush_shared();
+
+  // the memory the system holds with the given radix stage bits, 0 for per node local gutters
+  MemoryUsage memory_plan(size_t radix_bits);
 
  public:
   /**
@@ -35,10 +119,11 @@ private:
    * @param nodes       number of nodes in the graph.
    * @param workers     the number of workers which will be removing batches
    * @param inserters   the number of inserter buffers
+   * @throw MemoryBudgetError if the gutters do not fit the memory budget.
    */
-  StandAloneGutters(node_id_t nodes, uint32_t workers, uint32_t inserters,
+  StandAloneGutters(gutter_key_t nodes, uint32_t workers, uint32_t inserters,
                     GutteringConfiguration conf);
-  StandAloneGutters(node_id_t nodes, uint32_t workers, uint32_t inserters)
+  StandAloneGutters(gutter_key_t nodes, uint32_t workers, uint32_t inserters)
       : StandAloneGutters(nodes, workers, inserters, GutteringConfiguration()){};
 
   /**
@@ -49,10 +134,22 @@ private:
   insert_ret_t insert(const update_t &upd, size_t which);
   // pure virtual functions don't like default params
   insert_ret_t insert(const update_t &upd);
+  // insert a run of updates, checking the flush epoch once
+  insert_ret_t insert_updates(const update_t *upds, size_t count, size_t which);
+  size_t num_inserters() const { return inserters; }
 
   /**
    * Flushes all pending buffers.
    * @return nothing.
    */
   flush_ret_t force_flush();
+
+  /**
+   * Flushes the local gutters and gutters of the nodes in [lo, hi]. In radix stage mode the
+   * buckets holding those nodes are moved into the gutters whole.
+   * @return nothing.
+   */
+  flush_ret_t flush_nodes(gutter_key_t lo, gutter_key_t hi);
+
+  MemoryUsage memory_usage();
 };
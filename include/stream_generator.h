@@ -0,0 +1,133 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "edge_stream.h"
+#include "types.h"
+
+/*
+ * Reproducible synthetic graph streams with realistic skew. Every record of a stream is a pure
+ * function of the seed and its index, so a stream is the same no matter how many threads
+ * generate it or in what order.
+ *
+ * Edges are drawn from one of three distributions:
+ *   UNIFORM  both endpoints uniform over the nodes.
+ *   RMAT     Kronecker / R-MAT edges. Each of the log2(nodes) levels picks a quadrant of the
+ *            adjacency matrix with probabilities a, b, c and 1 - a - b - c.
+ *   ZIPF     both endpoints drawn from a Zipf distribution over node ranks, giving power law
+ *            degrees.
+ * Node ids are scrambled by a fixed permutation so that heavy nodes are not all small ids.
+ *
+ * Two effects may be layered on top:
+ *   churn    a fraction of the records delete an edge inserted earlier. The stream is cut into
+ *            windows of records, and each deletion removes a distinct insertion of the previous
+ *            window, so a deleted edge is always present.
+ *   bursts   the stream is cut into epochs, and in each epoch one of burst_hubs hub nodes takes
+ *            part in a burst_fraction of the insertions.
+ */
+class StreamGenerator {
+ public:
+  enum Distribution { UNIFORM, RMAT, ZIPF };
+
+  struct Options {
+    Distribution distribution = RMAT;
+    uint64_t seed = 1;
+    double rmat_a = 0.57; // the Graph500 R-MAT parameters
+    double rmat_b = 0.19;
+    double rmat_c = 0.19;
+    double zipf_exponent = 1.0;
+    double delete_fraction = 0; // at most 0.5
+    size_t churn_window = 1 << 16; // records, rounded up to a power of 2
+    size_t burst_hubs = 0;         // 0 for no bursts
+    size_t burst_period = 1 << 20; // records per epoch
+    double burst_fraction = 0.5;   // insertions of an epoch that touch its hub
+
+    Options &dist(Distribution d) { distribution = d; return *this; }
+    Options &seeded(uint64_t s) { seed = s; return *this; }
+    Options &rmat(double a, double b, double c) {
+      rmat_a = a; rmat_b = b; rmat_c = c; return *this;
+    }
+    Options &zipf(double exponent) { zipf_exponent = exponent; return *this; }
+    Options &churn(double fraction, size_t window = 1 << 16) {
+      delete_fraction = fraction; churn_window = window; return *this;
+    }
+    Options &bursts(size_t hubs, size_t period = 1 << 20, double fraction = 0.5) {
+      burst_hubs = hubs; burst_period = period; burst_fraction = fraction; return *this;
+    }
+  };
+
+  struct Edge {
+    gutter_key_t src;
+    gutter_key_t dst;
+    bool deletion;
+  };
+
+  // called with the edges [first, first + count) of the stream, by generating thread thr
+  using Consumer = std::function<void(size_t thr, uint64_t first, const Edge *edges,
+                                      size_t count)>;
+
+  /**
+   * @param num_nodes   the number of nodes, at least 2.
+   * @param num_edges   the number of records in the stream.
+   * @param opts        the shape of the stream.
+   * @throw std::invalid_argument if the options are out of range.
+   */
+  StreamGenerator(gutter_key_t num_nodes, uint64_t num_edges, Options opts);
+  StreamGenerator(gutter_key_t num_nodes, uint64_t num_edges)
+      : StreamGenerator(num_nodes, num_edges, Options()) {};
+
+  // the record at index i
+  Edge edge(uint64_t i) const;
+
+  /*
+   * Generate the stream from several threads. Thread t generates a contiguous range of records
+   * in chunks and passes each chunk to consume.
+   * @param threads   the number of generating threads.
+   * @param consume   receives the chunks. Called concurrently by different threads.
+   */
+  void generate(size_t threads, const Consumer &consume) const;
+
+  /*
+   * Write the stream to a binary edge file that EdgeStreamIngestor reads. The header, if any,
+   * is GraphZeppelin's: a 4 byte node count and an 8 byte record count.
+   * @param path      the file.
+   * @param threads   the number of generating threads.
+   * @param format    the layout, with a header of 0 or 12 bytes.
+   * @return the seconds the write took.
+   * @throw std::runtime_error if the file cannot be written.
+   */
+  double write_file(const std::string &path, size_t threads,
+                    EdgeStreamIngestor::Format format) const;
+  double write_file(const std::string &path, size_t threads) const {
+    return write_file(path, threads, EdgeStreamIngestor::Format::graph_zeppelin());
+  }
+
+  gutter_key_t num_nodes() const { return nodes; }
+  uint64_t num_edges() const { return edges; }
+
+ private:
+  static constexpr size_t chunk_edges = 4096;
+
+  const gutter_key_t nodes;
+  const uint64_t edges;
+  const Options opts;
+  uint32_t scale;          // log2 of the R-MAT matrix side
+  uint64_t perm_mult;      // node id permutation: rank -> (rank * perm_mult + perm_add) % nodes
+  uint64_t perm_add;
+  uint64_t churn_mask;     // window - 1
+  uint64_t churn_deletes;  // deletions per window
+  // constants of the Zipf rejection inversion sampler
+  double zipf_h_x1, zipf_h_n, zipf_s;
+
+  gutter_key_t permute(uint64_t rank) const;
+  // the insertion at index i, before churn
+  Edge base_edge(uint64_t i) const;
+  // the position of a record in the shuffled order of its churn window, and its inverse
+  uint64_t churn_slot(uint64_t window, uint64_t pos) const;
+  uint64_t churn_pos(uint64_t window, uint64_t slot) const;
+
+  double zipf_h(double x) const;
+  double zipf_h_integral(double x) const;
+  double zipf_h_integral_inverse(double x) const;
+};
@@ -1,8 +1,34 @@
 #pragma once
 #include <utility>
 #include <vector>
+#include <type_traits>
 #include <graph_zeppelin_common.h>
 
-typedef std::pair<node_id_t, node_id_t> update_t;
+// The guttering systems group updates by their key and deliver their values to consumers.
+// By default both are node ids, the key is the source and the value the destination of an edge.
+// Other types may be selected at compile time (see GUTTER_KEY_TYPE and GUTTER_VALUE_TYPE in
+// CMakeLists.txt). GUTTER_TYPES_HEADER names an optional header defining a custom value type.
+#ifdef GUTTER_TYPES_HEADER
+#include GUTTER_TYPES_HEADER
+#endif
+
+#ifdef GUTTER_KEY_TYPE
+typedef GUTTER_KEY_TYPE gutter_key_t;
+#else
+typedef node_id_t gutter_key_t;
+#endif
+
+#ifdef GUTTER_VALUE_TYPE
+typedef GUTTER_VALUE_TYPE gutter_value_t;
+#else
+typedef node_id_t gutter_value_t;
+#endif
+
+static_assert(std::is_integral<gutter_key_t>::value && std::is_unsigned<gutter_key_t>::value,
+              "gutter_key_t must be an unsigned integer");
+static_assert(std::is_trivially_copyable<gutter_value_t>::value,
+              "gutter_value_t must be trivially copyable");
+
+typedef std::pair<gutter_key_t, gutter_value_t> update_t;
 typedef void insert_ret_t;
 typedef void flush_ret_t;
@@ -3,14 +3,25 @@
 #include <mutex>
 #include <utility>
 #include <atomic>
+#include <thread>
 #include <vector>
 #include "types.h"
 
 struct update_batch {
-  node_id_t node_idx;
-  std::vector<node_id_t> upd_vec;
+  gutter_key_t node_idx;
+  std::vector<gutter_value_t> upd_vec;
+  bool sorted = false; // true if upd_vec is in ascending order
 };
 
+// How the destinations of a batch are ordered before a consumer receives it
+enum BatchSortMode {
+  NO_SORT,       // batches are delivered in arrival order
+  SORT_ON_FLUSH, // the thread pushing the batch sorts it
+  SORT_DEFERRED  // a pool of sorting threads sorts batches after they are pushed
+};
+
+class ShmWorkQueue;
+
 class WorkQueue {
  public:
   class DataNode {
@@ -18,13 +29,18 @@ class WorkQueue {
     // LL next pointer
     DataNode *next = nullptr;
     std::vector<update_batch> batches;
+    std::vector<gutter_value_t> sort_scratch; // scratch space for sorting batches
 
-    DataNode(const size_t batch_per_elm, const size_t vec_size) {
+    DataNode(const size_t batch_per_elm, const size_t vec_size, const bool sorting) {
       batches.resize(batch_per_elm);
       for (size_t i = 0; i < batch_per_elm; i++) {
         batches[i].upd_vec.reserve(vec_size);
       }
+      if (sorting) sort_scratch.reserve(vec_size);
     }
+
+    // sort every batch in this DataNode using the sort_scratch
+    void sort_batches();
     friend class WorkQueue;
    public:
     const std::vector<update_batch>& get_batches() { return batches; }
@@ -37,8 +53,11 @@ class WorkQueue {
    * @param num_batches     the rough number of batches to have in the queue
    * @param max_batch_size  the maximum size of a batch
    * @param batch_per_elm   number of batches per queue element.
+   * @param sort_mode       if and where the destinations of each batch are sorted
+   * @param sort_threads    the number of sorting threads when sort_mode is SORT_DEFERRED
    */
-  WorkQueue(size_t num_batches, size_t max_batch_size, size_t batch_per_elm);
+  WorkQueue(size_t num_batches, size_t max_batch_size, size_t batch_per_elm,
+            BatchSortMode sort_mode = NO_SORT, size_t sort_threads = 1);
   ~WorkQueue();
 
   /* 
@@ -49,6 +68,8 @@ class WorkQueue {
 
   /* 
    * Get data from the queue for processing
+   * When sorting is deferred and only unsorted data is available, the caller sorts it
+   * rather than waiting upon the sorting threads.
    * @param data   where to place the Data
    * @return  true if we were able to get good data, false otherwise
    */
@@ -76,6 +97,16 @@ class WorkQueue {
 
   void set_non_block(bool _block);
 
+  /*
+   * Forward every push to a shared memory work queue, whose consumers are other processes.
+   * Set before the first push. Batches sent to the sink are not sorted
+   * @param _sink   the queue, or nullptr to push to this queue again
+   */
+  void set_sink(ShmWorkQueue *_sink) { sink = _sink; }
+
+  // bytes preallocated by the queue for its batches
+  size_t memory_bytes() const;
+
   /*
    * Function which prints the work queue
    * Used for debugging
@@ -84,15 +115,24 @@ class WorkQueue {
 
   // functions for checking if the queue is empty or full
   inline bool full()    {return producer_list == nullptr;} // if producer queue empty, wq full
-  inline bool empty()   {return consumer_list == nullptr;} // if consumer queue empty, wq empty
+  inline bool empty()   {return consumer_list == nullptr && sort_list == nullptr;} // wq empty
 
 private:
   DataNode *producer_list = nullptr; // list of nodes ready to be written to
   DataNode *consumer_list = nullptr; // list of nodes with data for reading
+  DataNode *sort_list     = nullptr; // list of nodes waiting to be sorted (SORT_DEFERRED)
 
   const size_t len;            // number of elments in queue
   const size_t max_batch_size; // maximum batch size
   const size_t batch_per_elm;  // number of batches per work queue element
+  const BatchSortMode sort_mode;
+
+  // threads that sort batches when sort_mode is SORT_DEFERRED
+  // the sort_list is protected by the consumer_list_lock
+  std::vector<std::thread> sorters;
+  std::condition_variable sort_condition;
+  bool sorters_shutdown = false;
+  void do_sort_work();
 
   // locks and condition variables for producer list
   std::condition_variable producer_condition;
@@ -105,6 +145,8 @@ private:
   // should WorkQueue peeks wait until they can succeed(false)
   // or return false on failure (true)
   bool non_block;
+
+  ShmWorkQueue *sink = nullptr; // if set, pushes go here instead
 };
 
 class WriteTooBig : public std::exception {
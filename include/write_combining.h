@@ -0,0 +1,136 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Copy n items to dst with non-temporal stores. The destination lines are neither read nor
+ * left in the cache. Falls back to memcpy if the target has no streaming stores or the items
+ * are not a whole number of words.
+ */
+template <class T>
+inline void stream_copy(T *dst, const T *src, size_t n) {
+#if defined(__SSE2__) && defined(__x86_64__)
+  if (sizeof(T) % sizeof(long long) == 0) {
+    long long *d = reinterpret_cast<long long *>(dst);
+    const long long *s = reinterpret_cast<const long long *>(src);
+    for (size_t i = 0; i < n * sizeof(T) / sizeof(long long); i++)
+      _mm_stream_si64(d + i, s[i]);
+    return;
+  }
+#endif
+#ifdef __SSE2__
+  if (sizeof(T) % sizeof(int) == 0) {
+    int *d = reinterpret_cast<int *>(dst);
+    const int *s = reinterpret_cast<const int *>(src);
+    for (size_t i = 0; i < n * sizeof(T) / sizeof(int); i++)
+      _mm_stream_si32(d + i, s[i]);
+    return;
+  }
+#endif
+  std::copy(src, src + n, dst);
+}
+
+/*
+ * Copy n items to dst, writing the whole cache lines of the destination with non-temporal stores
+ * and the partial lines at either end with regular stores. Streaming part of a line would leave
+ * the line's write combining buffer partly filled, to be flushed in pieces.
+ */
+template <class T>
+inline void stream_lines(T *dst, const T *src, size_t n, size_t line_size) {
+  const uintptr_t begin = uintptr_t(dst);
+  const uintptr_t first_line = (begin + line_size - 1) & ~uintptr_t(line_size - 1);
+  const uintptr_t last_line = uintptr_t(dst + n) & ~uintptr_t(line_size - 1);
+  if (first_line >= last_line || (first_line - begin) % sizeof(T) != 0 ||
+      line_size % sizeof(T) != 0) {
+    std::copy(src, src + n, dst);
+    return;
+  }
+  const size_t head = (first_line - begin) / sizeof(T);
+  const size_t body = (last_line - first_line) / sizeof(T);
+  std::copy(src, src + head, dst);
+  stream_copy(dst + head, src + head, body);
+  std::copy(src + head + body, src + n, dst + head + body);
+}
+
+// Order non-temporal stores before any following store, such as publishing the data
+inline void stream_fence() {
+#ifdef __SSE2__
+  _mm_sfence();
+#endif
+}
+
+// Allocates cache line aligned memory, for destinations that are written with stream_lines()
+template <class T, size_t Align = 64>
+struct LineAlignedAllocator {
+  using value_type = T;
+  template <class U> struct rebind { using other = LineAlignedAllocator<U, Align>; };
+
+  LineAlignedAllocator() = default;
+  template <class U> LineAlignedAllocator(const LineAlignedAllocator<U, Align> &) {}
+
+  T *allocate(size_t n) {
+    void *mem = nullptr;
+    if (posix_memalign(&mem, Align, std::max(n * sizeof(T), size_t(1))) != 0)
+      throw std::bad_alloc();
+    return static_cast<T *>(mem);
+  }
+  void deallocate(T *mem, size_t) { free(mem); }
+
+  template <class U> bool operator==(const LineAlignedAllocator<U, Align> &) const { return true; }
+  template <class U> bool operator!=(const LineAlignedAllocator<U, Align> &) const { return false; }
+};
+
+/*
+ * Write combining buffer for scattering items into many large destinations, as in software radix
+ * partitioning. Items bound for the same destination gather in a cache line sized slot. A slot
+ * fills up to the end of its destination's current cache line, so once a destination is line
+ * aligned every full slot is one whole line for stream_lines().
+ */
+template <class T>
+class WriteCombiningBuffer {
+ private:
+  size_t per_slot = 1;        // items per slot
+  size_t line = 64;           // bytes per cache line
+  std::vector<T> staged;      // slots * per_slot items
+  std::vector<uint16_t> counts;
+  std::vector<uint16_t> limits; // items that complete the destination's current line
+ public:
+  /*
+   * @param slots       the number of destinations that may be staged at once
+   * @param line_size   the size of a cache line in bytes
+   */
+  void init(size_t slots, size_t line_size) {
+    per_slot = line_size / sizeof(T) > 0 ? line_size / sizeof(T) : 1;
+    line = line_size;
+    staged.resize(slots * per_slot);
+    counts.assign(slots, 0);
+    limits.assign(slots, per_slot);
+  }
+
+  size_t num_slots() const { return counts.size(); }
+  size_t memory_bytes() const {
+    return staged.capacity() * sizeof(T) +
+           (counts.capacity() + limits.capacity()) * sizeof(uint16_t);
+  }
+
+  // stage an item. Returns true if the slot is now full and must be written out
+  inline bool stage(size_t slot, const T &item) {
+    staged[slot * per_slot + counts[slot]++] = item;
+    return counts[slot] == limits[slot];
+  }
+
+  inline const T *items(size_t slot) const { return &staged[slot * per_slot]; }
+  inline size_t count(size_t slot) const { return counts[slot]; }
+  // empty a slot after it is written out. next is where its next item goes, or null if unknown
+  inline void clear(size_t slot, const T *next) {
+    counts[slot] = 0;
+    limits[slot] = per_slot - (uintptr_t(next) % line) / sizeof(T);
+  }
+};
@@ -16,7 +16,7 @@ BufferControlBlock::BufferControlBlock(buffer_id_t id, File_Pointer off, uint8_t
 
 inline bool BufferControlBlock::check_size_limit(uint32_t size, uint32_t flush_size, uint32_t max_size) {
   if (storage_ptr + size > max_size) {
-    printf("buffer %i too full write size %u, storage_ptr = %lu, max = %u\n", id, size, storage_ptr, max_size);
+    printf("buffer %lu too full write size %u, storage_ptr = %lu, max = %u\n", (uint64_t)id, size, storage_ptr, max_size);
     throw BufferFullError(id);
   }
   return storage_ptr + size >= flush_size;
@@ -38,6 +38,10 @@ bool BufferControlBlock::write(GutterTree *gt, char *data, uint32_t size) {
     len = pwrite(gt->get_fd(), data + w, size, file_offset + storage_ptr + w);
   }
   storage_ptr += size;
+  if (!dirty) {
+    dirty = true;
+    gt->mark_dirty(this);
+  }
 
   // return if this buffer should be added to the flush queue
   return need_flush;
@@ -53,9 +57,10 @@ void BufferControlBlock::validate_write(char *data, uint32_t size) {
   printf("Warning: Validating write should only be used for testing\n");
 
   while(data - data_start < size) {
-    node_id_t key = *((node_id_t *) data);
+    gutter_key_t key;
+    memcpy(&key, data, sizeof(gutter_key_t));
     if (key < min_key || key > max_key) {
-      printf("ERROR: Validate Write: incorrect key %u --> ", key); print();
+      printf("ERROR: Validate Write: incorrect key %lu --> ", (uint64_t)key); print();
       throw KeyIncorrectError();
     }
     data += GutterTree::serial_update_size;
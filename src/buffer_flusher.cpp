@@ -38,7 +38,7 @@ void BufferFlusher::do_work() {
       // printf("BufferFlusher id=%i awoken processing buffer %u\n", id, bcb_id);
       queue_unique.unlock();
       if (bcb_id >= gt->buffers.size()) {
-        fprintf(stderr, "ERROR: the id given in the flush_queue is too large! %u\n", bcb_id);
+        fprintf(stderr, "ERROR: the id given in the flush_queue is too large! %lu\n", (uint64_t)bcb_id);
         exit(EXIT_FAILURE);
       }
 
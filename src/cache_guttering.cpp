@@ -1,14 +1,113 @@
 #include "cache_guttering.h"
 
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <new>
+#include <stdexcept>
 #include <thread>
 
-inline static node_id_t extract_left_bits(node_id_t number, int pos) {
+inline static gutter_key_t extract_left_bits(gutter_key_t number, int pos) {
   number >>= pos;
   return number;
 }
 
-void CacheGuttering::print_r_to_l(node_id_t src) {
+// number of bits required to represent the ids [0, num) computed with integer arithmetic
+// so that it remains exact for 64 bit ids
+static int ceil_log2(gutter_key_t num) {
+  int bits = 0;
+  while (bits < (int) sizeof(gutter_key_t) * 8 && (gutter_key_t(1) << bits) < num) ++bits;
+  return bits;
+}
+
+// hint that a write to addr is coming
+inline static void prefetch_write(const void *addr) {
+#ifdef __GNUC__
+  __builtin_prefetch(addr, 1);
+#else
+  (void) addr;
+#endif
+}
+
+// conversions between values and packed words. Packing is only enabled when the two types are the
+// same so these are plain copies, but they must compile for any trivially copyable value type
+inline static gutter_key_t value_to_word(const gutter_value_t &val) {
+  gutter_key_t word = 0;
+  memcpy(&word, &val, std::min(sizeof(word), sizeof(val)));
+  return word;
+}
+inline static gutter_value_t word_to_value(gutter_key_t word) {
+  gutter_value_t val{};
+  memcpy(&val, &word, std::min(sizeof(word), sizeof(val)));
+  return val;
+}
+
+inline void CacheGuttering::put(Cache_Gutter &gutter, const update_t &upd, bool packed,
+                                int pos) {
+  if (packed) {
+    gutter_key_t remainder = upd.first & ((gutter_key_t(1) << pos) - 1);
+    gutter.words()[gutter.num_elms++] = (remainder << value_bits) | value_to_word(upd.second);
+  }
+  else
+    gutter.data[gutter.num_elms++] = upd;
+}
+
+inline update_t CacheGuttering::get(Cache_Gutter &gutter, size_t i, gutter_key_t idx,
+                                    bool packed, int pos) {
+  if (packed) {
+    gutter_key_t word = gutter.words()[i];
+    return {(idx << pos) | (word >> value_bits), word_to_value(word & value_mask)};
+  }
+  return gutter.data[i];
+}
+
+// largest power of 2 that is at most num, and at least 1
+static size_t floor_pow2(size_t num) {
+  size_t pow = 1;
+  while (pow <= num / 2) pow *= 2;
+  return pow;
+}
+
+// fanout of the level 1 gutters such that they fill about twice the level 1 data cache
+static size_t fit_level1_fanout(size_t l1d_size, size_t level1_bufs, size_t block_size) {
+  return std::min(std::max(floor_pow2(2 * l1d_size / (level1_bufs * block_size)), size_t(4)),
+                  size_t(64));
+}
+
+// size of the level 2 gutters such that they fill about twice the level 2 cache. They are never
+// smaller than the level 1 gutters
+static size_t fit_level2_elms(size_t l2_size, size_t level2_bufs, size_t level1_elms) {
+  return std::max(floor_pow2(2 * l2_size / (level2_bufs * sizeof(update_t))), level1_elms);
+}
+
+inline gutter_key_t CacheGuttering::repack_mask(int pos) {
+  return (((gutter_key_t(1) << pos) - 1) << value_bits) | value_mask;
+}
+
+inline void CacheGuttering::prefetch_slot(Cache_Gutter &gutter, bool packed) {
+  if (packed)
+    prefetch_write(gutter.words() + gutter.num_elms);
+  else
+    prefetch_write(gutter.data + gutter.num_elms);
+}
+
+void CacheGuttering::set_packing(bool allow) {
+  constexpr int key_bits = sizeof(gutter_key_t) * 8;
+  allow = allow && std::is_same<gutter_key_t, gutter_value_t>::value && value_bits < key_bits;
+  level1_packed = allow && level1_pos + value_bits <= key_bits;
+  level2_packed = allow && level2_pos + value_bits <= key_bits;
+  level3_packed = allow && level3_pos + value_bits <= key_bits;
+  any_packed = level1_packed || level2_packed || level3_packed;
+  level1_slots = level1_elms_per_buf * (level1_packed ? 2 : 1);
+  level2_slots = level2_elms_per_buf * (level2_packed ? 2 : 1);
+  level3_slots = level3_elms_per_buf * (level3_packed ? 2 : 1);
+
+  for (auto &thr : insert_threads)
+    thr.reset_thresholds();
+}
+
+void CacheGuttering::print_r_to_l(gutter_key_t src) {
   std::cout << "src: " << src;
   std::cout << "->(L1)" << extract_left_bits(src, level1_pos);
   std::cout << "->(L2)" << extract_left_bits(src, level2_pos);
@@ -18,21 +117,46 @@ void CacheGuttering::print_r_to_l(node_id_t src) {
   std::cout << std::endl;
 }
 
-CacheGuttering::CacheGuttering(node_id_t num_nodes, uint32_t workers, uint32_t inserters,
-                               GutteringConfiguration conf)
+void CacheGuttering::print_fanouts() {
+  std::cout << "Level 1: " << level1_bufs << " gutters x " << level1_slots << " updates"
+            << ", fanout = " << level1_fanout << std::endl;
+  std::cout << "Level 2: " << level2_bufs << " gutters x " << level2_slots << " updates"
+            << std::endl;
+  std::cout << "Level 3: " << level3_bufs << " gutters x " << level3_slots << " updates"
+            << std::endl;
+  if (level4_gutters)
+    std::cout << "Level 4: " << max_level4_bufs << " gutters x " << level4_elms_per_buf
+              << " updates, fanout = " << level4_fanout << std::endl;
+}
+
+CacheGuttering::CacheGuttering(gutter_key_t num_nodes, uint32_t workers, uint32_t inserters,
+                               GutteringConfiguration conf, const CacheInfo &caches)
     : GutteringSystem(num_nodes, workers, conf),
       inserters(inserters),
       num_nodes(num_nodes),
-      level1_pos(ceil(log2(num_nodes)) - level1_bits),
-      level2_pos(std::max((int)ceil(log2(num_nodes)) - level2_bits, 0)),
-      level3_pos(std::max((int)ceil(log2(num_nodes)) - level3_bits, 0)),
-      level4_pos(std::max((int)ceil(log2(num_nodes)) - level4_bits, 0)) {
-  // initialize storage for inserter threads
-  insert_threads.reserve(inserters);
-  for (uint32_t t = 0; t < inserters; t++) 
-    insert_threads.emplace_back(*this);
+      cache_line(floor_pow2(std::max(caches.line_size, sizeof(update_t)))),
+      block_size(8 * cache_line),
+      level1_fanout(fit_level1_fanout(caches.l1d_size, level1_bufs, block_size)),
+      level1_elms_per_buf(level1_fanout * block_size / sizeof(update_t)),
+      level2_bufs(level1_bufs * level1_fanout),
+      level2_elms_per_buf(fit_level2_elms(caches.l2_size, level2_bufs, level1_elms_per_buf)),
+      level3_bufs(level2_bufs * level1_fanout * buffer_growth_factor),
+      level3_elms_per_buf(std::max(level2_elms_per_buf, level1_elms_per_buf *
+                                   buffer_growth_factor * buffer_growth_factor)),
+      max_level4_bufs(level3_bufs * level1_fanout * buffer_growth_factor * buffer_growth_factor),
+      level1_bits(log2_constexpr(level1_bufs)),
+      level2_bits(log2_constexpr(level2_bufs)),
+      level3_bits(log2_constexpr(level3_bufs)),
+      level4_bits(log2_constexpr(max_level4_bufs)),
+      level1_pos(std::max(ceil_log2(num_nodes) - level1_bits, 0)),
+      level2_pos(std::max(ceil_log2(num_nodes) - level2_bits, 0)),
+      level3_pos(std::max(ceil_log2(num_nodes) - level3_bits, 0)),
+      level4_pos(std::max(ceil_log2(num_nodes) - level4_bits, 0)),
+      value_bits(ceil_log2(num_nodes)) {
+  value_mask = value_bits < (int) sizeof(gutter_key_t) * 8 ? (gutter_key_t(1) << value_bits) - 1
+                                                           : ~gutter_key_t(0);
 
-  // initialize level4_gutters if necessary
+  // size the level 4 gutters if necessary
   if (max_level4_bufs < num_nodes) {
 
     level4_fanout = num_nodes / max_level4_bufs;
@@ -43,36 +167,148 @@ CacheGuttering::CacheGuttering(node_id_t num_nodes, uint32_t workers, uint32_t i
     std::cout << " Using level 4 buffer" << std::endl;
     std::cout << " level 4 fanout    = " << level4_fanout << std::endl;
     std::cout << " level 4 elems/buf = " << level4_elms_per_buf << std::endl;
+  }
+
+  leaf_slots_avg = leaf_gutter_size;
+  if (adaptive_leaf_bytes > 0)
+    leaf_slots_avg = std::max(size_t(1), std::min(leaf_gutter_size,
+                                                  adaptive_leaf_bytes / sizeof(gutter_value_t)));
+
+  // leaf gutters that do not fit in the last level cache are written with non-temporal stores
+  stream_writes = double(num_nodes) * leaf_bytes() > caches.l3_size;
+  if (stream_writes) {
+    // stage the leaves below a level 3 or level 4 gutter if they fit in half the L2
+    size_t range = size_t(1) << (level4_fanout > 0 ? level4_pos : level3_pos);
+    leaf_wc_slots = std::min(range, caches.l2_size / 2 / cache_line);
+  }
 
+  // initialize storage for inserter threads
+  insert_threads.reserve(inserters);
+  for (uint32_t t = 0; t < inserters; t++) 
+    insert_threads.emplace_back(*this);
+  async_flusher.reset(new InsertThread(*this, true));
+  init_inserter_epochs(inserters);
+  if (hub_gutters > 0)
+    hubs = std::vector<HubGutters>(inserters, HubGutters(hub_gutters, leaf_gutter_size));
+
+  // Leaves take their buffers on demand, so they get what the rest of the system leaves of the
+  // memory budget. Fail if that is not a leaf per inserter
+  leaf_cap = leaf_pool_bytes;
+  if (memory_budget != 0) {
+    MemoryUsage usage = memory_plan(inserters * leaf_bytes());
+    check_memory_budget("CacheGuttering", usage);
+    const size_t spare = memory_budget - memory_plan(0).total();
+    if (leaf_cap == 0 || leaf_cap > spare) {
+      leaf_cap = spare;
+      std::cout << " Leaf pool capped at " << leaf_cap / 1024 << " KiB by the memory budget"
+                << std::endl;
+    }
+  }
+
+  if (level4_fanout > 0) {
     level4_gutters = new RAM_Gutter[max_level4_bufs];
-    for (node_id_t i = 0; i < max_level4_bufs; ++i)
-      level4_gutters[i].reserve(level4_elms_per_buf);
+    parallel_init(max_level4_bufs, [&](size_t lo, size_t hi) {
+      for (size_t i = lo; i < hi; ++i)
+        level4_gutters[i].buffer.resize(level4_elms_per_buf);
+    }, 64);
+  }
+
+  if (adaptive_leaf_bytes > 0) {
+    const size_t groups = ((num_nodes - 1) >> leaf_group_bits) + 1;
+    leaf_capacity.reset(new std::atomic<uint32_t>[num_nodes]);
+    leaf_updates.reset(new std::atomic<uint32_t>[num_nodes]);
+    group_emitted.reset(new std::atomic<size_t>[groups]);
+    for (gutter_key_t k = 0; k < num_nodes; k++) {
+      leaf_capacity[k] = leaf_slots_avg;
+      leaf_updates[k] = 0;
+    }
+    for (size_t g = 0; g < groups; g++) group_emitted[g] = 0;
   }
 
-  // initialize leaf gutters
-  leaf_gutters = new Leaf_Gutter[num_nodes];
-  for (node_id_t i = 0; i < num_nodes; ++i)
-    leaf_gutters[i].reserve(leaf_gutter_size);
+  // initialize leaf gutters. Their buffers are taken from the inserters' pools on first write,
+  // unless prefaulting, where every leaf that fits under the leaf cap gets one now
+  size_t eager_leaves = 0;
+  if (prefault)
+    eager_leaves = leaf_cap == 0 ? num_nodes
+                                 : std::min(size_t(num_nodes), leaf_cap / leaf_bytes());
+  leaf_buffers = eager_leaves;
+  leaf_gutters = static_cast<Leaf_Gutter *>(::operator new(sizeof(Leaf_Gutter) * num_nodes));
+  parallel_init(num_nodes, [&](size_t lo, size_t hi) {
+    for (size_t i = lo; i < hi; ++i) {
+      Leaf_Gutter *leaf = new (&leaf_gutters[i]) Leaf_Gutter();
+      if (i < eager_leaves)
+        leaf->buffer.resize(leaf_slots_avg);
+    }
+  });
+  set_packing(node_id_values);
 
   // initialize l3 flush locks
   level3_flush_locks = new std::mutex[level3_bufs];
+  dirty_leaves.resize(level3_bufs);
+  evict_hands.assign(level3_bufs, 0);
 
   // for debugging -- print out root to leaf paths for every id
-  // for (node_id_t i = 0; i < num_nodes; i++)
+  // for (gutter_key_t i = 0; i < num_nodes; i++)
   //  print_r_to_l(i);
 }
 
 CacheGuttering::~CacheGuttering() {
-  delete[] leaf_gutters;
+  parallel_init(num_nodes, [&](size_t lo, size_t hi) {
+    for (size_t i = lo; i < hi; ++i)
+      leaf_gutters[i].~Leaf_Gutter();
+  });
+  ::operator delete(leaf_gutters);
   delete[] level4_gutters;
   delete[] level3_flush_locks;
 }
 
+CacheGuttering::InsertThread::InsertThread(CacheGuttering &CGsystem, bool shared_only)
+    : CGsystem(CGsystem) {
+  local_wq_buffer.batches.resize(CGsystem.wq_batch_per_elm);
+  for (auto &batch : local_wq_buffer.batches)
+    batch.upd_vec.reserve(CGsystem.leaf_gutter_size);
+  if (shared_only) return;
+
+  init_level(level1_slab, level1_gutters, level1_bufs, CGsystem.level1_elms_per_buf);
+  init_level(level2_slab, level2_gutters, CGsystem.level2_bufs, CGsystem.level2_elms_per_buf);
+  init_level(level3_slab, level3_gutters, CGsystem.level3_bufs, CGsystem.level3_elms_per_buf);
+  overflow_slab.resize(max_deferred_l3 * CGsystem.level3_elms_per_buf);
+  for (size_t i = 0; i < max_deferred_l3; i++)
+    spare_l3.push_back(&overflow_slab[i * CGsystem.level3_elms_per_buf]);
+  deferred_l3.reserve(max_deferred_l3);
+  if (CGsystem.stream_writes) {
+    leaf_wc.init(CGsystem.leaf_wc_slots, CGsystem.cache_line);
+    if (CGsystem.level4_fanout > 0)
+      level4_wc.init(size_t(1) << (CGsystem.level3_pos - CGsystem.level4_pos), CGsystem.cache_line);
+  }
+}
+
+void CacheGuttering::InsertThread::init_level(std::vector<update_t> &slab,
+                                              std::vector<Cache_Gutter> &gutters, size_t bufs,
+                                              size_t elms) {
+  slab.resize(bufs * elms);
+  gutters.resize(bufs);
+  for (size_t i = 0; i < bufs; i++)
+    gutters[i].data = &slab[i * elms];
+}
+
+void CacheGuttering::InsertThread::reset_thresholds() {
+  for (auto &gutter : level1_gutters)
+    gutter.max_elms = CGsystem.level1_slots * 3 / 4 + rand() % (CGsystem.level1_slots / 4);
+  for (auto &gutter : level2_gutters)
+    gutter.max_elms = CGsystem.level2_slots * 3 / 4 + rand() % (CGsystem.level2_slots / 4);
+  for (auto &gutter : level3_gutters)
+    gutter.max_elms = CGsystem.level3_slots * 3 / 4 + rand() % (CGsystem.level3_slots / 4);
+}
+
 void CacheGuttering::InsertThread::insert(update_t upd) {
   upd.first -= CGsystem.relabelling_offset;
-  node_id_t l1_idx = extract_left_bits(upd.first, CGsystem.level1_pos);
+  if (CGsystem.any_packed && value_to_word(upd.second) > CGsystem.value_mask)
+    throw std::out_of_range("CacheGuttering: value " + std::to_string(value_to_word(upd.second)) +
+                            " is not a node id but node_id_values() is set");
+  gutter_key_t l1_idx = extract_left_bits(upd.first, CGsystem.level1_pos);
   auto &gutter = level1_gutters[l1_idx];
-  gutter.data[gutter.num_elms++] = upd;
+  CGsystem.put(gutter, upd, CGsystem.level1_packed, CGsystem.level1_pos);
 
   // std::cout << "Handling update " << upd.first << ", " << upd.second << std::endl;
   // std::cout << "Placing in L1 buffer " << l1_idx << ", num_elms = " << gutter.num_elms << std::endl;
@@ -83,96 +319,505 @@ void CacheGuttering::InsertThread::insert(update_t upd) {
   }
 }
 
-void CacheGuttering::InsertThread::flush_buf_l1(const node_id_t idx) {
+void CacheGuttering::InsertThread::partition(Cache_Gutter &gutter, bool packed, int pos,
+                                             int child_pos, Partition_Scratch &part) {
+  const size_t num_elms = gutter.num_elms;
+  const size_t children = size_t(1) << (pos - child_pos);
+  part.child.resize(std::max(part.child.size(), num_elms));
+  part.count.assign(children, 0);
+
+  // the child of every update. Branch free loops over the keys that the compiler can vectorize
+  uint16_t *child = part.child.data();
+  if (children == 1)
+    std::fill(child, child + num_elms, 0);
+  else if (packed) {
+    const gutter_key_t *words = gutter.words();
+    const int shift = CGsystem.value_bits + child_pos;
+    for (size_t i = 0; i < num_elms; i++)
+      child[i] = words[i] >> shift;
+  }
+  else {
+    const gutter_key_t mask = children - 1;
+    for (size_t i = 0; i < num_elms; i++)
+      child[i] = (gutter.data[i].first >> child_pos) & mask;
+  }
+
+  part.max_count = 0;
+  for (size_t i = 0; i < num_elms; i++)
+    part.max_count = std::max(part.max_count, ++part.count[child[i]]);
+}
+
+void CacheGuttering::InsertThread::flush_buf_l1(const gutter_key_t idx) {
   auto &l1_gutter = level1_gutters[idx];
-  for (size_t i = 0; i < l1_gutter.num_elms; i++) {
-    update_t upd = l1_gutter.data[i];
-    node_id_t l2_idx = extract_left_bits(upd.first, CGsystem.level2_pos);
-    auto &l2_gutter = level2_gutters[l2_idx];
-    l2_gutter.data[l2_gutter.num_elms++] = upd;
-    if (l2_gutter.num_elms >= l2_gutter.max_elms)
-      flush_buf_l2(l2_idx);
+  const int child_bits = CGsystem.level1_pos - CGsystem.level2_pos;
+  const gutter_key_t base = idx << child_bits;
+  partition(l1_gutter, CGsystem.level1_packed, CGsystem.level1_pos, CGsystem.level2_pos,
+            level1_part);
+
+  // make room in the children first, a level 2 gutter always holds a level 1 gutter
+  for (size_t c = 0; c < level1_part.count.size(); c++) {
+    if (level2_gutters[base + c].num_elms + level1_part.count[c] > CGsystem.level2_slots)
+      flush_buf_l2(base + c);
+  }
+
+  // copy every update into its child
+  const size_t ahead = CGsystem.prefetch ? level1_prefetch : 0;
+  const uint16_t *child = level1_part.child.data();
+  if (CGsystem.level1_packed && CGsystem.level2_packed) {
+    // a packed word only loses the key bits that its child's index implies
+    const gutter_key_t *words = l1_gutter.words();
+    const gutter_key_t keep = CGsystem.repack_mask(CGsystem.level2_pos);
+    for (size_t i = 0; i < l1_gutter.num_elms; i++) {
+      if (ahead > 0 && i + ahead < l1_gutter.num_elms)
+        CGsystem.prefetch_slot(level2_gutters[base + child[i + ahead]], true);
+      auto &gutter = level2_gutters[base + child[i]];
+      gutter.words()[gutter.num_elms++] = words[i] & keep;
+    }
+  }
+  else {
+    for (size_t i = 0; i < l1_gutter.num_elms; i++) {
+      if (ahead > 0 && i + ahead < l1_gutter.num_elms)
+        CGsystem.prefetch_slot(level2_gutters[base + child[i + ahead]],
+                               CGsystem.level2_packed);
+      update_t upd = CGsystem.get(l1_gutter, i, idx, CGsystem.level1_packed,
+                                  CGsystem.level1_pos);
+      CGsystem.put(level2_gutters[base + child[i]], upd, CGsystem.level2_packed,
+                   CGsystem.level2_pos);
+    }
   }
   l1_gutter.num_elms = 0;
-  l1_gutter.max_elms = level1_elms_per_buf;
+  l1_gutter.max_elms = CGsystem.level1_slots;
+
+  // only now that the parent is drained flush the children that are full
+  for (size_t c = 0; c < size_t(1) << child_bits; c++) {
+    if (level2_gutters[base + c].num_elms >= level2_gutters[base + c].max_elms)
+      flush_buf_l2(base + c);
+  }
 }
 
-void CacheGuttering::InsertThread::flush_buf_l2(const node_id_t idx) {
+void CacheGuttering::InsertThread::flush_buf_l2(const gutter_key_t idx) {
   auto &l2_gutter = level2_gutters[idx];
-  for (size_t i = 0; i < l2_gutter.num_elms; i++) {
-    update_t upd = l2_gutter.data[i];
-    node_id_t l3_idx = extract_left_bits(upd.first, CGsystem.level3_pos);
-    assert(l3_idx >> (CGsystem.level2_pos - CGsystem.level3_pos) == idx);
-    //   std::cout << "l2pos=" << CGsystem.level2_pos << " l3pos=" << CGsystem.level3_pos << std::endl;
-    //   std::cout << ((l3_idx >> (CGsystem.level2_pos - CGsystem.level3_pos)) ^ idx) << std::endl;
-    //   std::cout << "idx=" << idx << " l3_idx=" << l3_idx << std::endl;
-    //   exit(1);
-    // }
-    auto &l3_gutter = level3_gutters[l3_idx];
-    l3_gutter.data[l3_gutter.num_elms++] = upd;
-    if (l3_gutter.num_elms >= l3_gutter.max_elms)
-      flush_buf_l3(l3_idx);
+  const int child_bits = CGsystem.level2_pos - CGsystem.level3_pos;
+  const gutter_key_t base = idx << child_bits;
+  partition(l2_gutter, CGsystem.level2_packed, CGsystem.level2_pos, CGsystem.level3_pos,
+            level2_part);
+
+  // make room in the children first, a level 3 gutter always holds a level 2 gutter
+  for (size_t c = 0; c < level2_part.count.size(); c++) {
+    if (level3_gutters[base + c].num_elms + level2_part.count[c] > CGsystem.level3_slots)
+      flush_buf_l3(base + c);
+  }
+
+  // copy every update into its child
+  const size_t ahead = CGsystem.prefetch ? level2_prefetch : 0;
+  const uint16_t *child = level2_part.child.data();
+  if (CGsystem.level2_packed && CGsystem.level3_packed) {
+    // a packed word only loses the key bits that its child's index implies
+    const gutter_key_t *words = l2_gutter.words();
+    const gutter_key_t keep = CGsystem.repack_mask(CGsystem.level3_pos);
+    for (size_t i = 0; i < l2_gutter.num_elms; i++) {
+      if (ahead > 0 && i + ahead < l2_gutter.num_elms)
+        CGsystem.prefetch_slot(level3_gutters[base + child[i + ahead]], true);
+      auto &gutter = level3_gutters[base + child[i]];
+      gutter.words()[gutter.num_elms++] = words[i] & keep;
+    }
+  }
+  else {
+    for (size_t i = 0; i < l2_gutter.num_elms; i++) {
+      if (ahead > 0 && i + ahead < l2_gutter.num_elms)
+        CGsystem.prefetch_slot(level3_gutters[base + child[i + ahead]],
+                               CGsystem.level3_packed);
+      update_t upd = CGsystem.get(l2_gutter, i, idx, CGsystem.level2_packed,
+                                  CGsystem.level2_pos);
+      CGsystem.put(level3_gutters[base + child[i]], upd, CGsystem.level3_packed,
+                   CGsystem.level3_pos);
+    }
   }
   l2_gutter.num_elms = 0;
-  l2_gutter.max_elms = level2_elms_per_buf;
-}
+  l2_gutter.max_elms = CGsystem.level2_slots;
 
-void CacheGuttering::InsertThread::flush_buf_l3(const node_id_t idx) {
-  // lock associated mutex for this level3 gutter
-  CGsystem.level3_flush_locks[idx].lock();
+  // only now that the parent is drained flush the children that are full
+  for (size_t c = 0; c < size_t(1) << child_bits; c++) {
+    if (level3_gutters[base + c].num_elms >= level3_gutters[base + c].max_elms)
+      flush_buf_l3(base + c);
+  }
+}
 
+void CacheGuttering::InsertThread::flush_buf_l3(const gutter_key_t idx) {
   auto &l3_gutter = level3_gutters[idx];
+
+  // lock associated mutex for this level3 gutter. If another thread holds it defer the flush
+  if (!CGsystem.level3_flush_locks[idx].try_lock()) {
+    if (deferred_l3.size() >= max_deferred_l3)
+      retry_deferred_l3();
+    if (deferred_l3.size() < max_deferred_l3) {
+      // hand the slots to the overflow list and carry on with a spare set
+      deferred_l3.push_back({idx, l3_gutter});
+      l3_gutter.data = spare_l3.back();
+      spare_l3.pop_back();
+      l3_gutter.num_elms = 0;
+      l3_gutter.max_elms = CGsystem.level3_slots;
+      ++level3_stats.deferred;
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    CGsystem.level3_flush_locks[idx].lock();
+    level3_stats.wait_seconds +=
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ++level3_stats.blocked;
+  }
+  scatter_l3(idx, l3_gutter);
+  l3_gutter.num_elms = 0;
+  l3_gutter.max_elms = CGsystem.level3_slots;
+
+  // non-temporal stores must be visible to the next thread to take the lock
+  if (CGsystem.stream_writes) stream_fence();
+  // unlock
+  CGsystem.level3_flush_locks[idx].unlock();
+
+  if (!deferred_l3.empty())
+    retry_deferred_l3();
+}
+
+void CacheGuttering::InsertThread::retry_deferred_l3(bool block) {
+  for (size_t i = 0; i < deferred_l3.size();) {
+    gutter_key_t idx = deferred_l3[i].first;
+    Cache_Gutter &gutter = deferred_l3[i].second;
+    if (block)
+      CGsystem.level3_flush_locks[idx].lock();
+    else if (!CGsystem.level3_flush_locks[idx].try_lock()) {
+      ++i;
+      continue;
+    }
+    scatter_l3(idx, gutter);
+    if (CGsystem.stream_writes) stream_fence();
+    CGsystem.level3_flush_locks[idx].unlock();
+
+    spare_l3.push_back(gutter.data);
+    deferred_l3[i] = deferred_l3.back();
+    deferred_l3.pop_back();
+  }
+}
+
+void CacheGuttering::InsertThread::scatter_l3(const gutter_key_t idx, Cache_Gutter &l3_gutter) {
   if (CGsystem.level4_gutters == nullptr) {
     // flush directly to leaves
-    for (size_t i = 0; i < l3_gutter.num_elms; i++) {
-      update_t upd = l3_gutter.data[i];
-      Leaf_Gutter &leaf = CGsystem.leaf_gutters[upd.first];
-      // std::cout << "L3 Handling update " << upd.first << ", " << upd.second << std::endl;
-      leaf.push_back(upd.second);
-      if (leaf.size() >= CGsystem.leaf_gutter_size) {
-        assert(leaf.size() == CGsystem.leaf_gutter_size);
-        wq_push_helper(upd.first, leaf);
+    const gutter_key_t base = idx << CGsystem.level3_pos;
+    const size_t range = size_t(1) << CGsystem.level3_pos;
+    if (CGsystem.stream_writes && range <= leaf_wc.num_slots()) {
+      for (size_t i = 0; i < l3_gutter.num_elms; i++) {
+        update_t upd = CGsystem.get(l3_gutter, i, idx, CGsystem.level3_packed, CGsystem.level3_pos);
+        if (leaf_wc.stage(upd.first - base, upd.second))
+          commit_leaf(upd.first, upd.first - base, base);
+      }
+      drain_leaves(base, range);
+    }
+    else {
+      const size_t ahead = CGsystem.prefetch ? leaf_prefetch : 0;
+      auto key_at = [&](size_t i) {
+        return CGsystem.get(l3_gutter, i, idx, CGsystem.level3_packed, CGsystem.level3_pos).first;
+      };
+      for (size_t i = 0; i < l3_gutter.num_elms; i++) {
+        if (ahead > 0 && i + 2 * ahead < l3_gutter.num_elms)
+          prefetch_leaf(key_at(i + 2 * ahead), 2);
+        if (ahead > 0 && i + ahead < l3_gutter.num_elms)
+          prefetch_leaf(key_at(i + ahead), 1);
+        update_t upd = CGsystem.get(l3_gutter, i, idx, CGsystem.level3_packed, CGsystem.level3_pos);
+        write_leaf(upd, base);
       }
     }
+  } else if (!CGsystem.stream_writes && partition_l3(idx, l3_gutter)) {
+    // partitioned into the level 4 gutters
   } else {
-    // flush to level 4 gutters
+    // flush to level 4 gutters one update at a time, through the write combining buffers or
+    // because a level 4 gutter is smaller than the updates bound for it
+    const int child_bits = CGsystem.level3_pos - CGsystem.level4_pos;
+    const gutter_key_t base = idx << child_bits;
+    const size_t ahead = CGsystem.prefetch && !CGsystem.stream_writes ? leaf_prefetch : 0;
+    auto l4_idx_at = [&](size_t i) {
+      return extract_left_bits(
+        CGsystem.get(l3_gutter, i, idx, CGsystem.level3_packed, CGsystem.level3_pos).first,
+        CGsystem.level4_pos);
+    };
     for (size_t i = 0; i < l3_gutter.num_elms; i++) {
-      update_t upd = l3_gutter.data[i];
-      node_id_t l4_idx = extract_left_bits(upd.first, CGsystem.level4_pos);
+      if (ahead > 0 && i + 2 * ahead < l3_gutter.num_elms)
+        prefetch_level4(l4_idx_at(i + 2 * ahead), 2);
+      if (ahead > 0 && i + ahead < l3_gutter.num_elms)
+        prefetch_level4(l4_idx_at(i + ahead), 1);
+      update_t upd = CGsystem.get(l3_gutter, i, idx, CGsystem.level3_packed, CGsystem.level3_pos);
+      gutter_key_t l4_idx = extract_left_bits(upd.first, CGsystem.level4_pos);
+      if (CGsystem.stream_writes) {
+        if (level4_wc.stage(l4_idx - base, upd))
+          commit_level4(l4_idx, l4_idx - base);
+        continue;
+      }
       RAM_Gutter &gutter = CGsystem.level4_gutters[l4_idx];
-      gutter.push_back(upd);
-      if (gutter.size() >= CGsystem.level4_elms_per_buf) {
-        assert(gutter.size() == CGsystem.level4_elms_per_buf);
+      gutter.buffer[gutter.num_elms++] = upd;
+      if (gutter.num_elms >= CGsystem.level4_elms_per_buf)
         flush_buf_l4(l4_idx);
-      }
+    }
+    if (CGsystem.stream_writes) {
+      for (size_t slot = 0; slot < size_t(1) << child_bits; slot++)
+        if (level4_wc.count(slot) > 0) commit_level4(base + slot, slot);
     }
   }
-  l3_gutter.num_elms = 0;
-  l3_gutter.max_elms = level3_elms_per_buf;
-  // unlock
-  CGsystem.level3_flush_locks[idx].unlock();
 }
 
-void CacheGuttering::InsertThread::flush_buf_l4(const node_id_t idx) {
+bool CacheGuttering::InsertThread::partition_l3(const gutter_key_t idx, Cache_Gutter &l3_gutter) {
+  const int child_bits = CGsystem.level3_pos - CGsystem.level4_pos;
+  const gutter_key_t base = idx << child_bits;
+  partition(l3_gutter, CGsystem.level3_packed, CGsystem.level3_pos, CGsystem.level4_pos,
+            level3_part);
+  if (level3_part.max_count > CGsystem.level4_elms_per_buf)
+    return false;
+
+  // make room in the children first
+  for (size_t c = 0; c < level3_part.count.size(); c++) {
+    RAM_Gutter &gutter = CGsystem.level4_gutters[base + c];
+    if (gutter.num_elms + level3_part.count[c] > CGsystem.level4_elms_per_buf)
+      flush_buf_l4(base + c);
+  }
+
+  // copy every update into its child
+  const size_t ahead = CGsystem.prefetch ? leaf_prefetch : 0;
+  for (size_t i = 0; i < l3_gutter.num_elms; i++) {
+    if (ahead > 0 && i + ahead < l3_gutter.num_elms)
+      prefetch_level4(base + level3_part.child[i + ahead], 1);
+    RAM_Gutter &gutter = CGsystem.level4_gutters[base + level3_part.child[i]];
+    gutter.buffer[gutter.num_elms++] =
+      CGsystem.get(l3_gutter, i, idx, CGsystem.level3_packed, CGsystem.level3_pos);
+  }
+
+  // flush the children that are full
+  for (size_t c = 0; c < level3_part.count.size(); c++) {
+    if (CGsystem.level4_gutters[base + c].num_elms >= CGsystem.level4_elms_per_buf)
+      flush_buf_l4(base + c);
+  }
+  return true;
+}
+
+void CacheGuttering::InsertThread::flush_buf_l4(const gutter_key_t idx) {
   RAM_Gutter &gutter = CGsystem.level4_gutters[idx];
-  for (update_t upd : gutter) {
-    Leaf_Gutter &leaf = CGsystem.leaf_gutters[upd.first];
-    leaf.push_back(upd.second);
-    if (leaf.size() >= CGsystem.leaf_gutter_size) {
-      assert(leaf.size() == CGsystem.leaf_gutter_size);
-      wq_push_helper(upd.first, leaf);
+  const gutter_key_t base = idx << CGsystem.level4_pos;
+  const size_t range = size_t(1) << CGsystem.level4_pos;
+  if (CGsystem.stream_writes && range <= leaf_wc.num_slots()) {
+    for (size_t i = 0; i < gutter.num_elms; i++) {
+      const update_t &upd = gutter.buffer[i];
+      if (leaf_wc.stage(upd.first - base, upd.second))
+        commit_leaf(upd.first, upd.first - base, base);
+    }
+    drain_leaves(base, range);
+  }
+  else {
+    const size_t ahead = CGsystem.prefetch ? leaf_prefetch : 0;
+    for (size_t i = 0; i < gutter.num_elms; i++) {
+      if (ahead > 0 && i + 2 * ahead < gutter.num_elms)
+        prefetch_leaf(gutter.buffer[i + 2 * ahead].first, 2);
+      if (ahead > 0 && i + ahead < gutter.num_elms)
+        prefetch_leaf(gutter.buffer[i + ahead].first, 1);
+      write_leaf(gutter.buffer[i], base);
     }
   }
-  gutter.clear();
+  gutter.num_elms = 0;
+}
+
+inline void CacheGuttering::InsertThread::prefetch_leaf(gutter_key_t key, int ahead) {
+  Leaf_Gutter &leaf = CGsystem.leaf_gutters[key];
+  if (ahead == 2)
+    prefetch_write(&leaf);
+  else
+    prefetch_write(leaf.buffer.data() + leaf.num_elms);
+}
+
+inline void CacheGuttering::InsertThread::prefetch_level4(gutter_key_t idx, int ahead) {
+  RAM_Gutter &gutter = CGsystem.level4_gutters[idx];
+  if (ahead == 2)
+    prefetch_write(&gutter);
+  else
+    prefetch_write(gutter.buffer.data() + gutter.num_elms);
+}
+
+inline void CacheGuttering::InsertThread::mark_dirty(gutter_key_t key, Leaf_Gutter &leaf) {
+  if (!leaf.dirty) {
+    leaf.dirty = true;
+    CGsystem.dirty_leaves[key >> CGsystem.level3_pos].push_back(key);
+  }
+}
+
+inline void CacheGuttering::InsertThread::write_leaf(const update_t &upd, gutter_key_t base) {
+  Leaf_Gutter &leaf = CGsystem.leaf_gutters[upd.first];
+  if (leaf.buffer.empty()) acquire_leaf(leaf, base);
+  if (leaf.num_elms == 0) mark_dirty(upd.first, leaf);
+  leaf.buffer[leaf.num_elms++] = upd.second;
+  if (leaf.num_elms >= leaf.buffer.size()) {
+    assert(leaf.num_elms == leaf.buffer.size());
+    wq_push_helper(upd.first, leaf);
+  }
+}
+
+void CacheGuttering::InsertThread::commit_leaf(gutter_key_t key, size_t slot, gutter_key_t base) {
+  Leaf_Gutter &leaf = CGsystem.leaf_gutters[key];
+  const gutter_value_t *items = leaf_wc.items(slot);
+  size_t count = leaf_wc.count(slot);
+  while (count > 0) {
+    if (leaf.buffer.empty()) acquire_leaf(leaf, base);
+    if (leaf.num_elms == 0) mark_dirty(key, leaf);
+    size_t num = std::min(count, leaf.buffer.size() - leaf.num_elms);
+    stream_lines(&leaf.buffer[leaf.num_elms], items, num, CGsystem.cache_line);
+    leaf.num_elms += num;
+    items += num;
+    count -= num;
+    if (leaf.num_elms >= leaf.buffer.size())
+      wq_push_helper(key, leaf);
+  }
+  leaf_wc.clear(slot, leaf.buffer.empty() ? nullptr : leaf.buffer.data() + leaf.num_elms);
+}
+
+void CacheGuttering::InsertThread::drain_leaves(gutter_key_t base, size_t range) {
+  for (size_t slot = 0; slot < range; slot++)
+    if (leaf_wc.count(slot) > 0) commit_leaf(base + slot, slot, base);
+}
+
+bool CacheGuttering::reserve_leaf_buffer() {
+  size_t allocated = leaf_buffers.load();
+  do {
+    if (leaf_cap != 0 && (allocated + 1) * leaf_bytes() > leaf_cap)
+      return false;
+  } while (!leaf_buffers.compare_exchange_weak(allocated, allocated + 1));
+  return true;
+}
+
+CacheGuttering::Leaf_Gutter *CacheGuttering::InsertThread::evict_candidate(gutter_key_t l3_idx,
+                                                                           gutter_key_t &key) {
+  std::vector<gutter_key_t> &dirty = CGsystem.dirty_leaves[l3_idx];
+  size_t &hand = CGsystem.evict_hands[l3_idx];
+  Leaf_Gutter *victim = nullptr;
+  size_t candidates = 0;
+  for (size_t step = 0; step < evict_scan && candidates < evict_candidates && !dirty.empty();
+       step++) {
+    if (hand >= dirty.size()) hand = 0;
+    Leaf_Gutter &leaf = CGsystem.leaf_gutters[dirty[hand]];
+    if (leaf.num_elms == 0) {
+      // an emitted leaf, drop it from the list. It is listed again on its next write
+      leaf.dirty = false;
+      dirty[hand] = dirty.back();
+      dirty.pop_back();
+      continue;
+    }
+    ++candidates;
+    if (victim == nullptr || leaf.num_elms > victim->num_elms) {
+      victim = &leaf;
+      key = dirty[hand];
+    }
+    ++hand;
+  }
+  return victim;
+}
+
+void CacheGuttering::InsertThread::acquire_leaf(Leaf_Gutter &leaf, gutter_key_t base) {
+  if (leaf_pool.empty() && !CGsystem.reserve_leaf_buffer()) {
+    // At the memory cap. Emit a leaf from the range this thread holds the lock for, or else
+    // sweep the other level 3 ranges, clock style, for one whose lock is free and holds data
+    gutter_key_t key;
+    const gutter_key_t own = base >> CGsystem.level3_pos;
+    Leaf_Gutter *victim = evict_candidate(own, key);
+    if (victim != nullptr)
+      wq_push_helper(key, *victim);
+
+    for (size_t step = 0; victim == nullptr && step < CGsystem.level3_bufs; step++) {
+      gutter_key_t l3_idx = evict_cursor;
+      evict_cursor = (evict_cursor + 1) % CGsystem.level3_bufs;
+      if (l3_idx == own || !CGsystem.level3_flush_locks[l3_idx].try_lock()) continue;
+      victim = evict_candidate(l3_idx, key);
+      if (victim != nullptr)
+        wq_push_helper(key, *victim);
+      CGsystem.level3_flush_locks[l3_idx].unlock();
+    }
+
+    if (victim == nullptr)
+      ++CGsystem.leaf_buffers; // nothing to evict, exceed the cap
+  }
+  const size_t slots = CGsystem.leaf_slots(&leaf - CGsystem.leaf_gutters);
+  if (!leaf_pool.empty()) {
+    leaf.buffer = std::move(leaf_pool.back());
+    leaf_pool.pop_back();
+    if (leaf.buffer.capacity() > 2 * slots) // a pooled buffer of a hot leaf, too big to keep
+      leaf.buffer = std::vector<gutter_value_t>();
+  }
+  leaf.buffer.resize(slots);
+}
+
+void CacheGuttering::count_emitted(gutter_key_t key, size_t num_elms) {
+  leaf_updates[key].fetch_add(num_elms, std::memory_order_relaxed);
+  const gutter_key_t group = key >> leaf_group_bits;
+  const size_t mark = leaf_slots_avg << (leaf_group_bits + 2); // four budgets of a full group
+  const size_t before = group_emitted[group].fetch_add(num_elms, std::memory_order_relaxed);
+  if (before < mark && before + num_elms >= mark)
+    rebalance_leaves(group);
 }
 
-void CacheGuttering::InsertThread::wq_push_helper(node_id_t node_idx, Leaf_Gutter &leaf) {
-  local_wq_buffer.batches[local_wq_buffer.size].node_idx = node_idx + CGsystem.relabelling_offset;
-  std::swap(local_wq_buffer.batches[local_wq_buffer.size].upd_vec, leaf);
+void CacheGuttering::rebalance_leaves(gutter_key_t group) {
+  const gutter_key_t first = group << leaf_group_bits;
+  const gutter_key_t last = std::min(gutter_key_t(first + (gutter_key_t(1) << leaf_group_bits)),
+                                     num_nodes);
+  const size_t min_slots = std::max(size_t(1), std::min(leaf_slots_avg, leaf_gutter_size / 16));
+  std::vector<double> weights(last - first);
+  double total = 0;
+  for (gutter_key_t k = first; k < last; k++) {
+    const uint32_t updates = leaf_updates[k].load(std::memory_order_relaxed);
+    leaf_updates[k].store(updates / 2, std::memory_order_relaxed);
+    weights[k - first] = std::sqrt(double(updates) + 1);
+    total += weights[k - first];
+  }
+  const double budget = double(leaf_slots_avg) * (last - first);
+
+  // the budget left by leaves clamped to leaf_gutter_size goes to the others, once
+  std::vector<double> slots(last - first);
+  double spent = 0, unclamped = 0;
+  for (size_t i = 0; i < slots.size(); i++) {
+    slots[i] = std::min(std::max(budget * weights[i] / total, double(min_slots)),
+                        double(leaf_gutter_size));
+    spent += slots[i];
+    if (slots[i] < leaf_gutter_size) unclamped += weights[i];
+  }
+  for (size_t i = 0; i < slots.size(); i++) {
+    if (spent < budget && slots[i] < leaf_gutter_size)
+      slots[i] = std::min(slots[i] + (budget - spent) * weights[i] / unclamped,
+                          double(leaf_gutter_size));
+    leaf_capacity[first + i].store(slots[i], std::memory_order_relaxed);
+  }
+  group_emitted[group].store(0, std::memory_order_relaxed);
+}
+
+void CacheGuttering::InsertThread::commit_level4(gutter_key_t idx, size_t slot) {
+  RAM_Gutter &gutter = CGsystem.level4_gutters[idx];
+  const update_t *items = level4_wc.items(slot);
+  size_t count = level4_wc.count(slot);
+  while (count > 0) {
+    size_t num = std::min(count, CGsystem.level4_elms_per_buf - gutter.num_elms);
+    stream_lines(&gutter.buffer[gutter.num_elms], items, num, CGsystem.cache_line);
+    gutter.num_elms += num;
+    items += num;
+    count -= num;
+    if (gutter.num_elms >= CGsystem.level4_elms_per_buf)
+      flush_buf_l4(idx);
+  }
+  level4_wc.clear(slot, gutter.buffer.data() + gutter.num_elms);
+}
+
+void CacheGuttering::InsertThread::wq_push_helper(gutter_key_t node_idx, Leaf_Gutter &leaf) {
+  auto &batch = local_wq_buffer.batches[local_wq_buffer.size];
+  batch.node_idx = node_idx + CGsystem.relabelling_offset;
+  if (CGsystem.leaf_capacity) CGsystem.count_emitted(node_idx, leaf.num_elms);
+  leaf.buffer.resize(leaf.num_elms);
+  std::swap(batch.upd_vec, leaf.buffer);
+  // the leaf gives up its buffer until its next write
+  leaf_pool.push_back(std::move(leaf.buffer));
+  leaf.buffer = std::vector<gutter_value_t>();
+  leaf.num_elms = 0;
   ++local_wq_buffer.size;
   if (local_wq_buffer.size >= CGsystem.wq_batch_per_elm)
     flush_wq_buf();
-  leaf.clear();
 }
 
 void CacheGuttering::InsertThread::flush_wq_buf() {
@@ -187,51 +832,187 @@ void CacheGuttering::InsertThread::flush_wq_buf() {
   }
 
   // perform the flush
+  if (CGsystem.stream_writes) stream_fence();
   CGsystem.wq.push(local_wq_buffer.batches);
   local_wq_buffer.size = 0;
 }
 
 void CacheGuttering::InsertThread::flush_all() {
+  // empty gutters are skipped so that empty level 3 gutters don't take their locks
   for (size_t i = 0; i < level1_bufs; i++)
-    flush_buf_l1(i);
-  for (size_t i = 0; i < level2_bufs; i++)
-    flush_buf_l2(i);
-  for (size_t i = 0; i < level3_bufs; i++)
-    flush_buf_l3(i);
+    if (level1_gutters[i].num_elms > 0) flush_buf_l1(i);
+  for (size_t i = 0; i < CGsystem.level2_bufs; i++)
+    if (level2_gutters[i].num_elms > 0) flush_buf_l2(i);
+  for (size_t i = 0; i < CGsystem.level3_bufs; i++)
+    if (level3_gutters[i].num_elms > 0) flush_buf_l3(i);
+  retry_deferred_l3(true);
+}
+
+void CacheGuttering::InsertThread::flush_range(gutter_key_t lo, gutter_key_t hi) {
+  for (gutter_key_t i = extract_left_bits(lo, CGsystem.level1_pos);
+       i <= extract_left_bits(hi, CGsystem.level1_pos); i++)
+    if (level1_gutters[i].num_elms > 0) flush_buf_l1(i);
+  for (gutter_key_t i = extract_left_bits(lo, CGsystem.level2_pos);
+       i <= extract_left_bits(hi, CGsystem.level2_pos); i++)
+    if (level2_gutters[i].num_elms > 0) flush_buf_l2(i);
+  for (gutter_key_t i = extract_left_bits(lo, CGsystem.level3_pos);
+       i <= extract_left_bits(hi, CGsystem.level3_pos); i++)
+    if (level3_gutters[i].num_elms > 0) flush_buf_l3(i);
+  retry_deferred_l3(true);
+}
+
+void CacheGuttering::InsertThread::release_leaf_pool() {
+  CGsystem.leaf_buffers -= leaf_pool.size();
+  leaf_pool.clear();
+  leaf_pool.shrink_to_fit();
+}
+
+size_t CacheGuttering::InsertThread::memory_bytes() {
+  size_t bytes = (level1_slab.capacity() + level2_slab.capacity() + level3_slab.capacity() +
+                  overflow_slab.capacity()) * sizeof(update_t);
+  bytes += (level1_gutters.capacity() + level2_gutters.capacity() + level3_gutters.capacity()) *
+           sizeof(Cache_Gutter);
+  for (Partition_Scratch *part : {&level1_part, &level2_part, &level3_part})
+    bytes += part->child.capacity() * sizeof(uint16_t) + part->count.capacity() * sizeof(uint32_t);
+  bytes += leaf_wc.memory_bytes() + level4_wc.memory_bytes();
+  for (auto &batch : local_wq_buffer.batches)
+    bytes += sizeof(update_batch) + batch.upd_vec.capacity() * sizeof(gutter_value_t);
+  return bytes;
+}
+
+MemoryUsage CacheGuttering::memory_plan(size_t leaf_bytes_total) {
+  MemoryUsage usage;
+  usage.work_queue = wq.memory_bytes();
+  usage.gutters = leaf_bytes_total + size_t(num_nodes) * sizeof(Leaf_Gutter);
+  for (auto &thr : insert_threads)
+    usage.local += thr.memory_bytes();
+  if (hub_gutters > 0)
+    usage.local += inserters * HubGutters::memory_bytes(hub_gutters, leaf_gutter_size);
+  if (level4_fanout > 0)
+    usage.internal += max_level4_bufs * (sizeof(RAM_Gutter) +
+                                         level4_elms_per_buf * sizeof(update_t));
+  if (adaptive_leaf_bytes > 0)
+    usage.internal += size_t(num_nodes) * 2 * sizeof(uint32_t) +
+                      ((size_t(num_nodes) >> leaf_group_bits) + 1) * sizeof(size_t);
+  usage.internal += level3_bufs * (sizeof(std::mutex) + sizeof(std::vector<gutter_key_t>));
+  usage.internal += async_flusher->memory_bytes();
+  return usage;
+}
+
+MemoryUsage CacheGuttering::memory_usage() {
+  return memory_plan(leaf_buffers * leaf_bytes());
+}
+
+CacheGuttering::Level3_Stats CacheGuttering::get_level3_stats() {
+  Level3_Stats total;
+  for (auto &thr : insert_threads) {
+    total.deferred += thr.level3_stats.deferred;
+    total.blocked += thr.level3_stats.blocked;
+    total.wait_seconds += thr.level3_stats.wait_seconds;
+  }
+  return total;
+}
+
+void CacheGuttering::InsertThread::flush_level3_range(const gutter_key_t idx) {
+  if (CGsystem.level4_gutters != nullptr) {
+    const gutter_key_t first = (idx << CGsystem.level3_pos) >> CGsystem.level4_pos;
+    const gutter_key_t last = std::min(first + (gutter_key_t(1) << (CGsystem.level3_pos -
+                                                                   CGsystem.level4_pos)),
+                                       gutter_key_t(CGsystem.max_level4_bufs));
+    for (gutter_key_t l4 = first; l4 < last; l4++) {
+      if (CGsystem.level4_gutters[l4].num_elms > 0)
+        flush_buf_l4(l4);
+    }
+  }
+
+  std::vector<gutter_key_t> &dirty = CGsystem.dirty_leaves[idx];
+  for (gutter_key_t key : dirty) {
+    Leaf_Gutter &leaf = CGsystem.leaf_gutters[key];
+    leaf.dirty = false;
+    if (leaf.num_elms > 0) {
+      assert(leaf.num_elms <= leaf.buffer.size());
+      wq_push_helper(key, leaf);
+    }
+  }
+  dirty.clear();
+  CGsystem.evict_hands[idx] = 0;
+}
+
+void CacheGuttering::flush_nodes(gutter_key_t lo, gutter_key_t hi) {
+  for (auto &inserter_hubs : hubs)
+    inserter_hubs.flush_range(lo, hi, wq);
+  if (hi < relabelling_offset) return;
+  lo = std::max(lo, relabelling_offset) - relabelling_offset;
+  hi = std::min(hi - relabelling_offset, num_nodes - 1);
+  if (lo > hi) return;
+
+  for (auto &thr : insert_threads)
+    thr.flush_range(lo, hi);
+
+  // the nodes' level 4 gutters go to the leaves, and then their leaves to the work queue. A
+  // flushed leaf stays in its dirty list, empty, until the next force_flush()
+  auto &thr = insert_threads[0];
+  for (gutter_key_t l3 = extract_left_bits(lo, level3_pos);
+       l3 <= extract_left_bits(hi, level3_pos); l3++) {
+    std::lock_guard<std::mutex> lk(level3_flush_locks[l3]);
+    const gutter_key_t first = std::max(lo, l3 << level3_pos);
+    const gutter_key_t last = std::min(hi, ((l3 + 1) << level3_pos) - 1);
+    if (level4_gutters != nullptr) {
+      for (gutter_key_t l4 = extract_left_bits(first, level4_pos);
+           l4 <= extract_left_bits(last, level4_pos); l4++)
+        if (level4_gutters[l4].num_elms > 0) thr.flush_buf_l4(l4);
+    }
+    for (gutter_key_t key = first; key <= last; key++) {
+      if (leaf_gutters[key].num_elms > 0)
+        thr.wq_push_helper(key, leaf_gutters[key]);
+    }
+  }
+  thr.flush_wq_buf();
+}
+
+void CacheGuttering::hand_off(size_t thr) {
+  if (hub_gutters > 0) hubs[thr].flush(wq);
+  insert_threads[thr].flush_all();
+  insert_threads[thr].flush_wq_buf();
+}
+
+void CacheGuttering::flush_shared() {
+  // the flushing thread needs its own wq buffer and leaf pool, returning the leaf buffers it
+  // collects once done so that they don't sit idle
+  for (gutter_key_t l3 = 0; l3 < level3_bufs; l3++) {
+    std::lock_guard<std::mutex> lk(level3_flush_locks[l3]);
+    async_flusher->flush_level3_range(l3);
+  }
+  async_flusher->flush_wq_buf();
+  async_flusher->release_leaf_pool();
 }
 
 void CacheGuttering::force_flush() {
-  // task for flushing thread local buffers
-  auto flush_task = [&](const size_t idx) {
-    auto &thr = insert_threads[idx];
-    thr.flush_all();
+  // run a task for each InsertThread in parallel
+  auto run_parallel = [&](auto task) {
+    std::vector<std::thread> threads;
+    threads.reserve(inserters);
+    for (size_t i = 0; i < inserters; i++)
+      threads.emplace_back(task, i);
+
+    for (size_t i = 0; i < inserters; i++)
+      threads[i].join();
   };
-  
-  // flush thread local buffers in parallel
-  std::vector<std::thread> threads;
-  threads.reserve(inserters);
-  for (size_t i = 0; i < inserters; i++)
-    threads.emplace_back(flush_task, i);
-  
-  for (size_t i = 0; i < inserters; i++)
-    threads[i].join();
-  
-  // flush level4 gutters if necessary
-  if (level4_gutters != nullptr) {
-    for (size_t i = 0; i < max_level4_bufs; i++)
-      insert_threads[0].flush_buf_l4(i);
-  }
-
-  for (node_id_t i = 0; i < num_nodes; i++) {
-    if (leaf_gutters[i].size() > 0) {
-      // std::cout << "flushing leaf gutter " << i << " with " << leaf_gutters[i].size() << " updates" << std::endl;
-      assert(leaf_gutters[i].size() <= leaf_gutter_size);
-      insert_threads[0].wq_push_helper(i, leaf_gutters[i]);
-      leaf_gutters[i].clear();
-    }
-  }
-
-  // flush the local work queue buffer for each InsertThread
-  for (size_t i = 0; i < inserters; i++)
-    insert_threads[i].flush_wq_buf();
+
+  // flush thread local buffers
+  run_parallel([&](const size_t idx) {
+    if (hub_gutters > 0) hubs[idx].flush(wq);
+    insert_threads[idx].flush_all();
+  });
+
+  // flush the level 4 gutters and the leaves written since the last flush. Each InsertThread
+  // takes every inserters'th level 3 range
+  run_parallel([&](const size_t idx) {
+    auto &thr = insert_threads[idx];
+    for (gutter_key_t l3 = idx; l3 < level3_bufs; l3 += inserters) {
+      std::lock_guard<std::mutex> lk(level3_flush_locks[l3]);
+      thr.flush_level3_range(l3);
+    }
+    thr.flush_wq_buf();
+  });
 }
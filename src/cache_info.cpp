@@ -0,0 +1,63 @@
+#include "cache_info.h"
+
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+// parse a sysfs cache size such as "48K" or "32M"
+static size_t parse_size(const std::string &str) {
+  size_t pos = 0;
+  size_t size;
+  try {
+    size = std::stoull(str, &pos);
+  } catch (...) {
+    return 0;
+  }
+  if (pos < str.size() && (str[pos] == 'K' || str[pos] == 'k')) size <<= 10;
+  if (pos < str.size() && (str[pos] == 'M' || str[pos] == 'm')) size <<= 20;
+  return size;
+}
+
+static std::string read_line(const std::string &file) {
+  std::ifstream in(file);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
+
+CacheInfo CacheInfo::detect() {
+  CacheInfo info;
+  size_t line = 0, l1d = 0, l2 = 0, l3 = 0;
+
+  // sysfs lists every cache of the cpu as an index directory
+  const std::string dir = "/sys/devices/system/cpu/cpu0/cache/index";
+  for (int i = 0; i < 16; i++) {
+    std::string idx = dir + std::to_string(i) + "/";
+    std::string level = read_line(idx + "level");
+    if (level.empty()) break;
+    if (read_line(idx + "type") == "Instruction") continue;
+
+    size_t size = parse_size(read_line(idx + "size"));
+    if (level == "1") {
+      l1d = size;
+      line = parse_size(read_line(idx + "coherency_line_size"));
+    }
+    else if (level == "2") l2 = size;
+    else if (level == "3") l3 = size;
+  }
+
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+  auto query = [](int name) -> size_t { long val = sysconf(name); return val > 0 ? val : 0; };
+  if (line == 0) line = query(_SC_LEVEL1_DCACHE_LINESIZE);
+  if (l1d == 0) l1d = query(_SC_LEVEL1_DCACHE_SIZE);
+  if (l2 == 0) l2 = query(_SC_LEVEL2_CACHE_SIZE);
+  if (l3 == 0) l3 = query(_SC_LEVEL3_CACHE_SIZE);
+#endif
+
+  if (line != 0) info.line_size = line;
+  if (l1d != 0) info.l1d_size = l1d;
+  if (l2 != 0) info.l2_size = l2;
+  if (l3 != 0) info.l3_size = l3;
+  else if (l2 != 0) info.l3_size = l2; // no level 3, the level 2 cache is the last level
+  return info;
+}
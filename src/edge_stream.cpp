@@ -0,0 +1,222 @@
+#include "../include/edge_stream.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+constexpr size_t EdgeStreamIngestor::block_bytes;
+constexpr size_t EdgeStreamIngestor::run_edges;
+
+template <typename Id, bool flagged, bool both_directions>
+static size_t parse_records(const char *data, size_t count, update_t *run, size_t &deletions,
+                            uint64_t first, uint64_t nodes) {
+  constexpr size_t record = (flagged ? 1 : 0) + 2 * sizeof(Id);
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++, data += record) {
+    const char *ids = data;
+    if (flagged) {
+      deletions += data[0] == 1;
+      ++ids;
+    }
+    Id src, dst;
+    memcpy(&src, ids, sizeof(Id));
+    memcpy(&dst, ids + sizeof(Id), sizeof(Id));
+    if (uint64_t(src) - first >= nodes || uint64_t(dst) - first >= nodes)
+      throw std::runtime_error("EdgeStreamIngestor: edge (" + std::to_string(src) + ", " +
+                               std::to_string(dst) + ") is outside the nodes [" +
+                               std::to_string(first) + ", " + std::to_string(first + nodes) +
+                               ") of the system");
+    run[n++] = {gutter_key_t(src), gutter_value_t(dst)};
+    if (both_directions) run[n++] = {gutter_key_t(dst), gutter_value_t(src)};
+  }
+  return n;
+}
+
+template <typename Id>
+static EdgeStreamIngestor::Parser parser_for(bool flagged, bool both_directions) {
+  if (flagged)
+    return both_directions ? parse_records<Id, true, true> : parse_records<Id, true, false>;
+  return both_directions ? parse_records<Id, false, true> : parse_records<Id, false, false>;
+}
+
+static std::runtime_error io_error(const std::string &what, const std::string &path) {
+  return std::runtime_error("EdgeStreamIngestor: " + what + " " + path + ": " + strerror(errno));
+}
+
+EdgeStreamIngestor::EdgeStreamIngestor(const std::string &path, Format format)
+    : path(path), format(format) {
+  if (format.id_bytes == 4)
+    parse = parser_for<uint32_t>(format.flag_byte, format.both_directions);
+  else if (format.id_bytes == 8)
+    parse = parser_for<uint64_t>(format.flag_byte, format.both_directions);
+  else
+    throw std::runtime_error("EdgeStreamIngestor: ids must be 4 or 8 bytes, not " +
+                             std::to_string(format.id_bytes));
+
+  fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) throw io_error("cannot open", path);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw io_error("cannot stat", path);
+  }
+  const size_t file_bytes = st.st_size;
+  if (file_bytes < format.header_bytes ||
+      (file_bytes - format.header_bytes) % format.record_bytes() != 0) {
+    close(fd);
+    throw std::runtime_error("EdgeStreamIngestor: " + path + " is not a whole number of " +
+                             std::to_string(format.record_bytes()) + " byte records");
+  }
+  records = (file_bytes - format.header_bytes) / format.record_bytes();
+  if (format.node_count) {
+    uint32_t count;
+    if (format.header_bytes < sizeof(count) ||
+        pread(fd, &count, sizeof(count), 0) != ssize_t(sizeof(count))) {
+      close(fd);
+      throw std::runtime_error("EdgeStreamIngestor: cannot read the node count of " + path);
+    }
+    header_nodes = count;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+EdgeStreamIngestor::~EdgeStreamIngestor() {
+  close(fd);
+}
+
+void EdgeStreamIngestor::insert_records(GutteringSystem &gts, size_t thr, const char *data,
+                                        size_t count, update_t *run, Stats &stats) {
+  const size_t record = format.record_bytes();
+  const uint64_t first = gts.first_node();
+  const uint64_t nodes = gts.get_num_nodes();
+  for (size_t i = 0; i < count; i += run_edges) {
+    const size_t edges = std::min(run_edges, count - i);
+    const size_t updates = parse(data + i * record, edges, run, stats.deletions, first, nodes);
+    gts.insert_updates(run, updates, thr);
+    stats.updates += updates;
+  }
+  stats.edges += count;
+  stats.bytes += count * record;
+}
+
+void EdgeStreamIngestor::read_range(GutteringSystem &gts, size_t thr, size_t first,
+                                    size_t count, Stats &stats) {
+  const size_t record = format.record_bytes();
+  const size_t block_records = std::max(block_bytes / record, size_t(1));
+  const size_t blocks = (count + block_records - 1) / block_records;
+  std::vector<char> buffers[2];
+  for (auto &buffer : buffers) buffer.resize(std::min(block_records, count) * record);
+  std::vector<update_t> run(2 * run_edges);
+
+  // read block b into its buffer, returning its records
+  auto read_block = [&](size_t b) -> size_t {
+    const size_t start = b * block_records;
+    const size_t num = std::min(block_records, count - start);
+    char *dst = buffers[b % 2].data();
+    size_t done = 0;
+    off_t offset = format.header_bytes + (first + start) * record;
+    while (done < num * record) {
+      ssize_t got = pread(fd, dst + done, num * record - done, offset + done);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) throw io_error("cannot read", path);
+      done += got;
+    }
+    return num;
+  };
+
+  // the next block is read while the current one is parsed and inserted
+  std::future<size_t> next = std::async(std::launch::async, read_block, 0);
+  for (size_t b = 0; b < blocks; b++) {
+    const size_t num = next.get();
+    if (b + 1 < blocks) next = std::async(std::launch::async, read_block, b + 1);
+    insert_records(gts, thr, buffers[b % 2].data(), num, run.data(), stats);
+  }
+}
+
+void EdgeStreamIngestor::map_range(GutteringSystem &gts, size_t thr, const char *data,
+                                   size_t count, Stats &stats) {
+  const size_t record = format.record_bytes();
+  const size_t block_records = std::max(block_bytes / record, size_t(1));
+  const uintptr_t page = sysconf(_SC_PAGE_SIZE);
+  std::vector<update_t> run(2 * run_edges);
+  for (size_t start = 0; start < count; start += block_records) {
+    // ask for the next block while this one is parsed
+    const size_t ahead = start + block_records;
+    if (ahead < count) {
+      uintptr_t lo = uintptr_t(data + ahead * record) & ~(page - 1);
+      uintptr_t hi = uintptr_t(data + std::min(ahead + block_records, count) * record);
+      madvise(reinterpret_cast<void *>(lo), hi - lo, MADV_WILLNEED);
+    }
+    insert_records(gts, thr, data + start * record, std::min(block_records, count - start),
+                   run.data(), stats);
+  }
+}
+
+EdgeStreamIngestor::Stats EdgeStreamIngestor::ingest(GutteringSystem &gts, size_t threads,
+                                                     bool use_mmap) {
+  if (threads > gts.num_inserters())
+    throw std::runtime_error("EdgeStreamIngestor: " + std::to_string(threads) +
+                             " threads but the system has " +
+                             std::to_string(gts.num_inserters()) + " inserters");
+  if (header_nodes > gts.get_num_nodes())
+    throw std::runtime_error("EdgeStreamIngestor: " + path + " has " +
+                             std::to_string(header_nodes) + " nodes but the system has " +
+                             std::to_string(gts.get_num_nodes()));
+  Stats total;
+  if (records == 0) return total;
+  threads = std::max(std::min(threads, records), size_t(1));
+
+  const size_t file_bytes = format.header_bytes + records * format.record_bytes();
+  const char *mapping = nullptr;
+  if (use_mmap) {
+    void *mem = mmap(nullptr, file_bytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) throw io_error("cannot map", path);
+    madvise(mem, file_bytes, MADV_SEQUENTIAL);
+    mapping = static_cast<const char *>(mem);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<Stats> stats(threads);
+  std::vector<std::exception_ptr> errors(threads);
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      const size_t first = records * t / threads;
+      const size_t count = records * (t + 1) / threads - first;
+      try {
+        if (use_mmap)
+          map_range(gts, t, mapping + format.header_bytes + first * format.record_bytes(),
+                    count, stats[t]);
+        else
+          read_range(gts, t, first, count, stats[t]);
+      } catch (...) {
+        errors[t] = std::current_exception();
+      }
+    });
+  }
+  for (auto &worker : workers) worker.join();
+  total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (use_mmap) munmap(const_cast<char *>(mapping), file_bytes);
+
+  for (auto &error : errors)
+    if (error) std::rethrow_exception(error);
+  for (auto &s : stats) {
+    total.bytes += s.bytes;
+    total.edges += s.edges;
+    total.deletions += s.deletions;
+    total.updates += s.updates;
+  }
+  return total;
+}
@@ -2,6 +2,7 @@
 #include "../include/buffer_flusher.h"
 #include "../include/gt_file_errors.h"
 
+#include <algorithm>
 #include <utility>
 #include <unistd.h> //open and close
 #include <string.h> //memcpy
@@ -15,7 +16,7 @@
  * and the number of nodes we will insert(N)
  * We assume that node indices begin at 0 and increase to N-1
  */
-GutterTree::GutterTree(std::string dir, node_id_t nodes, int workers, GutteringConfiguration conf, 
+GutterTree::GutterTree(std::string dir, gutter_key_t nodes, int workers, GutteringConfiguration conf, 
  bool reset) 
 : GutteringSystem(nodes, workers, conf, true), dir(dir), num_nodes(nodes) {
   if (buffer_size < page_size) {
@@ -24,14 +25,26 @@ GutterTree::GutterTree(std::string dir, node_id_t nodes, int workers, GutteringC
   }
   
   // setup universal variables
-  max_level       = ceil(log(num_nodes) / log(fanout));
+  // max_level is the smallest depth at which fanout^max_level >= num_nodes
+  max_level = 0;
+  for (gutter_key_t reach = 1; reach < num_nodes; ++max_level)
+    reach = reach > num_nodes / fanout ? num_nodes : reach * fanout;
   backing_EOF     = 0;
 
   leaf_size = leaf_gutter_size * serial_update_size; // bytes per leaf
 
+  // the tree has num_nodes leaves and about num_nodes / (fanout - 1) internal blocks
+  check_memory_budget("GutterTree", memory_plan(num_nodes + num_nodes / (fanout - 1) + fanout,
+                                                num_flushers + 1));
+
   // create memory for cache and flushing
   flush_data = new flush_struct(this); // must be done after setting up universal variables
   cache = (char *) malloc(fanout * ((uint64_t)buffer_size + page_size));
+  if (prefault) {
+    parallel_init(fanout, [&](size_t lo, size_t hi) {
+      prefault_pages(cache + lo * (buffer_size + page_size), (hi - lo) * (buffer_size + page_size));
+    }, 1);
+  }
 
   // open the file which will be our backing store for the non-root nodes
   // create it if it does not already exist
@@ -48,6 +61,7 @@ GutterTree::GutterTree(std::string dir, node_id_t nodes, int workers, GutteringC
   }
 
   setup_tree(); // setup the gutter tree
+  dirty_bcbs.assign(fanout, std::vector<std::vector<buffer_id_t>>(max_level));
 
   // start the buffer flushers
   printf("number of flushers %i\n", num_flushers);
@@ -64,6 +78,7 @@ GutterTree::~GutterTree() {
 
   // free malloc'd memory
   delete flush_data;
+  delete async_flush_data;
   free(cache);
   for(uint32_t i = 0; i < buffers.size(); i++) {
     if (buffers[i] != nullptr)
@@ -77,6 +92,21 @@ GutterTree::~GutterTree() {
   close(backing_store);
 }
 
+MemoryUsage GutterTree::memory_plan(size_t blocks, size_t flush_structs) {
+  const size_t node_bytes = (size_t) buffer_size + page_size;
+  MemoryUsage usage;
+  usage.work_queue = wq.memory_bytes();
+  usage.gutters = fanout * node_bytes; // the root cache
+  const size_t flush_bytes = max_level * (node_bytes + fanout * (page_size + 2 * sizeof(char *)));
+  usage.internal = flush_structs * flush_bytes +
+                   blocks * (sizeof(BufferControlBlock) + sizeof(BufferControlBlock *));
+  return usage;
+}
+
+MemoryUsage GutterTree::memory_usage() {
+  return memory_plan(buffers.size(), num_flushers + 1 + (async_flush_data != nullptr ? 1 : 0));
+}
+
 void print_tree(std::vector<BufferControlBlock *>bcb_list) {
   for(uint32_t i = 0; i < bcb_list.size(); i++) {
     if (bcb_list[i] != nullptr) 
@@ -84,57 +114,79 @@ void print_tree(std::vector<BufferControlBlock *>bcb_list) {
   }
 }
 
-// TODO: clean up this function
 void GutterTree::setup_tree() {
   printf("Creating a tree of depth %i\n", max_level);
   File_Pointer size = 0;
 
-  // create the BufferControlBlocks
-  for (uint32_t l = 0; l < max_level; l++) { // loop through all levels
+  // the children of a parent holding parent_keys keys. Each child gets its share of the keys
+  // that are left rounded up, and a parent holding a single key is a leaf
+  auto num_children = [&](gutter_key_t parent_keys) -> buffer_id_t {
+    return parent_keys <= 1 ? 0 : std::min((gutter_key_t) fanout, parent_keys);
+  };
+  auto child_bytes = [&](gutter_key_t child_keys) -> File_Pointer {
+    return child_keys == 1 ? leaf_size + page_size : buffer_size + page_size;
+  };
+
+  // create the BufferControlBlocks one level at a time. The parents of level 0 is the root,
+  // which holds every key, and the parents of level l are the blocks of level l-1
+  buffer_id_t parent_start = 0;
+  for (uint32_t l = 0; l < max_level; l++) {
     if(l == 1) size = 0; // reset the size because the first level is held in cache
 
-    uint32_t level_size    = pow(fanout, l+1); // number of blocks in this level
-    uint32_t plevel_size   = pow(fanout, l);
-    uint32_t start         = buffers.size();
-    node_id_t key          = 0;
-
-    double parent_keys = num_nodes;
-    uint32_t options   = fanout;
-    bool skip          = false;
-    uint32_t parent    = 0;
-    File_Pointer index = 0;
-
-    buffers.reserve(start + level_size);
-    for (uint32_t i = 0; i < level_size; i++) { // loop through all blocks in the level
-      // get the parent of this node if not level 1 and if we have a new parent
-      if (l > 0 && (i-start) % fanout == 0) {
-        parent      = start + i/fanout - plevel_size; // this logic should check out because only the last level is ever not full
-        parent_keys = buffers[parent]->max_key - buffers[parent]->min_key + 1;
-        key         = buffers[parent]->min_key;
-        options     = fanout;
-        skip        = (parent_keys == 1)? true : false; // if parent leaf then skip
-      }
-      if (skip || parent_keys == 0) {
-        continue;
-      }
+    buffer_id_t start   = buffers.size();
+    buffer_id_t parents = l == 0 ? 1 : start - parent_start;
+    auto parent_min = [&](buffer_id_t p) -> gutter_key_t {
+      return l == 0 ? 0 : buffers[parent_start + p]->min_key;
+    };
+    auto parent_keys = [&](buffer_id_t p) -> gutter_key_t {
+      if (l == 0) return num_nodes;
+      BufferControlBlock *parent = buffers[parent_start + p];
+      return parent->max_key - parent->min_key + 1;
+    };
 
-      BufferControlBlock *bcb = new BufferControlBlock(start + index, size, l);
-      bcb->min_key     = key;
-      key              += ceil(parent_keys/options);
-      bcb->max_key     = key - 1;
-
-      if (l != 0)
-        buffers[parent]->add_child(start + index);
-      
-      parent_keys -= ceil(parent_keys/options);
-      options--;
-      buffers.push_back(bcb);
-      index++; // seperate variable because sometimes we skip stuff
-      if(bcb->is_leaf())
-        size += leaf_size + page_size; // leaves are of size == sketch
-      else 
-        size += buffer_size + page_size;
+    // the index and file offset of each parent's first child
+    std::vector<buffer_id_t> first(parents + 1);
+    std::vector<File_Pointer> offset(parents + 1);
+    first[0]  = start;
+    offset[0] = size;
+    for (buffer_id_t p = 0; p < parents; p++) {
+      gutter_key_t keys    = parent_keys(p);
+      buffer_id_t children = num_children(keys);
+      File_Pointer bytes   = 0;
+      for (buffer_id_t c = 0; c < children; c++) {
+        gutter_key_t child_keys = (keys + (children - c) - 1) / (children - c);
+        bytes += child_bytes(child_keys);
+        keys  -= child_keys;
+      }
+      first[p + 1]  = first[p] + children;
+      offset[p + 1] = offset[p] + bytes;
     }
+
+    // build the children of each parent in parallel
+    buffers.resize(first[parents], nullptr);
+    parallel_init(parents, [&](size_t lo, size_t hi) {
+      for (buffer_id_t p = lo; p < hi; p++) {
+        gutter_key_t keys    = parent_keys(p);
+        gutter_key_t key     = parent_min(p);
+        buffer_id_t children = num_children(keys);
+        File_Pointer off     = offset[p];
+        for (buffer_id_t c = 0; c < children; c++) {
+          gutter_key_t child_keys = (keys + (children - c) - 1) / (children - c);
+          BufferControlBlock *bcb = new BufferControlBlock(first[p] + c, off, l);
+          bcb->min_key = key;
+          key         += child_keys;
+          bcb->max_key = key - 1;
+          keys        -= child_keys;
+          off         += child_bytes(child_keys);
+
+          if (l != 0)
+            buffers[parent_start + p]->add_child(first[p] + c);
+          buffers[first[p] + c] = bcb;
+        }
+      }
+    }, 1024);
+    size = offset[parents];
+    parent_start = start;
   }
 
     // allocate file space for all the nodes to prevent fragmentation
@@ -164,17 +216,14 @@ void GutterTree::setup_tree() {
 
 // serialize an update to a data location (should only be used for root I think)
 inline void GutterTree::serialize_update(char *dst, update_t src) {
-  node_id_t node1 = src.first;
-  node_id_t node2 = src.second;
-
-  memcpy(dst, &node1, sizeof(node_id_t));
-  memcpy(dst + sizeof(node_id_t), &node2, sizeof(node_id_t));
+  memcpy(dst, &src.first, sizeof(gutter_key_t));
+  memcpy(dst + sizeof(gutter_key_t), &src.second, sizeof(gutter_value_t));
 }
 
 inline update_t GutterTree::deserialize_update(char *src) {
   update_t dst;
-  dst.first  = *((node_id_t *) src);
-  dst.second = *((node_id_t *) (src + sizeof(node_id_t)));
+  memcpy(&dst.first, src, sizeof(gutter_key_t));
+  memcpy(&dst.second, src + sizeof(gutter_key_t), sizeof(gutter_value_t));
 
   return dst;
 }
@@ -187,29 +236,12 @@ inline void GutterTree::copy_serial(char *src, char *dst) {
 /*
  * Load a key from a given location
  */
-inline node_id_t GutterTree::load_key(char *location) {
-  node_id_t key;
-  memcpy(&key, location, sizeof(node_id_t));
+inline gutter_key_t GutterTree::load_key(char *location) {
+  gutter_key_t key;
+  memcpy(&key, location, sizeof(gutter_key_t));
   return key;
 }
 
-/*
- * Helper function which determines which child we should flush to
- */
-inline uint32_t which_child(node_id_t key, node_id_t min_key, node_id_t max_key, uint16_t options) {
-  node_id_t total = max_key - min_key + 1;
-  double div = (double)total / options;
-
-  uint32_t larger_kids = total % options;
-  uint32_t larger_count = larger_kids * ceil(div);
-  node_id_t idx = key - min_key;
-
-  if (idx >= larger_count)
-    return ((idx - larger_count) / (int)div) + larger_kids;
-  else
-    return idx / ceil(div);
-}
-
 /*
  * Perform an insertion to the buffer-tree
  * Insertions always go to the root
@@ -218,7 +250,7 @@ insert_ret_t GutterTree::insert(const update_t &upd) {
   // printf("inserting to gutter_tree . . . \n");
   
   // first calculate which of the roots we're inserting to
-  node_id_t key = upd.first;
+  gutter_key_t key = upd.first;
   buffer_id_t r_id = which_child(key, 0, num_nodes-1, fanout); // TODO: Here we are assuming that num_nodes >= fanout
   BufferControlBlock *root = buffers[r_id];
   // printf("Insertion to buffer %i of size %llu\n", r_id, root->size());
@@ -226,8 +258,8 @@ insert_ret_t GutterTree::insert(const update_t &upd) {
   // perform the write and block if necessary
   while (true) {
     std::unique_lock<std::mutex> lk(BufferControlBlock::buffer_ready_lock);
-    BufferControlBlock::buffer_ready.wait(lk, [root, this]{return (root->size() < buffer_size + page_size);});
-    if (root->size() < buffer_size + page_size) {
+    BufferControlBlock::buffer_ready.wait(lk, [root, this]{return (root->size() + serial_update_size <= buffer_size + page_size);});
+    if (root->size() + serial_update_size <= buffer_size + page_size) {
       lk.unlock();
       root->lock_rw(); // ensure that a worker isn't flushing this node.
       serialize_update(GutterTree::cache + root->size() + root->offset(), upd);
@@ -260,10 +292,31 @@ insert_ret_t GutterTree::insert(const update_t &upd) {
  * currently enforce this by maintaining a lock on a root node while flushing
  * the associated sub-tree
  */
-flush_ret_t GutterTree::do_flush(flush_struct &flush_from, uint32_t data_size, uint32_t begin, 
-  node_id_t min_key, node_id_t max_key, uint16_t options, uint8_t level) {
+size_t GutterTree::flush_root_isolated(const std::vector<update_t> &upds, size_t runs) {
+  flush_struct &flush_from = *flush_data;
+  BufferControlBlock *root = buffers[0];
+  const size_t slots = buffer_size / serial_update_size;
+  const gutter_key_t range = root->max_key - root->min_key + 1;
+  char *data = flush_from.read_buffers[0];
+  for (size_t i = 0; i < slots; i++) {
+    update_t upd = upds[i % upds.size()];
+    upd.first = root->min_key + upd.first % range;
+    serialize_update(data + i * serial_update_size, upd);
+  }
+  for (size_t r = 0; r < runs; r++) {
+    do_flush(flush_from, slots * serial_update_size, root->first_child, root->min_key,
+             root->max_key, root->children_num, 0);
+    for (size_t c = 0; c < root->children_num; c++)
+      buffers[root->first_child + c]->set_size(0);
+  }
+  return slots * serial_update_size;
+}
+
+flush_ret_t GutterTree::do_flush(flush_struct &flush_from, uint32_t data_size, buffer_id_t begin, 
+  gutter_key_t min_key, gutter_key_t max_key, uint16_t options, uint8_t level) {
   // setup
-  uint32_t full_flush = page_size;
+  // largest multiple of the update size that fits in a flush buffer
+  uint32_t full_flush = page_size - page_size % serial_update_size;
 
   char **flush_pos = flush_from.flush_positions[level];
   char **flush_buf = flush_from.flush_buffers[level];
@@ -275,17 +328,19 @@ flush_ret_t GutterTree::do_flush(flush_struct &flush_from, uint32_t data_size, u
   }
 
   while (data - data_start < data_size) { // loop through all the data to be flushed
-    node_id_t key = load_key(data);
+    gutter_key_t key = load_key(data);
     uint32_t child  = which_child(key, min_key, max_key, options);
     if (child > fanout - 1) {
-      printf("ERROR: incorrect child %u abandoning insert key=%u min=%u max=%u\n", child, key, min_key, max_key);
-      printf("first child = %u\n", buffers[begin]->get_id());
+      printf("ERROR: incorrect child %u abandoning insert key=%lu min=%lu max=%lu\n", child,
+        (uint64_t)key, (uint64_t)min_key, (uint64_t)max_key);
+      printf("first child = %lu\n", (uint64_t)buffers[begin]->get_id());
       printf("data pointer = %lu data_start=%lu data_size=%u\n", (uint64_t) data, (uint64_t) data_start, data_size);
       throw KeyIncorrectError();
     }
     if (buffers[child+begin]->min_key > key || buffers[child+begin]->max_key < key) {
-      printf("ERROR: bad key %u for child %u, child min = %u, max = %u\n", 
-        key, child, buffers[child+begin]->min_key, buffers[child+begin]->max_key);
+      printf("ERROR: bad key %lu for child %u, child min = %lu, max = %lu\n", 
+        (uint64_t)key, child, (uint64_t)buffers[child+begin]->min_key,
+        (uint64_t)buffers[child+begin]->max_key);
       throw KeyIncorrectError();
     }
  
@@ -359,14 +414,15 @@ flush_ret_t inline GutterTree::flush_internal_node(flush_struct &flush_from, Buf
 }
 
 // helper function that converts memory address to vector of updates and push to work queue
-void GutterTree::mem_to_wq(node_id_t node_idx, char *mem_addr, uint32_t size) {
-  std::vector<node_id_t> data_vec;
+void GutterTree::mem_to_wq(gutter_key_t node_idx, char *mem_addr, uint32_t size) {
+  std::vector<gutter_value_t> data_vec;
   data_vec.reserve(size / serial_update_size);
   uint32_t offset = 0;
   while (offset < size) {
     update_t upd = deserialize_update(mem_addr + offset);
     if (upd.first != node_idx) {
-      printf("upd key %u and node_idx %u do not match in mem_to_wq()\n", upd.first, node_idx);
+      printf("upd key %lu and node_idx %lu do not match in mem_to_wq()\n", (uint64_t)upd.first,
+        (uint64_t)node_idx);
       printf("offset = %u size = %u\n", offset, size);
       throw KeyIncorrectError();
     }
@@ -412,25 +468,62 @@ flush_ret_t GutterTree::flush_subtree(flush_struct &flush_from, BufferControlBlo
 
   root->lock_flush(); // re-acquire the flush lock for flushing sub-tree
 
-  buffer_id_t first_child = root->first_child;
-  buffer_id_t num_children = root->children_num;
-  for(int l = 0; l < max_level; l++) {
-    buffer_id_t new_first_child  = 0;
-    buffer_id_t new_num_children = 0;
-    for (buffer_id_t idx = 0; idx < num_children; idx++) {
-      BufferControlBlock *cur = buffers[idx + first_child];
-      if (idx == 0) new_first_child = cur->first_child;
-      new_num_children += cur->children_num;
-
+  // flush only the blocks written since the last force flush. Going a level at a time flushes
+  // every block after its parent, and flushing a block only dirties blocks below its level
+  std::vector<std::vector<buffer_id_t>> &dirty = dirty_bcbs[root->get_id()];
+  for (uint8_t l = 1; l < max_level; l++) {
+    for (buffer_id_t id : dirty[l]) {
+      BufferControlBlock *cur = buffers[id];
+      cur->dirty = false;
       flush_control_block(flush_from, cur);
     }
-    first_child  = new_first_child;
-    num_children = new_num_children;
+    dirty[l].clear();
   }
   // done flushing sub-tree so unlock root
   root->unlock_flush();
 }
 
+void GutterTree::mark_dirty(BufferControlBlock *bcb) {
+  buffer_id_t root = which_child(bcb->min_key, 0, num_nodes - 1, fanout);
+  dirty_bcbs[root][bcb->level].push_back(bcb->get_id());
+}
+
+void GutterTree::flush_path(BufferControlBlock *bcb, gutter_key_t lo, gutter_key_t hi) {
+  if (bcb->is_leaf()) return;
+
+  lo = std::max(lo, bcb->min_key);
+  hi = std::min(hi, bcb->max_key);
+  uint32_t first = which_child(lo, bcb->min_key, bcb->max_key, bcb->children_num);
+  uint32_t last  = which_child(hi, bcb->min_key, bcb->max_key, bcb->children_num);
+  for (uint32_t c = first; c <= last; c++) {
+    BufferControlBlock *child = buffers[bcb->first_child + c];
+    flush_control_block(*flush_data, child);
+    flush_path(child, lo, hi);
+  }
+}
+
+flush_ret_t GutterTree::flush_nodes(gutter_key_t lo, gutter_key_t hi) {
+  hi = std::min(hi, num_nodes - 1);
+  if (lo > hi) return;
+
+  // flushed blocks stay in their dirty lists, empty, until the next force_flush()
+  buffer_id_t first = which_child(lo, 0, num_nodes - 1, fanout);
+  buffer_id_t last  = which_child(hi, 0, num_nodes - 1, fanout);
+  for (buffer_id_t r = first; r <= last; r++) {
+    BufferControlBlock *root = buffers[r];
+    flush_control_block(*flush_data, root);
+    root->lock_flush(); // re-acquire the flush lock for flushing below the root
+    flush_path(root, lo, hi);
+    root->unlock_flush();
+  }
+}
+
+void GutterTree::flush_shared() {
+  if (async_flush_data == nullptr) async_flush_data = new flush_struct(this);
+  for (buffer_id_t idx = 0; idx < fanout && idx < buffers.size(); idx++)
+    flush_subtree(*async_flush_data, buffers[idx]);
+}
+
 flush_ret_t GutterTree::force_flush() {
   // Tell the BufferFlushers to flush the entire subtrees
   BufferFlusher::force_flush = true;
@@ -11,6 +11,15 @@ GutteringConfiguration& GutteringConfiguration::set_defaults() {
   if (_num_flushers == uninit_param)     _num_flushers     = 2;
   if (_gutter_bytes == uninit_param)     _gutter_bytes     = 32 * 1024;
   if (_wq_batch_per_elm == uninit_param) _wq_batch_per_elm = 1;
+  if (_batch_sort == uninit_param)       _batch_sort       = NO_SORT;
+  if (_sort_threads == uninit_param)     _sort_threads     = 1;
+  if (_local_radix_bits == uninit_param) _local_radix_bits = 0;
+  if (_leaf_pool_bytes == uninit_param)  _leaf_pool_bytes  = 0;
+  if (_adaptive_leaf_bytes == uninit_param) _adaptive_leaf_bytes = 0;
+  if (_memory_budget == uninit_param)    _memory_budget    = 0;
+  if (_prefault == uninit_param)         _prefault         = false;
+  if (_hub_gutters == uninit_param)      _hub_gutters      = 0;
+  if (_node_id_values == uninit_param)   _node_id_values   = false;
 
   return *this;
 }
@@ -77,14 +86,94 @@ GutteringConfiguration& GutteringConfiguration::wq_batch_per_elm(size_t wq_batch
   return *this;
 }
 
+GutteringConfiguration& GutteringConfiguration::batch_sort(BatchSortMode batch_sort) {
+  _batch_sort = batch_sort;
+  return *this;
+}
+
+GutteringConfiguration& GutteringConfiguration::sort_threads(size_t sort_threads) {
+  _sort_threads = sort_threads;
+  if (_sort_threads > 64 || _sort_threads < 1) {
+    printf("WARNING: sort_threads out of bounds [1,64] using default(1)\n");
+    _sort_threads = 1;
+  }
+  return *this;
+}
+
+GutteringConfiguration& GutteringConfiguration::local_radix_bits(size_t local_radix_bits) {
+  _local_radix_bits = local_radix_bits;
+  if (_local_radix_bits > 16) {
+    printf("WARNING: local_radix_bits out of bounds [0,16] using default(0)\n");
+    _local_radix_bits = 0;
+  }
+  return *this;
+}
+
+GutteringConfiguration& GutteringConfiguration::leaf_pool_bytes(size_t leaf_pool_bytes) {
+  _leaf_pool_bytes = leaf_pool_bytes;
+  return *this;
+}
+
+GutteringConfiguration& GutteringConfiguration::adaptive_leaf_bytes(size_t adaptive_leaf_bytes) {
+  _adaptive_leaf_bytes = adaptive_leaf_bytes;
+  return *this;
+}
+
+GutteringConfiguration& GutteringConfiguration::memory_budget(size_t memory_budget) {
+  _memory_budget = memory_budget;
+  return *this;
+}
+
+GutteringConfiguration& GutteringConfiguration::prefault(bool prefault) {
+  _prefault = prefault;
+  return *this;
+}
+
+GutteringConfiguration& GutteringConfiguration::hub_gutters(size_t hub_gutters) {
+  _hub_gutters = hub_gutters;
+  if (_hub_gutters > 256) {
+    printf("WARNING: hub_gutters out of bounds [0,256] using default(0)\n");
+    _hub_gutters = 0;
+  }
+  return *this;
+}
+
+GutteringConfiguration& GutteringConfiguration::node_id_values(bool node_id_values) {
+  _node_id_values = node_id_values;
+  return *this;
+}
+
 std::ostream& operator<<(std::ostream& out, GutteringConfiguration conf) {
   conf.set_defaults();
 
   out << "GutteringSystem Configuration:" << std::endl;
   out << " Background threads = " << conf._num_flushers << std::endl;
-  out << " Updates per batch  = " << conf._gutter_bytes / sizeof(node_id_t) << std::endl;
+  out << " Updates per batch  = " << conf._gutter_bytes / sizeof(gutter_value_t) << std::endl;
   out << " WQ elements factor = " << conf._queue_factor << std::endl;
   out << " WQ batches per elm = " << conf._wq_batch_per_elm << std::endl;
+  out << " Batch sorting      = ";
+  if (conf._batch_sort == NO_SORT)            out << "none" << std::endl;
+  else if (conf._batch_sort == SORT_ON_FLUSH) out << "on flush" << std::endl;
+  else out << "deferred (" << conf._sort_threads << " threads)" << std::endl;
+  out << " Memory budget      = ";
+  if (conf._memory_budget == 0) out << "unlimited" << std::endl;
+  else out << conf._memory_budget / 1024 << " KiB" << std::endl;
+  out << " Prefault memory    = " << (conf._prefault ? "yes" : "no") << std::endl;
+  out << " Hub gutters        = ";
+  if (conf._hub_gutters == 0) out << "none" << std::endl;
+  else out << conf._hub_gutters << " per inserter" << std::endl;
+  out << " StandAloneGutters params:" << std::endl;
+  out << "  Local stage       = ";
+  if (conf._local_radix_bits == 0) out << "per node" << std::endl;
+  else out << (1 << conf._local_radix_bits) << " radix buckets" << std::endl;
+  out << " CacheGuttering params:" << std::endl;
+  out << "  Leaf pool (KiB)   = ";
+  if (conf._leaf_pool_bytes == 0) out << "unlimited" << std::endl;
+  else out << conf._leaf_pool_bytes / 1024 << std::endl;
+  out << "  Leaf sizing       = ";
+  if (conf._adaptive_leaf_bytes == 0) out << "fixed" << std::endl;
+  else out << "adaptive, " << conf._adaptive_leaf_bytes << " bytes on average" << std::endl;
+  out << "  Packed slots      = " << (conf._node_id_values ? "if they fit" : "no") << std::endl;
   out << " GutterTree params:"    << std::endl;
   out << "  Write granularity = " << conf._page_size << std::endl;
   out << "  Buffer size (KiB) = " << conf._buffer_size / 1024 << std::endl;
@@ -0,0 +1,101 @@
+#include "../include/hub_gutters.h"
+
+#include <algorithm>
+
+// multipliers of the sketch's row hashes
+static constexpr uint64_t row_mult[] = {0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full};
+
+// the slot table holds at least 4 slots per hub so that hubs rarely collide
+static size_t slot_table_size(size_t max_hubs) {
+  size_t num_slots = 64;
+  while (num_slots < 4 * max_hubs) num_slots *= 2;
+  return num_slots;
+}
+
+HubGutters::HubGutters(size_t max_hubs, size_t gutter_elms)
+    : max_hubs(max_hubs), gutter_elms(gutter_elms), sketch(sketch_depth * sketch_width, 0) {
+  size_t num_slots = slot_table_size(max_hubs);
+  slots.resize(num_slots);
+  slot_mask = num_slots - 1;
+  hubs.reserve(max_hubs);
+}
+
+void HubGutters::sample(gutter_key_t key) {
+  ++samples;
+  rng_state ^= rng_state << 13; // xorshift64
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  until_sample = 1 + (rng_state & (2 * sample_period - 2)); // mean of sample_period
+  uint16_t estimate = UINT16_MAX;
+  for (size_t r = 0; r < sketch_depth; r++) {
+    const size_t col = (uint64_t(key) * row_mult[r]) >> (64 - sketch_bits);
+    uint16_t &counter = sketch[r * sketch_width + col];
+    if (counter < UINT16_MAX) ++counter;
+    estimate = std::min(estimate, counter);
+  }
+
+  Slot &slot = slots[key & slot_mask];
+  if (estimate >= (window >> hub_share_bits) && hubs.size() < max_hubs && slot.hub == no_hub) {
+    Hub hub;
+    hub.key = key;
+    hub.buffer.reserve(gutter_elms);
+    slot.key = key;
+    slot.hub = hubs.size();
+    hubs.push_back(std::move(hub));
+  }
+}
+
+void HubGutters::end_window(WorkQueue &wq) {
+  size_t inserts = samples * sample_period;
+  for (auto &hub : hubs) inserts += hub.hits;
+  for (size_t i = hubs.size(); i-- > 0;) {
+    if (hubs[i].hits < (inserts >> hub_share_bits))
+      remove(i, wq);
+    else
+      hubs[i].hits = 0;
+  }
+  for (auto &counter : sketch) counter /= 2;
+  samples = 0;
+}
+
+void HubGutters::push(Hub &hub, WorkQueue &wq) {
+  batch_vec.resize(1);
+  batch_vec[0].node_idx = hub.key;
+  std::swap(batch_vec[0].upd_vec, hub.buffer);
+  wq.push(batch_vec); // returns the batches of an empty queue element for reuse
+  hub.buffer.swap(batch_vec[0].upd_vec);
+  hub.buffer.clear();
+  hub.buffer.reserve(gutter_elms);
+}
+
+void HubGutters::remove(size_t idx, WorkQueue &wq) {
+  if (!hubs[idx].buffer.empty()) push(hubs[idx], wq);
+  slots[hubs[idx].key & slot_mask].hub = no_hub;
+  if (idx != hubs.size() - 1) {
+    hubs[idx] = std::move(hubs.back());
+    slots[hubs[idx].key & slot_mask].hub = idx;
+  }
+  hubs.pop_back();
+}
+
+void HubGutters::flush(WorkQueue &wq) {
+  for (auto &hub : hubs)
+    if (!hub.buffer.empty()) push(hub, wq);
+}
+
+void HubGutters::flush_range(gutter_key_t lo, gutter_key_t hi, WorkQueue &wq) {
+  for (auto &hub : hubs)
+    if (hub.key >= lo && hub.key <= hi && !hub.buffer.empty()) push(hub, wq);
+}
+
+std::vector<gutter_key_t> HubGutters::get_hubs() {
+  std::vector<gutter_key_t> keys;
+  for (auto &hub : hubs) keys.push_back(hub.key);
+  return keys;
+}
+
+size_t HubGutters::memory_bytes(size_t max_hubs, size_t gutter_elms) {
+  return sizeof(HubGutters) + sketch_depth * sketch_width * sizeof(uint16_t) +
+         slot_table_size(max_hubs) * sizeof(Slot) +
+         max_hubs * (sizeof(Hub) + gutter_elms * sizeof(gutter_value_t));
+}
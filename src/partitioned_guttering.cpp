@@ -0,0 +1,244 @@
+#include "../include/partitioned_guttering.h"
+#include "../include/cache_guttering.h"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "ring indices must be lock free to be shared");
+
+// Spin briefly, then yield, then sleep. Returns true every 64 sleeps, when a waiter should
+// check that the other side of the ring is still alive
+static bool backoff(size_t &spins) {
+  ++spins;
+  if (spins < 256) return false;
+  if (spins < 1024) {
+    std::this_thread::yield();
+    return false;
+  }
+  usleep(100);
+  return spins % 64 == 0;
+}
+
+PartitionedGuttering::SystemFactory PartitionedGuttering::cache_guttering(
+    uint32_t workers, GutteringConfiguration conf) {
+  return [workers, conf](gutter_key_t first, gutter_key_t nodes) -> GutteringSystem * {
+    CacheGuttering *gts = new CacheGuttering(nodes, workers, 1, conf);
+    gts->set_offset(first);
+    return gts;
+  };
+}
+
+PartitionedGuttering::PartitionedGuttering(gutter_key_t num_nodes, size_t partitions,
+                                           SystemFactory make_system, BatchConsumer consume,
+                                           size_t consumers, size_t ring_blocks)
+    : ring_blocks(ring_blocks), make_system(make_system), consume(consume),
+      consumers(consumers), router_pid(getpid()) {
+  partitions = std::max(std::min(partitions, size_t(num_nodes)), size_t(1));
+  block_bytes = sysconf(_SC_PAGE_SIZE);
+  block_slots = (block_bytes - sizeof(BlockHeader)) / sizeof(update_t);
+  ring_bytes = block_bytes * (ring_blocks + 1); // the ring's head takes the first page
+  part_nodes = (num_nodes + partitions - 1) / partitions;
+  partitions = (num_nodes + part_nodes - 1) / part_nodes;
+
+  // the rings are mapped before forking, so that every worker shares its ring with the router
+  parts.resize(partitions);
+  for (size_t p = 0; p < partitions; p++) {
+    Partition &part = parts[p];
+    part.first = p * part_nodes;
+    part.nodes = std::min(part_nodes, gutter_key_t(num_nodes - part.first));
+    void *mem = mmap(nullptr, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                     -1, 0);
+    if (mem == MAP_FAILED) {
+      const int err = errno;
+      unmap_rings();
+      throw std::runtime_error(std::string("PartitionedGuttering: mmap failed: ") +
+                               strerror(err));
+    }
+    part.ring = new (mem) Ring();
+    part.blocks = static_cast<char *>(mem) + block_bytes;
+  }
+
+  // flush buffered output so that the workers do not repeat it
+  std::cout.flush();
+  fflush(stdout);
+  for (auto &part : parts) {
+    part.pid = fork();
+    if (part.pid == 0) run_worker(part);
+    if (part.pid < 0) {
+      const int err = errno;
+      // this partition and those after it have no worker to stop
+      for (Partition *p = &part; p != parts.data() + parts.size(); p++)
+        p->failed = p->exited = true;
+      finish();
+      unmap_rings();
+      throw std::runtime_error(std::string("PartitionedGuttering: fork failed: ") +
+                               strerror(err));
+    }
+  }
+}
+
+PartitionedGuttering::~PartitionedGuttering() {
+  if (!finished) finish();
+  unmap_rings();
+}
+
+void PartitionedGuttering::unmap_rings() {
+  for (auto &part : parts) {
+    if (part.ring != nullptr) munmap(part.ring, ring_bytes);
+    part.ring = nullptr;
+  }
+}
+
+bool PartitionedGuttering::alive(Partition &part) {
+  if (part.exited) return false;
+  int status = 0;
+  pid_t ret;
+  while ((ret = waitpid(part.pid, &status, WNOHANG)) == -1 && errno == EINTR) {}
+  if (ret == 0) return true;
+  // the worker exited, or can no longer be waited for (SIGCHLD ignored or reaped elsewhere)
+  part.exited = true;
+  part.failed = true; // workers only exit when told to
+  printf("WARNING: PartitionedGuttering: worker of partition %lu exited, dropping its updates\n",
+         &part - parts.data());
+  return false;
+}
+
+bool PartitionedGuttering::open_block(Partition &part) {
+  if (part.failed) return false;
+  size_t spins = 0;
+  while (part.head - part.ring->tail.load(std::memory_order_acquire) >= ring_blocks) {
+    if (backoff(spins) && !alive(part)) return false;
+  }
+  part.slots = reinterpret_cast<update_t *>(block(part, part.head) + 1);
+  part.count = 0;
+  return true;
+}
+
+void PartitionedGuttering::publish(Partition &part) {
+  BlockHeader *header = block(part, part.head);
+  header->kind = DATA;
+  header->count = part.count;
+  part.ring->head.store(++part.head, std::memory_order_release);
+  part.slots = nullptr;
+}
+
+bool PartitionedGuttering::send_control(Partition &part, BlockKind kind) {
+  if (part.slots != nullptr) publish(part);
+  if (!open_block(part)) return false;
+  BlockHeader *header = block(part, part.head);
+  header->kind = kind;
+  header->count = 0;
+  part.ring->head.store(++part.head, std::memory_order_release);
+  part.slots = nullptr;
+  return true;
+}
+
+flush_ret_t PartitionedGuttering::force_flush() {
+  for (auto &part : parts)
+    if (send_control(part, FLUSH)) ++part.flushes;
+  for (auto &part : parts) {
+    size_t spins = 0;
+    while (!part.failed && part.ring->flushed.load(std::memory_order_acquire) < part.flushes) {
+      if (backoff(spins)) alive(part);
+    }
+  }
+}
+
+void PartitionedGuttering::reap(Partition &part) {
+  if (part.exited) return;
+  int status = 0;
+  while (waitpid(part.pid, &status, 0) != part.pid) {
+    if (errno != EINTR) {
+      // the worker can no longer be waited for and status was never set
+      part.failed = true;
+      part.exited = true;
+      return;
+    }
+  }
+  part.exited = true;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    part.failed = true;
+    printf("WARNING: PartitionedGuttering: worker of partition %lu failed\n",
+           &part - parts.data());
+  }
+}
+
+size_t PartitionedGuttering::finish() {
+  if (finished) return failed_partitions().size();
+  finished = true;
+  for (auto &part : parts)
+    if (!part.failed) send_control(part, END);
+  for (auto &part : parts)
+    if (part.pid > 0) reap(part);
+  return failed_partitions().size();
+}
+
+std::vector<size_t> PartitionedGuttering::failed_partitions() {
+  std::vector<size_t> failed;
+  for (size_t p = 0; p < parts.size(); p++)
+    if (parts[p].failed) failed.push_back(p);
+  return failed;
+}
+
+void PartitionedGuttering::run_worker(Partition &part) {
+  int status = 0;
+  try {
+    std::unique_ptr<GutteringSystem> gts(make_system(part.first, part.nodes));
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads;
+    for (size_t c = 0; c < consumers; c++) {
+      threads.emplace_back([&]() {
+        WorkQueue::DataNode *data;
+        while (true) {
+          if (gts->get_data(data)) {
+            for (auto &batch : data->get_batches())
+              if (!batch.upd_vec.empty()) consume(batch);
+            gts->get_data_callback(data);
+          }
+          else if (done)
+            return;
+        }
+      });
+    }
+
+    Ring &ring = *part.ring;
+    for (uint64_t tail = 0;; ) {
+      size_t spins = 0;
+      while (ring.head.load(std::memory_order_acquire) == tail) {
+        if (backoff(spins) && getppid() != router_pid) _exit(1); // the router is gone
+      }
+      const BlockHeader *header = block(part, tail);
+      const BlockKind kind = BlockKind(header->kind);
+      const update_t *upds = reinterpret_cast<const update_t *>(header + 1);
+      for (uint32_t i = 0; i < header->count; i++)
+        gts->insert(upds[i], 0);
+      ring.tail.store(++tail, std::memory_order_release);
+      if (kind == FLUSH) {
+        gts->force_flush();
+        ring.flushed.fetch_add(1, std::memory_order_release);
+      }
+      if (kind == END) break;
+    }
+
+    gts->force_flush();
+    done = true;
+    gts->set_non_block(true); // wake the consumers once the queue is drained
+    for (auto &thr : threads)
+      thr.join();
+  } catch (std::exception &e) {
+    std::cerr << "PartitionedGuttering: worker of partition " << &part - parts.data()
+              << " failed: " << e.what() << std::endl;
+    status = 1;
+  }
+  std::cout.flush();
+  fflush(stdout);
+  _exit(status);
+}
@@ -0,0 +1,248 @@
+#include "../include/shm_work_queue.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared atomics must be lock free");
+
+static std::runtime_error shm_error(const std::string &what, const std::string &name) {
+  return std::runtime_error("ShmWorkQueue: " + what + " " + name + ": " + strerror(errno));
+}
+
+// whether the segment called name was left behind by a creator process that has since exited.
+// A segment whose creator cannot be read, for example one still being set up, is not stale
+static bool stale_segment(const std::string &name) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd == -1) return errno == ENOENT;
+  struct stat st;
+  pid_t pid = 0;
+  if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(ShmWorkQueue::Header)) {
+    void *mem = mmap(nullptr, sizeof(ShmWorkQueue::Header), PROT_READ, MAP_SHARED, fd, 0);
+    if (mem != MAP_FAILED) {
+      pid = pid_t(static_cast<ShmWorkQueue::Header *>(mem)->creator_pid);
+      munmap(mem, sizeof(ShmWorkQueue::Header));
+    }
+  }
+  ::close(fd);
+  return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+// wait a little longer on every call, from spinning up to sleeping
+static void backoff(size_t &spins) {
+  if (++spins < 256) return;
+  if (spins < 1024) std::this_thread::yield();
+  else usleep(50);
+}
+
+ShmWorkQueue::ShmWorkQueue(const std::string &name, size_t num_slots, size_t slot_values)
+    : name(name), creator(true) {
+  size_t slots = 1;
+  while (slots < num_slots) slots *= 2;
+  const size_t slot_bytes = (sizeof(SlotHeader) + slot_values * sizeof(gutter_value_t) + 63) / 64
+                            * 64;
+  const size_t cells_offset = (sizeof(Header) + 63) / 64 * 64;
+  const size_t slots_offset = (cells_offset + 2 * slots * sizeof(Cell) + 4095) / 4096 * 4096;
+
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd == -1 && errno == EEXIST) {
+    if (!stale_segment(name))
+      throw std::runtime_error("ShmWorkQueue: " + name + " already exists and may be in use, "
+                               "remove it with shm_unlink if it is not");
+    // left behind by a producer that did not exit cleanly
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+  }
+  if (fd == -1) throw shm_error("cannot create", name);
+  if (ftruncate(fd, slots_offset + slots * slot_bytes) != 0) {
+    ::close(fd);
+    shm_unlink(name.c_str());
+    throw shm_error("cannot size", name);
+  }
+  map(fd, slots_offset + slots * slot_bytes);
+
+  header = new (segment) Header();
+  header->creator_pid = uint32_t(getpid());
+  header->version = layout_version;
+  header->key_bytes = sizeof(gutter_key_t);
+  header->value_bytes = sizeof(gutter_value_t);
+  header->num_slots = slots;
+  header->slot_values = slot_values;
+  header->slot_bytes = slot_bytes;
+  header->cells_offset = cells_offset;
+  header->slots_offset = slots_offset;
+  free_cells = reinterpret_cast<Cell *>(segment + cells_offset);
+  ready_cells = free_cells + slots;
+  for (uint64_t i = 0; i < slots; i++) {
+    new (&free_cells[i]) Cell();
+    new (&ready_cells[i]) Cell();
+    free_cells[i].seq.store(i, std::memory_order_relaxed);
+    ready_cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+  // every slot starts out free
+  for (uint64_t i = 0; i < slots; i++)
+    enqueue(header->free_ring, free_cells, i);
+  header->magic.store(magic_number, std::memory_order_release);
+}
+
+ShmWorkQueue::ShmWorkQueue(const std::string &name) : name(name), creator(false) {
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd == -1) throw shm_error("cannot open", name);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw shm_error("cannot stat", name);
+  }
+  // the creator sizes the segment and then writes the header, magic last
+  if (size_t(st.st_size) < sizeof(Header)) {
+    ::close(fd);
+    throw ShmNotReady("ShmWorkQueue: " + name + " is not set up yet");
+  }
+  map(fd, st.st_size);
+  header = reinterpret_cast<Header *>(segment);
+  const uint64_t magic = header->magic.load(std::memory_order_acquire);
+  if (magic == 0) {
+    munmap(segment, segment_bytes);
+    throw ShmNotReady("ShmWorkQueue: " + name + " is not set up yet");
+  }
+  if (magic != magic_number || header->version != layout_version ||
+      header->key_bytes != sizeof(gutter_key_t) || header->value_bytes != sizeof(gutter_value_t)) {
+    munmap(segment, segment_bytes);
+    throw std::runtime_error("ShmWorkQueue: " + name + " has a different layout");
+  }
+  // the rings and slots must lie inside the mapping, each comparison guarding the next against
+  // overflow
+  const uint64_t slots = header->num_slots;
+  const bool fits =
+      slots != 0 && (slots & (slots - 1)) == 0 &&
+      header->slot_bytes >= sizeof(SlotHeader) && header->slot_bytes % alignof(SlotHeader) == 0 &&
+      header->slot_values <= (header->slot_bytes - sizeof(SlotHeader)) / sizeof(gutter_value_t) &&
+      header->cells_offset >= sizeof(Header) && header->cells_offset % alignof(Cell) == 0 &&
+      header->cells_offset <= segment_bytes &&
+      slots <= (segment_bytes - header->cells_offset) / (2 * sizeof(Cell)) &&
+      header->slots_offset >= header->cells_offset + 2 * slots * sizeof(Cell) &&
+      header->slots_offset <= segment_bytes && header->slots_offset % alignof(SlotHeader) == 0 &&
+      slots <= (segment_bytes - header->slots_offset) / header->slot_bytes;
+  if (!fits) {
+    munmap(segment, segment_bytes);
+    throw std::runtime_error("ShmWorkQueue: " + name + " is truncated or its geometry is bad");
+  }
+  free_cells = reinterpret_cast<Cell *>(segment + header->cells_offset);
+  ready_cells = free_cells + header->num_slots;
+}
+
+ShmWorkQueue::~ShmWorkQueue() {
+  munmap(segment, segment_bytes);
+  if (creator) shm_unlink(name.c_str());
+}
+
+void ShmWorkQueue::map(int fd, size_t bytes) {
+  void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mem == MAP_FAILED) {
+    if (creator) shm_unlink(name.c_str());
+    throw shm_error("cannot map", name);
+  }
+  segment = static_cast<char *>(mem);
+  segment_bytes = bytes;
+}
+
+bool ShmWorkQueue::enqueue(RingHead &ring, Cell *cells, uint64_t value) {
+  const uint64_t mask = header->num_slots - 1;
+  uint64_t pos = ring.enqueue_pos.load(std::memory_order_relaxed);
+  Cell *cell;
+  while (true) {
+    cell = &cells[pos & mask];
+    const int64_t diff = int64_t(cell->seq.load(std::memory_order_acquire)) - int64_t(pos);
+    if (diff == 0) {
+      if (ring.enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+      return false; // full
+    else
+      pos = ring.enqueue_pos.load(std::memory_order_relaxed);
+  }
+  cell->slot = value;
+  cell->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool ShmWorkQueue::dequeue(RingHead &ring, Cell *cells, uint64_t &value) {
+  const uint64_t mask = header->num_slots - 1;
+  uint64_t pos = ring.dequeue_pos.load(std::memory_order_relaxed);
+  Cell *cell;
+  while (true) {
+    cell = &cells[pos & mask];
+    const int64_t diff = int64_t(cell->seq.load(std::memory_order_acquire)) - int64_t(pos + 1);
+    if (diff == 0) {
+      if (ring.dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+      return false; // empty
+    else
+      pos = ring.dequeue_pos.load(std::memory_order_relaxed);
+  }
+  value = cell->slot;
+  cell->seq.store(pos + mask + 1, std::memory_order_release);
+  return true;
+}
+
+void ShmWorkQueue::push(std::vector<update_batch> &upd_vec_batch) {
+  for (auto &batch : upd_vec_batch) {
+    if (batch.upd_vec.size() > header->slot_values)
+      throw WriteTooBig("ShmWorkQueue: Batch is too big " + std::to_string(batch.upd_vec.size())
+        + " > " + std::to_string(header->slot_values));
+  }
+  for (auto &batch : upd_vec_batch) {
+    if (batch.upd_vec.empty()) continue;
+    uint64_t idx;
+    size_t spins = 0;
+    while (!dequeue(header->free_ring, free_cells, idx))
+      backoff(spins); // full, wait for the consumers
+    SlotHeader *dst = slot(idx);
+    dst->node_idx = batch.node_idx;
+    dst->count = batch.upd_vec.size();
+    std::copy(batch.upd_vec.begin(), batch.upd_vec.end(),
+              reinterpret_cast<gutter_value_t *>(dst + 1));
+    enqueue(header->ready_ring, ready_cells, idx);
+    batch.upd_vec.clear();
+  }
+}
+
+void ShmWorkQueue::close() {
+  header->closed.store(1, std::memory_order_release);
+}
+
+bool ShmWorkQueue::peek(Batch &batch) {
+  uint64_t idx;
+  size_t spins = 0;
+  while (!dequeue(header->ready_ring, ready_cells, idx)) {
+    if (header->closed.load(std::memory_order_acquire)) {
+      // batches pushed before the close are visible now
+      if (dequeue(header->ready_ring, ready_cells, idx)) break;
+      return false;
+    }
+    if (non_block) return false;
+    backoff(spins);
+  }
+  const SlotHeader *src = slot(idx);
+  batch.node_idx = src->node_idx;
+  batch.count = src->count;
+  batch.values = reinterpret_cast<const gutter_value_t *>(src + 1);
+  batch.slot = idx;
+  return true;
+}
+
+void ShmWorkQueue::peek_callback(const Batch &batch) {
+  enqueue(header->free_ring, free_cells, batch.slot);
+}
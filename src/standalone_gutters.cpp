@@ -1,67 +1,335 @@
+#include <algorithm>
 #include <cassert>
 #include <fstream>
+#include <thread>
 #include "../include/standalone_gutters.h"
 
 #ifdef LINUX_FALLOCATE
 #include <omp.h>
 #endif
 
-StandAloneGutters::StandAloneGutters(node_id_t num_nodes, uint32_t workers, uint32_t inserters,
+StandAloneGutters::StandAloneGutters(gutter_key_t num_nodes, uint32_t workers, uint32_t inserters,
                                      GutteringConfiguration conf)
-    : GutteringSystem(num_nodes, workers, conf), gutters(num_nodes), inserters(inserters) {
-  for (node_id_t i = 0; i < num_nodes; ++i) {
-    gutters[i].buffer.reserve(leaf_gutter_size);
+    : GutteringSystem(num_nodes, workers, conf), inserters(inserters), local_buffers(inserters) {
+  // force_flush() threads take a spare each too
+  spares = std::vector<Spare>(std::max((int) inserters, omp_get_max_threads()) + 1);
+
+  // per node local gutters that do not fit the memory budget are replaced by a radix stage
+  radix_bits = local_radix_bits;
+  if (memory_budget != 0 && radix_bits == 0 && memory_plan(0).total() > memory_budget) {
+    radix_bits = budget_radix_bits;
+    printf("WARNING: local gutters exceed the memory budget, using %lu radix bits\n",
+           radix_bits);
   }
-  local_buffers.reserve(inserters);
-  for (node_id_t i = 0; i < inserters; ++i) {
-    local_buffers.emplace_back(num_nodes);
+  check_memory_budget("StandAloneGutters", memory_plan(radix_bits));
+
+  gutters = std::vector<Gutter>(num_nodes);
+  init_inserter_epochs(inserters);
+  if (hub_gutters > 0)
+    hubs = std::vector<HubGutters>(inserters, HubGutters(hub_gutters, leaf_gutter_size));
+  const size_t bitmap_words = (size_t(num_nodes) + 63) / 64;
+  dirty_gutters = std::vector<std::atomic<uint64_t>>(bitmap_words);
+  const size_t num_buffers = size_t(num_nodes) + spares.size();
+  slab.reset(new gutter_value_t[num_buffers * leaf_gutter_size]);
+  parallel_init(num_buffers, [&](size_t lo, size_t hi) {
+    for (size_t i = lo; i < hi; ++i) {
+      gutter_value_t *buffer = &slab[i * leaf_gutter_size];
+      if (i < num_nodes) gutters[i].buffer = buffer;
+      else spares[i - num_nodes].buffer = buffer;
+      if (prefault)
+        prefault_pages(buffer, leaf_gutter_size * sizeof(gutter_value_t));
+    }
+  });
+  if (radix_bits > 0) {
+    int key_bits = 0;
+    while (key_bits < (int) sizeof(gutter_key_t) * 8 && (gutter_key_t(1) << key_bits) < num_nodes)
+      ++key_bits;
+    radix_shift = std::max(key_bits - (int) radix_bits, 0);
+    size_t buckets = ((num_nodes - 1) >> radix_shift) + 1;
+    bucket_size = std::max(radix_stage_bytes / buckets / sizeof(update_t), size_t(local_buf_size));
+
+    local_buffers.clear();
+    radix_stages.resize(inserters);
+    for (auto &stage : radix_stages) {
+      stage.slots.resize(buckets * bucket_size);
+      stage.counts.assign(buckets, 0);
+    }
+    return;
   }
+
+  // each inserter's local gutters are zeroed, and so faulted in, by the thread that builds them
+  dirty_local.resize(inserters);
+  parallel_init(inserters, [&](size_t lo, size_t hi) {
+    for (size_t i = lo; i < hi; ++i) {
+      local_buffers[i].resize(num_nodes);
+      dirty_local[i].assign(bitmap_words, 0);
+    }
+  }, 1);
 }
 
-insert_ret_t StandAloneGutters::insert(const update_t &upd, size_t which) {
+MemoryUsage StandAloneGutters::memory_plan(size_t radix_bits) {
+  const size_t bitmap_words = (size_t(num_nodes) + 63) / 64;
+  MemoryUsage usage;
+  usage.work_queue = wq.memory_bytes();
+  usage.gutters = (size_t(num_nodes) + spares.size()) * leaf_gutter_size * sizeof(gutter_value_t);
+  if (radix_bits > 0) {
+    // at least local_buf_size slots per bucket
+    const size_t buckets = size_t(1) << radix_bits;
+    usage.local = inserters * (std::max(size_t(radix_stage_bytes), buckets * local_buf_size *
+                                        sizeof(update_t)) + buckets * sizeof(uint32_t));
+  }
+  else
+    usage.local = inserters * (size_t(num_nodes) * sizeof(LocalGutter) + bitmap_words * 8);
+  if (hub_gutters > 0)
+    usage.local += inserters * HubGutters::memory_bytes(hub_gutters, leaf_gutter_size);
+  usage.internal = size_t(num_nodes) * sizeof(Gutter) + bitmap_words * 8 +
+                   spares.size() * (sizeof(Spare) + sizeof(update_batch));
+  return usage;
+}
+
+MemoryUsage StandAloneGutters::memory_usage() {
+  return memory_plan(radix_bits);
+}
+
+inline void StandAloneGutters::insert_unchecked(const update_t &upd, size_t which) {
+  if (hub_gutters > 0 && hubs[which].insert(upd, wq)) return;
+  if (bucket_size > 0) {
+    RadixStage &stage = radix_stages[which];
+    size_t bucket = upd.first >> radix_shift;
+    stage.slots[bucket * bucket_size + stage.counts[bucket]++] = upd;
+    if (stage.counts[bucket] == bucket_size)
+      flush_bucket(stage, bucket, spares[which]);
+    return;
+  }
   LocalGutter &lgutter = local_buffers[which][upd.first];
+  if (lgutter.count == 0)
+    dirty_local[which][upd.first / 64] |= uint64_t(1) << (upd.first % 64);
 	lgutter.buffer[lgutter.count++] = upd.second;
   if (lgutter.count == local_buf_size) { // full, so request flush
-    const std::lock_guard<std::mutex> lock(gutters[upd.first].mux);
-    insert_batch(which, upd.first);
-		lgutter.count = 0;
+    insert_batch(which, upd.first, spares[which]);
   }
 }
+insert_ret_t StandAloneGutters::insert(const update_t &upd, size_t which) {
+  check_epoch(which);
+  insert_unchecked(upd, which);
+}
 insert_ret_t StandAloneGutters::insert(const update_t &upd) {
   insert(upd, 0);
 }
+insert_ret_t StandAloneGutters::insert_updates(const update_t *upds, size_t count,
+                                               size_t which) {
+  check_epoch(which);
+  for (size_t i = 0; i < count; i++) insert_unchecked(upds[i], which);
+}
 
-// We already hold the lock on both buffers
-insert_ret_t StandAloneGutters::insert_batch(size_t which, node_id_t gutterid) {
+void StandAloneGutters::append(gutter_key_t gutterid, const gutter_value_t *values, size_t count,
+                               Spare &spare) {
   Gutter &gutter = gutters[gutterid];
-  LocalGutter &lgutter = local_buffers[which][gutterid];
-  std::vector<node_id_t> &ptr = gutter.buffer;
-
-  for (size_t i = 0; i < lgutter.count; i++) {
-    ptr.push_back(lgutter.buffer[i]);
-    if (ptr.size() == leaf_gutter_size) { // full, so request flush
-      std::vector<update_batch> batch_vec;
-      batch_vec.push_back({gutterid, ptr});
-      wq.push(batch_vec);
-      ptr.clear();
+  const uint32_t capacity = leaf_gutter_size;
+  while (count > 0) {
+    uint32_t start = gutter.reserved.fetch_add(count, std::memory_order_acquire);
+    if (start == 0) {
+      std::atomic<uint64_t> &word = dirty_gutters[gutterid / 64];
+      const uint64_t bit = uint64_t(1) << (gutterid % 64);
+      if ((word.load(std::memory_order_relaxed) & bit) == 0)
+        word.fetch_or(bit, std::memory_order_relaxed);
+    }
+    if (start >= capacity) {
+      // full, wait for the thread that completed it to swap the buffer
+      while (gutter.reserved.load(std::memory_order_acquire) >= capacity)
+        std::this_thread::yield();
+      continue;
+    }
+    uint32_t written = std::min(size_t(capacity - start), count);
+    std::copy(values, values + written, gutter.buffer + start);
+    values += written;
+    count  -= written;
+
+    if (gutter.committed.fetch_add(written, std::memory_order_acq_rel) + written == capacity) {
+      // we wrote the last slot, so every slot is written and no one else uses the buffer
+      gutter_value_t *full = gutter.buffer;
+      gutter.buffer = spare.buffer;
+      const uint64_t push = spare.pushes_begun.load(std::memory_order_relaxed) + 1;
+      spare.pushes_begun.store(push, std::memory_order_relaxed);
+      gutter.committed.store(0, std::memory_order_relaxed);
+      gutter.reserved.store(0, std::memory_order_release);
+
+      spare.buffer = full;
+      push_buffer(gutterid, full, capacity, spare);
+      spare.pushes_done.store(push, std::memory_order_release);
     }
   }
+}
+
+inline void StandAloneGutters::prefetch_slot(gutter_key_t gutterid) {
+#ifdef __GNUC__
+  const Gutter &gutter = gutters[gutterid];
+  uint32_t slot = std::min(gutter.reserved.load(std::memory_order_relaxed),
+                           uint32_t(leaf_gutter_size - 1));
+  __builtin_prefetch(gutter.buffer + slot, 1);
+#else
+  (void) gutterid;
+#endif
+}
+
+void StandAloneGutters::push_buffer(gutter_key_t gutterid, const gutter_value_t *buffer,
+                                    size_t count, Spare &spare) {
+  spare.batch_vec.resize(1);
+  spare.batch_vec[0].node_idx = gutterid;
+  spare.batch_vec[0].upd_vec.assign(buffer, buffer + count);
+  wq.push(spare.batch_vec); // returns the batches of an empty queue element for reuse
+}
+
+insert_ret_t StandAloneGutters::insert_batch(size_t which, gutter_key_t gutterid, Spare &spare) {
+  LocalGutter &lgutter = local_buffers[which][gutterid];
+  append(gutterid, lgutter.buffer, lgutter.count, spare);
 	lgutter.count = 0;
 }
 
-flush_ret_t StandAloneGutters::force_flush() {
-#pragma omp parallel for num_threads(omp_get_max_threads() / 2)
-  for (node_id_t node_idx = 0; node_idx < gutters.size(); node_idx++) {
-    const std::lock_guard<std::mutex> lock(gutters[node_idx].mux);
-    for (uint32_t which = 0; which < inserters; which++) {
-      //const std::lock_guard<std::mutex> lock(local_buffers[which][node_idx].mux);
-      insert_batch(which, node_idx);
+void StandAloneGutters::flush_bucket(RadixStage &stage, size_t bucket, Spare &spare) {
+  update_t *begin = &stage.slots[bucket * bucket_size];
+  update_t *end   = begin + stage.counts[bucket];
+  std::sort(begin, end, [](const update_t &a, const update_t &b) { return a.first < b.first; });
+
+  // committing to a gutter waits for the write to its buffer, so bring the next free slot of
+  // the gutters a few updates ahead into the cache
+  gutter_value_t values[local_buf_size];
+  for (update_t *run = begin; run < end;) {
+    const gutter_key_t gutterid = run->first;
+    size_t count = 0;
+    for (; run < end && run->first == gutterid; ++run) {
+      if (run + gutter_prefetch < end)
+        prefetch_slot(run[gutter_prefetch].first);
+      values[count++] = run->second;
+      if (count == local_buf_size) {
+        append(gutterid, values, count, spare);
+        count = 0;
+      }
+    }
+    append(gutterid, values, count, spare);
+  }
+  stage.counts[bucket] = 0;
+}
+
+template <class Bitmap, class F>
+void StandAloneGutters::for_each_dirty(Bitmap &bitmap, size_t word, F f) {
+  uint64_t bits = bitmap[word];
+  bitmap[word] = 0;
+  while (bits != 0) {
+    f(gutter_key_t(word * 64 + __builtin_ctzll(bits)));
+    bits &= bits - 1;
+  }
+}
+
+void StandAloneGutters::hand_off(size_t which) {
+  Spare &spare = spares[which];
+  if (hub_gutters > 0) hubs[which].flush(wq);
+  if (which < radix_stages.size()) {
+    for (size_t bucket = 0; bucket < radix_stages[which].counts.size(); bucket++)
+      flush_bucket(radix_stages[which], bucket, spare);
+  }
+  else {
+    for (size_t word = 0; word < dirty_local[which].size(); word++) {
+      for_each_dirty(dirty_local[which], word, [&](gutter_key_t node_idx) {
+        insert_batch(which, node_idx, spare);
+      });
     }
-    if (!gutters[node_idx].buffer.empty()) { // have stuff to flush
-      std::vector<update_batch> batch_vec;
-      batch_vec.push_back({node_idx, gutters[node_idx].buffer});
-      wq.push(batch_vec);
-      gutters[node_idx].buffer.clear();
+  }
+}
+
+void StandAloneGutters::drain_gutter(gutter_key_t gutterid, Spare &spare) {
+  Gutter &gutter = gutters[gutterid];
+  const uint32_t capacity = leaf_gutter_size;
+
+  // close the gutter to new reservations. If it is full the thread that filled it pushes it
+  uint32_t count = gutter.reserved.fetch_add(capacity, std::memory_order_acquire);
+  if (count >= capacity) {
+    while (gutter.reserved.load(std::memory_order_acquire) >= capacity)
+      std::this_thread::yield();
+    return;
+  }
+  while (gutter.committed.load(std::memory_order_acquire) != count)
+    std::this_thread::yield();
+
+  spare.batch_vec.resize(1);
+  spare.batch_vec[0].node_idx = gutterid;
+  spare.batch_vec[0].upd_vec.assign(gutter.buffer, gutter.buffer + count);
+  gutter.committed.store(0, std::memory_order_relaxed);
+  gutter.reserved.store(0, std::memory_order_release);
+  if (count > 0) wq.push(spare.batch_vec);
+}
+
+void StandAloneGutters::flush_shared() {
+  Spare &spare = spares.back();
+  for (size_t word = 0; word < dirty_gutters.size(); word++) {
+    uint64_t bits = dirty_gutters[word].exchange(0, std::memory_order_acq_rel);
+    while (bits != 0) {
+      drain_gutter(gutter_key_t(word * 64 + __builtin_ctzll(bits)), spare);
+      bits &= bits - 1;
     }
   }
+
+  // wait for the gutters that filled up before they were drained to reach the work queue
+  for (size_t i = 0; i + 1 < spares.size(); i++) {
+    const uint64_t begun = spares[i].pushes_begun.load(std::memory_order_acquire);
+    while (spares[i].pushes_done.load(std::memory_order_acquire) < begun)
+      std::this_thread::yield();
+  }
+}
+
+flush_ret_t StandAloneGutters::flush_nodes(gutter_key_t lo, gutter_key_t hi) {
+  hi = std::min(hi, gutter_key_t(num_nodes - 1));
+  if (lo > hi) return;
+  Spare &spare = spares[0];
+
+  for (size_t which = 0; which < inserters; which++) {
+    if (hub_gutters > 0) hubs[which].flush_range(lo, hi, wq);
+    if (which < radix_stages.size()) {
+      for (size_t bucket = lo >> radix_shift; bucket <= size_t(hi >> radix_shift); bucket++)
+        flush_bucket(radix_stages[which], bucket, spare);
+      continue;
+    }
+    for (gutter_key_t node_idx = lo; node_idx <= hi; node_idx++) {
+      if (local_buffers[which][node_idx].count > 0) {
+        dirty_local[which][node_idx / 64] &= ~(uint64_t(1) << (node_idx % 64));
+        insert_batch(which, node_idx, spare);
+      }
+    }
+  }
+
+  // a gutter's dirty bit stays set, force_flush() finds it empty
+  for (gutter_key_t node_idx = lo; node_idx <= hi; node_idx++) {
+    Gutter &gutter = gutters[node_idx];
+    uint32_t count = gutter.committed.load(std::memory_order_acquire);
+    if (count > 0) {
+      push_buffer(node_idx, gutter.buffer, count, spare);
+      gutter.committed.store(0, std::memory_order_relaxed);
+      gutter.reserved.store(0, std::memory_order_release);
+    }
+  }
+}
+
+flush_ret_t StandAloneGutters::force_flush() {
+  const int threads = std::max(1, omp_get_max_threads() / 2);
+
+  // move the inserters' local gutters into the gutters, each inserter by one thread
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+  for (size_t which = 0; which < inserters; which++)
+    hand_off(which);
+
+  // emit the gutters that hold data. No inserts run during a flush, so each gutter is handled
+  // by one thread
+#pragma omp parallel for num_threads(threads)
+  for (size_t word = 0; word < dirty_gutters.size(); word++) {
+    Spare &spare = spares[omp_get_thread_num()];
+    for_each_dirty(dirty_gutters, word, [&](gutter_key_t node_idx) {
+      Gutter &gutter = gutters[node_idx];
+      uint32_t count = gutter.committed.load(std::memory_order_acquire);
+      if (count > 0) { // have stuff to flush
+        push_buffer(node_idx, gutter.buffer, count, spare);
+        gutter.committed.store(0, std::memory_order_relaxed);
+        gutter.reserved.store(0, std::memory_order_release);
+      }
+    });
+  }
 }
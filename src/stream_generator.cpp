@@ -0,0 +1,266 @@
+#include "../include/stream_generator.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+constexpr size_t StreamGenerator::chunk_edges;
+
+// the splitmix64 finalizer, a bijection that mixes every bit
+static inline uint64_t mix(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t mix(uint64_t seed, uint64_t i, uint64_t salt) {
+  return mix(seed ^ mix(i * 0x9E3779B97F4A7C15ull + salt));
+}
+
+// splitmix64, seeded per record so that records can be generated in any order
+struct SplitMix {
+  uint64_t state;
+  inline uint64_t next() { return mix(state += 0x9E3779B97F4A7C15ull); }
+  inline double uniform() { return (next() >> 11) * (1.0 / (uint64_t(1) << 53)); }
+};
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+  while (b != 0) {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+StreamGenerator::StreamGenerator(gutter_key_t num_nodes, uint64_t num_edges, Options opts)
+    : nodes(num_nodes), edges(num_edges), opts(opts) {
+  if (nodes < 2) throw std::invalid_argument("StreamGenerator: at least 2 nodes are required");
+  if (opts.delete_fraction < 0 || opts.delete_fraction > 0.5)
+    throw std::invalid_argument("StreamGenerator: delete_fraction must be in [0, 0.5]");
+  if (opts.burst_fraction < 0 || opts.burst_fraction > 1 || opts.burst_period == 0)
+    throw std::invalid_argument("StreamGenerator: burst_fraction must be in [0, 1] and "
+                                "burst_period positive");
+  if (opts.distribution == RMAT &&
+      (opts.rmat_a < 0 || opts.rmat_b < 0 || opts.rmat_c < 0 ||
+       opts.rmat_a + opts.rmat_b + opts.rmat_c > 1))
+    throw std::invalid_argument("StreamGenerator: R-MAT probabilities must sum to at most 1");
+  if (opts.distribution == ZIPF && opts.zipf_exponent <= 0)
+    throw std::invalid_argument("StreamGenerator: the Zipf exponent must be positive");
+
+  scale = 0;
+  while ((uint64_t(1) << scale) < uint64_t(nodes)) ++scale;
+
+  perm_mult = (mix(opts.seed, 0, 1) % nodes) | 1;
+  while (gcd(perm_mult, nodes) != 1) perm_mult = (perm_mult + 2) % nodes;
+  perm_add = mix(opts.seed, 0, 2) % nodes;
+
+  uint64_t window = 1;
+  while (window < opts.churn_window) window *= 2;
+  churn_mask = window - 1;
+  churn_deletes = uint64_t(opts.delete_fraction * window);
+
+  if (opts.distribution == ZIPF) {
+    zipf_h_x1 = zipf_h_integral(1.5) - 1;
+    zipf_h_n = zipf_h_integral(double(nodes) + 0.5);
+    zipf_s = 2 - zipf_h_integral_inverse(zipf_h_integral(2.5) - zipf_h(2));
+  }
+}
+
+gutter_key_t StreamGenerator::permute(uint64_t rank) const {
+  return gutter_key_t(((unsigned __int128) rank * perm_mult + perm_add) % nodes);
+}
+
+/*
+ * Zipf sampling by rejection inversion (Hormann and Derflinger). h is the unnormalized density
+ * x^-s and H its integral, shifted so that both are well behaved for s near 1.
+ */
+static inline double log1p_over_x(double x) {
+  return std::abs(x) > 1e-8 ? std::log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static inline double expm1_over_x(double x) {
+  return std::abs(x) > 1e-8 ? std::expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+double StreamGenerator::zipf_h(double x) const {
+  return std::exp(-opts.zipf_exponent * std::log(x));
+}
+
+double StreamGenerator::zipf_h_integral(double x) const {
+  const double log_x = std::log(x);
+  return expm1_over_x((1 - opts.zipf_exponent) * log_x) * log_x;
+}
+
+double StreamGenerator::zipf_h_integral_inverse(double x) const {
+  const double t = std::max(x * (1 - opts.zipf_exponent), -1.0);
+  return std::exp(log1p_over_x(t) * x);
+}
+
+StreamGenerator::Edge StreamGenerator::base_edge(uint64_t i) const {
+  SplitMix rng{mix(opts.seed, i, 0)};
+  uint64_t u = 0, v = 0;
+  if (opts.distribution == UNIFORM) {
+    u = rng.next() % nodes;
+    v = rng.next() % nodes;
+  }
+  else if (opts.distribution == RMAT) {
+    const double ab = opts.rmat_a + opts.rmat_b;
+    const double abc = ab + opts.rmat_c;
+    do { // redraw edges that fall outside the nodes when they are not a power of 2
+      u = v = 0;
+      for (uint32_t level = 0; level < scale; level++) {
+        const double r = rng.uniform();
+        u = (u << 1) | (r >= ab);
+        v = (v << 1) | ((r >= opts.rmat_a && r < ab) || r >= abc);
+      }
+    } while (u >= nodes || v >= nodes);
+  }
+  else {
+    uint64_t ranks[2];
+    for (uint64_t &rank : ranks) {
+      while (true) {
+        const double h = zipf_h_n + rng.uniform() * (zipf_h_x1 - zipf_h_n);
+        const double x = zipf_h_integral_inverse(h);
+        rank = std::min(std::max(uint64_t(x + 0.5), uint64_t(1)), uint64_t(nodes));
+        if (rank - x <= zipf_s || h >= zipf_h_integral(rank + 0.5) - zipf_h(rank)) break;
+      }
+      --rank;
+    }
+    u = ranks[0];
+    v = ranks[1];
+  }
+  u = permute(u);
+  v = permute(v);
+
+  if (opts.burst_hubs > 0 && rng.uniform() < opts.burst_fraction) {
+    const uint64_t epoch = i / opts.burst_period;
+    u = permute(mix(opts.seed, epoch, 3) % opts.burst_hubs);
+  }
+  if (u == v) v = (v + 1) % nodes; // no self loops
+  return {gutter_key_t(u), gutter_key_t(v), false};
+}
+
+// Each churn window is shuffled by an affine bijection slot = a * pos + c mod the window size.
+// The records in the first churn_deletes slots are deletions, and the deletion in slot k
+// removes the insertion in slot churn_deletes + k of the previous window.
+uint64_t StreamGenerator::churn_slot(uint64_t window, uint64_t pos) const {
+  const uint64_t a = mix(opts.seed, window, 4) | 1;
+  const uint64_t c = mix(opts.seed, window, 5);
+  return (a * pos + c) & churn_mask;
+}
+
+uint64_t StreamGenerator::churn_pos(uint64_t window, uint64_t slot) const {
+  const uint64_t a = mix(opts.seed, window, 4) | 1;
+  const uint64_t c = mix(opts.seed, window, 5);
+  uint64_t inverse = a; // Newton's iteration for the inverse of a mod 2^64
+  for (int it = 0; it < 5; it++) inverse *= 2 - a * inverse;
+  return (inverse * (slot - c)) & churn_mask;
+}
+
+StreamGenerator::Edge StreamGenerator::edge(uint64_t i) const {
+  if (churn_deletes > 0) {
+    const uint64_t window = i / (churn_mask + 1);
+    const uint64_t slot = churn_slot(window, i & churn_mask);
+    if (window > 0 && slot < churn_deletes) {
+      const uint64_t target = churn_pos(window - 1, churn_deletes + slot);
+      Edge del = base_edge((window - 1) * (churn_mask + 1) + target);
+      del.deletion = true;
+      return del;
+    }
+  }
+  return base_edge(i);
+}
+
+void StreamGenerator::generate(size_t threads, const Consumer &consume) const {
+  if (edges == 0) return;
+  threads = std::max(std::min(uint64_t(threads), edges), uint64_t(1));
+  std::vector<std::exception_ptr> errors(threads);
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      const uint64_t first = edges * t / threads;
+      const uint64_t last = edges * (t + 1) / threads;
+      std::vector<Edge> chunk(chunk_edges);
+      try {
+        for (uint64_t start = first; start < last; start += chunk_edges) {
+          const size_t count = std::min(uint64_t(chunk_edges), last - start);
+          for (size_t j = 0; j < count; j++) chunk[j] = edge(start + j);
+          consume(t, start, chunk.data(), count);
+        }
+      } catch (...) {
+        errors[t] = std::current_exception();
+      }
+    });
+  }
+  for (auto &worker : workers) worker.join();
+  for (auto &error : errors)
+    if (error) std::rethrow_exception(error);
+}
+
+double StreamGenerator::write_file(const std::string &path, size_t threads,
+                                   EdgeStreamIngestor::Format format) const {
+  if (format.header_bytes != 0 && format.header_bytes != 12)
+    throw std::invalid_argument("StreamGenerator: headers are 0 or 12 bytes");
+  if (format.id_bytes != 8 && (format.id_bytes != 4 || uint64_t(nodes) > (uint64_t(1) << 32)))
+    throw std::invalid_argument("StreamGenerator: ids of " + std::to_string(format.id_bytes) +
+                                " bytes cannot hold " + std::to_string(nodes) + " nodes");
+  auto start = std::chrono::steady_clock::now();
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+  if (fd == -1)
+    throw std::runtime_error("StreamGenerator: cannot open " + path + ": " + strerror(errno));
+
+  auto write_all = [&](const char *data, size_t bytes, off_t offset) {
+    size_t done = 0;
+    while (done < bytes) {
+      ssize_t len = pwrite(fd, data + done, bytes - done, offset + done);
+      if (len < 0 && errno == EINTR) continue;
+      if (len <= 0)
+        throw std::runtime_error("StreamGenerator: cannot write " + path + ": " +
+                                 strerror(errno));
+      done += len;
+    }
+  };
+
+  const size_t record = format.record_bytes();
+  try {
+    if (format.header_bytes == 12) {
+      char header[12];
+      const uint32_t num_nodes = nodes;
+      memcpy(header, &num_nodes, 4);
+      memcpy(header + 4, &edges, 8);
+      write_all(header, sizeof(header), 0);
+    }
+    generate(threads, [&](size_t, uint64_t first, const Edge *chunk, size_t count) {
+      std::vector<char> bytes(count * record);
+      char *dst = bytes.data();
+      for (size_t j = 0; j < count; j++) {
+        if (format.flag_byte) *dst++ = chunk[j].deletion ? 1 : 0;
+        if (format.id_bytes == 4) {
+          const uint32_t ids[2] = {uint32_t(chunk[j].src), uint32_t(chunk[j].dst)};
+          memcpy(dst, ids, sizeof(ids));
+        } else {
+          const uint64_t ids[2] = {uint64_t(chunk[j].src), uint64_t(chunk[j].dst)};
+          memcpy(dst, ids, sizeof(ids));
+        }
+        dst += 2 * format.id_bytes;
+      }
+      write_all(bytes.data(), bytes.size(), format.header_bytes + first * record);
+    });
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
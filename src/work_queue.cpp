@@ -1,25 +1,121 @@
 #include "../include/work_queue.h"
 #include "../include/types.h"
+#include "../include/shm_work_queue.h"
 
 #include <string.h>
 #include <chrono>
 #include <cassert>
+#include <algorithm>
 
-WorkQueue::WorkQueue(size_t total_batches, size_t batch_size, size_t bpe) : 
- len(total_batches / bpe + total_batches % bpe), max_batch_size(batch_size), batch_per_elm(bpe) {
+/*
+ * Sort a vector of integer values with a least significant digit radix sort.
+ * Passes in which every value shares the same digit are skipped, so batches of small
+ * node ids only pay for the digits they actually use.
+ * @param vec       the vector to sort
+ * @param scratch   temporary storage, resized to the size of vec
+ */
+template <typename T>
+static void radix_sort(std::vector<T> &vec, std::vector<T> &scratch, std::true_type) {
+  typedef typename std::make_unsigned<T>::type U;
+  constexpr size_t radix_bits = 8;
+  constexpr size_t radix      = 1 << radix_bits;
+  constexpr size_t passes     = sizeof(T) * 8 / radix_bits;
+  // flip the sign bit of signed values so that negative values sort first
+  constexpr U flip = std::is_signed<T>::value ? U(1) << (sizeof(T) * 8 - 1) : 0;
+  const size_t n = vec.size();
+
+  // insertion sort is faster for tiny batches
+  if (n < 64) {
+    for (size_t i = 1; i < n; i++) {
+      T val = vec[i];
+      size_t j = i;
+      for (; j > 0 && vec[j - 1] > val; j--)
+        vec[j] = vec[j - 1];
+      vec[j] = val;
+    }
+    return;
+  }
+
+  // compute the histogram of every digit in a single scan
+  size_t hist[passes][radix] = {};
+  for (size_t i = 0; i < n; i++) {
+    U val = U(vec[i]) ^ flip;
+    for (size_t p = 0; p < passes; p++)
+      ++hist[p][(val >> (p * radix_bits)) & (radix - 1)];
+  }
+
+  scratch.resize(n);
+  T *src = vec.data();
+  T *dst = scratch.data();
+  for (size_t p = 0; p < passes; p++) {
+    const size_t shift = p * radix_bits;
+    size_t *counts = hist[p];
+    if (counts[((U(src[0]) ^ flip) >> shift) & (radix - 1)] == n) continue; // same digit
+
+    size_t offset = 0;
+    for (size_t b = 0; b < radix; b++) {
+      size_t count = counts[b];
+      counts[b] = offset;
+      offset += count;
+    }
+    for (size_t i = 0; i < n; i++)
+      dst[counts[((U(src[i]) ^ flip) >> shift) & (radix - 1)]++] = src[i];
+    std::swap(src, dst);
+  }
+  if (src != vec.data())
+    memcpy(vec.data(), src, n * sizeof(T));
+}
+
+// values that are not integers cannot be sorted (the WorkQueue disables sorting for them)
+template <typename T>
+static void radix_sort(std::vector<T> &, std::vector<T> &, std::false_type) {}
+
+void WorkQueue::DataNode::sort_batches() {
+  for (auto &batch : batches) {
+    radix_sort(batch.upd_vec, sort_scratch, std::is_integral<gutter_value_t>());
+    batch.sorted = true;
+  }
+}
+
+WorkQueue::WorkQueue(size_t total_batches, size_t batch_size, size_t bpe,
+                     BatchSortMode _sort_mode, size_t sort_threads) :
+ len(total_batches / bpe + total_batches % bpe), max_batch_size(batch_size), batch_per_elm(bpe),
+ sort_mode(std::is_integral<gutter_value_t>::value ? _sort_mode : NO_SORT) {
   non_block = false;
+  if (sort_mode != _sort_mode)
+    printf("WARNING: WQ: batches of non-integer values cannot be sorted, sorting disabled\n");
 
   // place all nodes of linked list in the producer queue and reserve
   // memory for the vectors
   for (size_t i = 0; i < len; i++) {
     // create and reserve space for updates
-    DataNode *node = new DataNode(batch_per_elm, max_batch_size);
+    DataNode *node = new DataNode(batch_per_elm, max_batch_size, sort_mode != NO_SORT);
     node->next = producer_list; // next of node is head
     producer_list = node; // set head to new node
   }
+
+  if (sort_mode == SORT_DEFERRED) {
+    sorters.reserve(sort_threads);
+    for (size_t i = 0; i < sort_threads; i++)
+      sorters.emplace_back(&WorkQueue::do_sort_work, this);
+  }
+}
+
+size_t WorkQueue::memory_bytes() const {
+  const size_t vecs = batch_per_elm + (sort_mode != NO_SORT ? 1 : 0);
+  return len * (sizeof(DataNode) + batch_per_elm * sizeof(update_batch) +
+                vecs * max_batch_size * sizeof(gutter_value_t));
 }
 
 WorkQueue::~WorkQueue() {
+  // stop the sorting threads, they finish the DataNode they are working on
+  consumer_list_lock.lock();
+  sorters_shutdown = true;
+  consumer_list_lock.unlock();
+  sort_condition.notify_all();
+  for (auto &thr : sorters)
+    thr.join();
+
   // free data from the queues
   // grab locks to ensure that list variables aren't old due to cpu caching
   producer_list_lock.lock();
@@ -34,6 +130,11 @@ WorkQueue::~WorkQueue() {
     consumer_list = consumer_list->next;
     delete temp;
   }
+  while (sort_list != nullptr) {
+    DataNode *temp = sort_list;
+    sort_list = sort_list->next;
+    delete temp;
+  }
   producer_list_lock.unlock();
   consumer_list_lock.unlock();
 }
@@ -45,12 +146,16 @@ void WorkQueue::push(std::vector<update_batch> &upd_vec_batch) {
   }
   for (auto &batch : upd_vec_batch) {
     // ensure the write size is valid
-    std::vector<node_id_t> &upd_vec = batch.upd_vec;
+    std::vector<gutter_value_t> &upd_vec = batch.upd_vec;
     if(upd_vec.size() > max_batch_size) {
       throw WriteTooBig("WQ: Batch is too big " + std::to_string(upd_vec.size()) 
         + " > " + std::to_string(max_batch_size));
     }
   }
+  if (sink != nullptr) {
+    sink->push(upd_vec_batch);
+    return;
+  }
   std::unique_lock<std::mutex> lk(producer_list_lock);
   producer_condition.wait(lk, [this]{return !full();});
 
@@ -65,12 +170,43 @@ void WorkQueue::push(std::vector<update_batch> &upd_vec_batch) {
   // swap the batch vectors to perform the update
   std::swap(node->batches, upd_vec_batch);
 
-  // add this block to the consumer queue for processing
+  if (sort_mode == SORT_ON_FLUSH)
+    node->sort_batches();
+  else
+    for (auto &batch : node->batches) batch.sorted = false;
+
+  // add this block to the consumer queue (or sort queue) for processing
   consumer_list_lock.lock();
-  node->next = consumer_list;
-  consumer_list = node;
+  if (sort_mode == SORT_DEFERRED) {
+    node->next = sort_list;
+    sort_list = node;
+  } else {
+    node->next = consumer_list;
+    consumer_list = node;
+  }
   consumer_list_lock.unlock();
   consumer_condition.notify_one();
+  if (sort_mode == SORT_DEFERRED) sort_condition.notify_one();
+}
+
+void WorkQueue::do_sort_work() {
+  while (true) {
+    std::unique_lock<std::mutex> lk(consumer_list_lock);
+    sort_condition.wait(lk, [this]{return sort_list != nullptr || sorters_shutdown;});
+    if (sort_list == nullptr) return; // shutdown and nothing left to sort
+
+    DataNode *node = sort_list;
+    sort_list = sort_list->next;
+    lk.unlock();
+
+    node->sort_batches();
+
+    lk.lock();
+    node->next = consumer_list;
+    consumer_list = node;
+    lk.unlock();
+    consumer_condition.notify_one();
+  }
 }
 
 bool WorkQueue::peek(DataNode *&data) {
@@ -90,9 +226,18 @@ bool WorkQueue::peek(DataNode *&data) {
   }
 
   // remove head from consumer_list and release lock
-  DataNode *node = consumer_list;
-  consumer_list = consumer_list->next;
-  lk.unlock();
+  // if only unsorted data is available then sort it here rather than waiting on the sorters
+  DataNode *node;
+  if (consumer_list != nullptr) {
+    node = consumer_list;
+    consumer_list = consumer_list->next;
+    lk.unlock();
+  } else {
+    node = sort_list;
+    sort_list = sort_list->next;
+    lk.unlock();
+    node->sort_batches();
+  }
 
   data = node;
   return true;
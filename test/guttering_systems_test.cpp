@@ -1,12 +1,23 @@
 #include <gtest/gtest.h>
 #include <algorithm>
 #include <thread>
+#include <future>
 #include <atomic>
 #include <fstream>
+#include <map>
 #include <math.h>
 #include "standalone_gutters.h"
 #include "gutter_tree.h"
 #include "cache_guttering.h"
+#include "hub_gutters.h"
+#include "partitioned_guttering.h"
+#include "shm_work_queue.h"
+#include "edge_stream.h"
+#include "stream_generator.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define KB (1 << 10)
 #define MB (1 << 20)
@@ -31,8 +42,8 @@ static void querier(GutteringSystem *gts, int nodes) {
     if (valid) {
       std::vector<update_batch> batches = data->get_batches();
       for (auto batch : batches) {
-        node_id_t key = batch.node_idx;
-        std::vector<node_id_t> upd_vec = batch.upd_vec;
+        gutter_key_t key = batch.node_idx;
+        std::vector<gutter_value_t> upd_vec = batch.upd_vec;
         // verify that the updates are all between the correct nodes
         for (auto upd : upd_vec) {
           // printf("edge from %u to %u\n", key, upd);
@@ -181,12 +192,27 @@ TEST_P(GuttersTest, TinyGutters) {
   auto conf = GutteringConfiguration()
               .buffer_exp(16)
               .fanout(16)
-              .gutter_bytes(sizeof(node_id_t))
+              .gutter_bytes(sizeof(gutter_value_t))
               .queue_factor(1);
 
   run_test(nodes, num_updates, data_workers, GetParam(), conf);
 }
 
+TEST_P(GuttersTest, Prefault) {
+  const int nodes = 20000;
+  const int num_updates = 400000;
+  const int data_workers = 2;
+
+  // fault in all memory at construction
+  auto conf = GutteringConfiguration()
+              .buffer_exp(18)
+              .fanout(16)
+              .gutter_bytes(1024)
+              .prefault(true);
+
+  run_test(nodes, num_updates, data_workers, GetParam(), conf);
+}
+
 TEST_P(GuttersTest, FlushAndInsertAgain) {
   const int nodes       = 1024;
   const int num_updates = 10000;
@@ -248,6 +274,240 @@ TEST_P(GuttersTest, FlushAndInsertAgain) {
   delete gts;
 }
 
+// many flushes with little data each, so force_flush only finds a few non-empty gutters
+TEST_P(GuttersTest, FrequentFlushes) {
+  const int nodes        = 1 << 16;
+  const int num_updates  = 2000;
+  const int num_flushes  = 50;
+  const int data_workers = 4;
+
+  auto conf = GutteringConfiguration()
+              .buffer_exp(18)
+              .fanout(16)
+              .gutter_bytes(KB);
+
+  SystemEnum gts_enum = GetParam();
+  GutteringSystem *gts;
+  if (gts_enum == GUTTREE)
+    gts = new GutterTree("./test_", nodes, data_workers, conf, true);
+  else if (gts_enum == STANDALONE)
+    gts = new StandAloneGutters(nodes, data_workers, 1, conf);
+  else
+    gts = new CacheGuttering(nodes, data_workers, 1, conf);
+
+  shutdown = false;
+  upd_processed = 0;
+
+  std::thread query_threads[data_workers];
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t] = std::thread(querier, gts, nodes);
+
+  for (int f = 0; f < num_flushes; f++) {
+    for (int i = 0; i < num_updates; i++) {
+      gutter_key_t key = (gutter_key_t(f * num_updates + i) * 7919) % nodes;
+      gts->insert({key, gutter_value_t(nodes - 1 - key)});
+    }
+    gts->force_flush();
+  }
+  shutdown = true;
+  gts->set_non_block(true); // switch to non-blocking calls in an effort to exit
+
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t].join();
+
+  ASSERT_EQ(num_updates * num_flushes, upd_processed);
+  delete gts;
+}
+
+// insert while asynchronous flushes run and check that each flush delivers the updates
+// inserted before it
+TEST_P(GuttersTest, FlushAsync) {
+  const int nodes        = 1 << 16;
+  const int num_updates  = 20000;
+  const int num_flushes  = 20;
+  const int data_workers = 4;
+
+  auto conf = GutteringConfiguration()
+              .buffer_exp(18)
+              .fanout(16)
+              .gutter_bytes(KB);
+
+  SystemEnum gts_enum = GetParam();
+  GutteringSystem *gts;
+  if (gts_enum == GUTTREE)
+    gts = new GutterTree("./test_", nodes, data_workers, conf, true);
+  else if (gts_enum == STANDALONE)
+    gts = new StandAloneGutters(nodes, data_workers, 2, conf);
+  else
+    gts = new CacheGuttering(nodes, data_workers, 2, conf);
+
+  shutdown = false;
+  upd_processed = 0;
+
+  std::thread query_threads[data_workers];
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t] = std::thread(querier, gts, nodes);
+
+  auto insert_round = [&](int f) {
+    for (int i = 0; i < num_updates; i++) {
+      gutter_key_t key = (gutter_key_t(f * num_updates + i) * 7919) % nodes;
+      gts->insert({key, gutter_value_t(nodes - 1 - key)});
+    }
+  };
+  auto wait_processed = [&](uint32_t expected) {
+    for (int ms = 0; ms < 10000 && upd_processed < expected; ms++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  };
+
+  insert_round(0);
+  for (int f = 1; f < num_flushes; f++) {
+    std::future<void> flushed = gts->flush_async();
+    insert_round(f); // the next epoch is inserted while the flush runs
+    flushed.get();
+    wait_processed(f * num_updates);
+    ASSERT_GE(upd_processed, uint32_t(f * num_updates));
+  }
+  gts->pause_inserter(0);
+  gts->flush_async().get();
+  wait_processed(num_flushes * num_updates);
+
+  shutdown = true;
+  gts->set_non_block(true); // switch to non-blocking calls in an effort to exit
+
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t].join();
+
+  ASSERT_EQ(num_updates * num_flushes, upd_processed);
+  delete gts;
+}
+
+// flush a few node ranges and check that all of their updates, and so far no more than the
+// inserted updates of the other nodes, reach the work queue
+TEST_P(GuttersTest, FlushNodes) {
+  const int nodes         = 1 << 14;
+  const int upds_per_node = 20;
+  const int data_workers  = 4;
+
+  auto conf = GutteringConfiguration()
+              .buffer_exp(18)
+              .fanout(16)
+              .gutter_bytes(KB);
+
+  SystemEnum gts_enum = GetParam();
+  GutteringSystem *gts;
+  if (gts_enum == GUTTREE)
+    gts = new GutterTree("./test_", nodes, data_workers, conf, true);
+  else if (gts_enum == STANDALONE)
+    gts = new StandAloneGutters(nodes, data_workers, 1, conf);
+  else
+    gts = new CacheGuttering(nodes, data_workers, 1, conf);
+
+  std::vector<std::atomic<uint32_t>> node_processed(nodes);
+  std::atomic<bool> done{false};
+  auto count_updates = [&]() {
+    WorkQueue::DataNode *data;
+    while (true) {
+      if (gts->get_data(data)) {
+        for (auto &batch : data->get_batches()) {
+          for (auto upd : batch.upd_vec) {
+            ASSERT_EQ(nodes - (batch.node_idx + 1), upd) << "key " << batch.node_idx;
+            node_processed[batch.node_idx] += 1;
+          }
+        }
+        gts->get_data_callback(data);
+      }
+      else if (done)
+        return;
+    }
+  };
+  std::thread query_threads[data_workers];
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t] = std::thread(count_updates);
+
+  for (int r = 0; r < upds_per_node; r++) {
+    for (int i = 0; i < nodes; i++) {
+      gutter_key_t key = (gutter_key_t(i) * 7919) % nodes;
+      gts->insert({key, gutter_value_t(nodes - 1 - key)});
+    }
+  }
+
+  auto wait_for = [&](gutter_key_t lo, gutter_key_t hi) {
+    for (gutter_key_t n = lo; n <= hi; n++) {
+      for (int ms = 0; ms < 10000 && node_processed[n] < upds_per_node; ms++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      ASSERT_EQ(uint32_t(upds_per_node), node_processed[n]) << "node " << n;
+    }
+  };
+  gts->flush_nodes(0, 0);
+  wait_for(0, 0);
+  gts->flush_nodes(5000, 5100);
+  wait_for(5000, 5100);
+  gts->flush_nodes(nodes - 1, nodes + 100); // clamped to the last node
+  wait_for(nodes - 1, nodes - 1);
+
+  gts->force_flush();
+  wait_for(0, nodes - 1);
+  done = true;
+  gts->set_non_block(true); // switch to non-blocking calls in an effort to exit
+
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t].join();
+  for (int n = 0; n < nodes; n++)
+    ASSERT_EQ(uint32_t(upds_per_node), node_processed[n]) << "node " << n;
+  delete gts;
+}
+
+// construction fails fast on a budget that is too small, and a system built under a budget
+// stays within it while ingesting
+TEST_P(GuttersTest, MemoryBudget) {
+  const int nodes = 4096;
+  const int num_updates = 1 << 20;
+  const int data_workers = 2;
+  auto make = [&](size_t budget) -> GutteringSystem * {
+    auto conf = GutteringConfiguration().gutter_bytes(KB).buffer_exp(16).memory_budget(budget);
+    if (GetParam() == GUTTREE) return new GutterTree("./test_", nodes, data_workers, conf, true);
+    if (GetParam() == STANDALONE) return new StandAloneGutters(nodes, data_workers, 1, conf);
+    return new CacheGuttering(nodes, data_workers, 1, conf);
+  };
+
+  GutteringSystem *gts = make(0);
+  MemoryUsage usage = gts->memory_usage();
+  std::cout << usage << std::endl;
+  ASSERT_GT(usage.work_queue, size_t(0));
+  ASSERT_GT(usage.total(), usage.work_queue);
+  delete gts;
+
+  ASSERT_THROW(make(usage.total() / 2), MemoryBudgetError);
+
+  const size_t budget = usage.total() + 256 * KB;
+  gts = make(budget);
+  shutdown = false;
+  upd_processed = 0;
+  std::thread query_threads[data_workers];
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t] = std::thread(querier, gts, nodes);
+  for (int i = 0; i < num_updates; i++) {
+    gutter_key_t key = (gutter_key_t(i) * 7919) % nodes;
+    gts->insert({key, gutter_value_t(nodes - 1 - key)});
+  }
+  // an asynchronous flush of the guttering systems stays within the budget too
+  if (GetParam() != GUTTREE) {
+    gts->pause_inserter(0);
+    gts->flush_async().get();
+    ASSERT_LE(gts->memory_usage().total(), budget + gts->gutter_size());
+  }
+  gts->force_flush();
+  shutdown = true;
+  gts->set_non_block(true);
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t].join();
+
+  ASSERT_EQ(num_updates, upd_processed);
+  std::cout << gts->memory_usage() << std::endl;
+  ASSERT_LE(gts->memory_usage().total(), budget + gts->gutter_size()); // the leaf cap is soft
+  delete gts;
+}
+
 TEST_P(GuttersTest, GetDataBatched) {
   const int nodes = 2048;
   const int num_updates = 100000;
@@ -307,6 +567,77 @@ TEST_P(GuttersTest, GetDataBatched) {
   delete gts;
 }
 
+// verify that batches are emitted sorted when requested, both when sorting upon flush
+// and when sorting is deferred to a pool of sorting threads
+TEST_P(GuttersTest, SortedBatches) {
+  const int nodes = 512;
+  const int num_updates = 200000;
+  const int data_workers = 4;
+
+  for (BatchSortMode mode : {SORT_ON_FLUSH, SORT_DEFERRED}) {
+    auto conf = GutteringConfiguration()
+                .buffer_exp(16)
+                .fanout(8)
+                .gutter_bytes(KB)
+                .wq_batch_per_elm(2)
+                .batch_sort(mode)
+                .sort_threads(2);
+
+    SystemEnum gts_enum = GetParam();
+    GutteringSystem *gts;
+    if (gts_enum == GUTTREE)
+      gts = new GutterTree("./test_", nodes, data_workers, conf, true);
+    else if (gts_enum == STANDALONE)
+      gts = new StandAloneGutters(nodes, data_workers, 1, conf);
+    else
+      gts = new CacheGuttering(nodes, data_workers, 1, conf);
+
+    shutdown = false;
+    upd_processed = 0;
+    std::atomic<uint32_t> sorted_batches;
+    sorted_batches = 0;
+    auto query_task = [&]() {
+      WorkQueue::DataNode *data;
+      while (true) {
+        bool valid = gts->get_data(data);
+        if (valid) {
+          for (auto &batch : data->get_batches()) {
+            ASSERT_TRUE(batch.sorted);
+            ASSERT_TRUE(std::is_sorted(batch.upd_vec.begin(), batch.upd_vec.end()));
+            sorted_batches += 1;
+            for (auto upd : batch.upd_vec) ASSERT_LT(upd, (gutter_value_t) nodes);
+            upd_processed += batch.upd_vec.size();
+          }
+          gts->get_data_callback(data);
+        }
+        else if (shutdown)
+          return;
+      }
+    };
+
+    std::thread query_threads[data_workers];
+    for (int t = 0; t < data_workers; t++)
+      query_threads[t] = std::thread(query_task);
+
+    for (int i = 0; i < num_updates; i++) {
+      update_t upd;
+      upd.first = i % nodes;
+      upd.second = (i * 7919) % nodes;
+      gts->insert(upd);
+    }
+    gts->force_flush();
+    shutdown = true;
+    gts->set_non_block(true); // switch to non-blocking calls in an effort to exit
+
+    for (int t = 0; t < data_workers; t++)
+      query_threads[t].join();
+
+    ASSERT_EQ(num_updates, upd_processed);
+    ASSERT_GT(sorted_batches, 0u);
+    delete gts;
+  }
+}
+
 // test designed to trigger recursive flushes
 // Insert full root buffers which are 95% node 0 and 5% a node
 // which will make 95% split from 5% at different levels of 
@@ -407,6 +738,53 @@ TEST(StandaloneTest, ParallelInserts) {
   run_test(nodes, num_updates, data_workers, STANDALONE, conf, nthreads);
 }
 
+TEST(StandaloneTest, RadixStage) {
+  const int nodes = 100000;
+  const int num_updates = 3000000;
+  const int data_workers = 4;
+  const int nthreads = 4;
+
+  for (size_t bits : {1, 6, 16}) {
+    auto conf = GutteringConfiguration()
+                .gutter_bytes(8 * KB)
+                .local_radix_bits(bits);
+
+    run_test(nodes, num_updates, data_workers, STANDALONE, conf, nthreads);
+  }
+}
+
+// many inserters filling and swapping a few small gutters at once
+// per node local gutters over the memory budget are replaced by a radix stage
+TEST(StandaloneTest, BudgetRadixStage) {
+  const int nodes = 1 << 16;
+  const int inserters = 8;
+  auto conf = GutteringConfiguration().gutter_bytes(256);
+  StandAloneGutters *gts = new StandAloneGutters(nodes, 2, inserters, conf);
+  const size_t per_node = gts->memory_usage().total();
+  delete gts;
+
+  const size_t budget = per_node * 3 / 4;
+  gts = new StandAloneGutters(nodes, 2, inserters, conf.memory_budget(budget));
+  ASSERT_LE(gts->memory_usage().total(), budget);
+  ASSERT_LT(gts->memory_usage().local, per_node / 4);
+  delete gts;
+}
+
+TEST(StandaloneTest, ContendedGutters) {
+  const int nodes = 4;
+  const int num_updates = 2000000;
+  const int data_workers = 2;
+  const int nthreads = 8;
+
+  for (size_t bits : {0, 1}) {
+    auto conf = GutteringConfiguration()
+                .gutter_bytes(16 * sizeof(gutter_value_t))
+                .local_radix_bits(bits);
+
+    run_test(nodes, num_updates, data_workers, STANDALONE, conf, nthreads);
+  }
+}
+
 TEST(CacheGutteringTest, ParallelInserts) {
   const int nodes = 32;
   const int num_updates = 5000000;
@@ -446,6 +824,7 @@ TEST(CacheGutteringTest, RelabellingOffset) {
   threads.reserve(nthreads);
   std::vector<std::vector<update_t>> recorded_insertions(nthreads, std::vector<update_t>());
   std::vector<std::vector<update_t>> retrieved_insertions(data_workers, std::vector<update_t>());
+  std::atomic<int> retrieved{0};
   // This is the work to do per thread (rounded up)
   const int work_per = (num_updates+nthreads-1) / nthreads;
 
@@ -465,11 +844,12 @@ TEST(CacheGutteringTest, RelabellingOffset) {
       if (valid) {
         std::vector<update_batch> batches = data->get_batches();
         for (auto batch : batches) {
-          node_id_t key = batch.node_idx;
-          std::vector<node_id_t> upd_vec = batch.upd_vec;
+          gutter_key_t key = batch.node_idx;
+          std::vector<gutter_value_t> upd_vec = batch.upd_vec;
           for (auto upd : upd_vec) {
             retrieved_insertions[j].push_back({key, upd});
           }
+          retrieved += upd_vec.size();
         }
         gts->get_data_callback(data);
       }
@@ -489,6 +869,13 @@ TEST(CacheGutteringTest, RelabellingOffset) {
   for (int j = 0; j < nthreads; j++)
     threads[j].join();
 
+  // flush_nodes() takes ids before relabelling: a range below the offset holds no nodes and
+  // one that starts below it covers every node
+  gts->flush_nodes(0, relabelling_offset - 1);
+  gts->flush_nodes(0, relabelling_offset + nodes - 1);
+  for (int ms = 0; ms < 10000 && retrieved < num_updates; ms++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  ASSERT_EQ(num_updates, retrieved);
 
   printf("force flush\n");
   gts->force_flush();
@@ -514,4 +901,690 @@ TEST(CacheGutteringTest, RelabellingOffset) {
   ASSERT_EQ(catted_recorded, catted_retrieved);
 
   delete gts;
-}
\ No newline at end of file
+}
+// keys and values that use the high bits of their types, 64 bit builds (GUTTER_64BIT_IDS)
+// exercise ids above 2^32
+TEST(CacheGutteringTest, HighIds) {
+  const int nodes = 1024;
+  const int num_updates = 100000;
+  const int data_workers = 2;
+  const gutter_key_t offset = gutter_key_t(1) << (sizeof(gutter_key_t) * 8 - 8);
+  const gutter_value_t high = gutter_value_t(1) << (sizeof(gutter_value_t) * 8 - 4);
+
+  auto gts = new CacheGuttering(nodes, data_workers, 1, GutteringConfiguration());
+  gts->set_offset(offset);
+
+  shutdown = false;
+  upd_processed = 0;
+  auto query_task = [&]() {
+    WorkQueue::DataNode *data;
+    while (true) {
+      bool valid = gts->get_data(data);
+      if (valid) {
+        for (auto &batch : data->get_batches()) {
+          for (auto upd : batch.upd_vec) {
+            ASSERT_EQ(high + (batch.node_idx - offset), upd);
+            upd_processed += 1;
+          }
+        }
+        gts->get_data_callback(data);
+      }
+      else if (shutdown)
+        return;
+    }
+  };
+  std::thread query_threads[data_workers];
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t] = std::thread(query_task);
+
+  for (int i = 0; i < num_updates; i++)
+    gts->insert({offset + i % nodes, high + i % nodes});
+
+  gts->force_flush();
+  shutdown = true;
+  gts->set_non_block(true); // switch to non-blocking calls in an effort to exit
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t].join();
+
+  ASSERT_EQ(num_updates, upd_processed);
+  delete gts;
+}
+
+// enough nodes that only some levels of a 32 bit build use packed slots. Every value is derived
+// from its key so that a mis-decoded slot is detected. Values that are not node ids are only
+// accepted without node_id_values()
+TEST(CacheGutteringTest, PackedSlots) {
+  const gutter_key_t nodes = 1 << 18;
+  const int num_updates = 2000000;
+  const int data_workers = 2;
+  const int nthreads = 4;
+  auto value_of = [&](gutter_key_t key) { return gutter_value_t((key * 7 + 3) % nodes); };
+
+  {
+    CacheGuttering packed(nodes, 1, 1, GutteringConfiguration().node_id_values(true));
+    ASSERT_THROW(packed.insert({0, gutter_value_t(~gutter_key_t(0))}, 0), std::out_of_range);
+    CacheGuttering plain(nodes, 1, 1);
+    std::thread consumer([&]() {
+      WorkQueue::DataNode *data;
+      ASSERT_TRUE(plain.get_data(data));
+      ASSERT_EQ(gutter_value_t(~gutter_key_t(0)), data->get_batches()[0].upd_vec[0]);
+      plain.get_data_callback(data);
+    });
+    plain.insert({5, gutter_value_t(~gutter_key_t(0))}, 0);
+    plain.force_flush();
+    consumer.join();
+  }
+
+  auto gts = new CacheGuttering(nodes, data_workers, nthreads,
+                                GutteringConfiguration().gutter_bytes(64).node_id_values(true));
+
+  shutdown = false;
+  upd_processed = 0;
+  auto query_task = [&]() {
+    WorkQueue::DataNode *data;
+    while (true) {
+      bool valid = gts->get_data(data);
+      if (valid) {
+        for (auto &batch : data->get_batches()) {
+          for (auto upd : batch.upd_vec) {
+            ASSERT_EQ(value_of(batch.node_idx), upd);
+            upd_processed += 1;
+          }
+        }
+        gts->get_data_callback(data);
+      }
+      else if (shutdown)
+        return;
+    }
+  };
+  std::thread query_threads[data_workers];
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t] = std::thread(query_task);
+
+  std::vector<std::thread> threads;
+  for (int j = 0; j < nthreads; j++) {
+    threads.emplace_back([&, j]() {
+      for (int i = j; i < num_updates; i += nthreads) {
+        gutter_key_t key = (gutter_key_t(i) * 104729) % nodes;
+        gts->insert({key, value_of(key)}, j);
+      }
+    });
+  }
+  for (auto &thr : threads)
+    thr.join();
+
+  gts->force_flush();
+  shutdown = true;
+  gts->set_non_block(true); // switch to non-blocking calls in an effort to exit
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t].join();
+
+  ASSERT_EQ(num_updates, upd_processed);
+  delete gts;
+}
+
+// a slot fills up to the end of its destination's cache line, so that after the first commit
+// every commit of a full slot is one whole aligned line
+TEST(CacheGutteringTest, WriteCombiningLines) {
+  const size_t line = 64;
+  const size_t per_line = line / sizeof(gutter_value_t);
+  std::vector<gutter_value_t, LineAlignedAllocator<gutter_value_t>> dst(16 * per_line);
+  ASSERT_EQ(0u, uintptr_t(dst.data()) % line);
+  WriteCombiningBuffer<gutter_value_t> wc;
+  wc.init(1, line);
+  size_t pos = 3; // a misaligned destination
+  wc.clear(0, dst.data() + pos);
+  size_t commits = 0;
+  for (size_t i = 0; pos + 1 < dst.size(); i++) {
+    if (!wc.stage(0, gutter_value_t(i))) continue;
+    ASSERT_EQ(commits == 0 ? per_line - 3 : per_line, wc.count(0));
+    stream_lines(dst.data() + pos, wc.items(0), wc.count(0), line);
+    pos += wc.count(0);
+    ASSERT_EQ(0u, uintptr_t(dst.data() + pos) % line);
+    wc.clear(0, dst.data() + pos);
+    ++commits;
+  }
+  stream_fence();
+  for (size_t i = 3; i < pos; i++) ASSERT_EQ(gutter_value_t(i - 3), dst[i]);
+}
+
+// the thread local levels are sized from the caches of the machine, check a few other machines.
+// Leaves that exceed the last level cache are written through write combining buffers
+TEST(CacheGutteringTest, CacheGeometries) {
+  const int nodes = 8192;
+  const int num_updates = 4000000;
+  const int data_workers = 2;
+
+  std::vector<CacheInfo> machines(5);
+  machines[0].l1d_size = 16 * KB;
+  machines[0].l2_size = 256 * KB;
+  machines[0].l3_size = 1 * MB;
+  machines[1].l1d_size = 48 * KB;
+  machines[1].l2_size = 2 * MB;
+  machines[2].line_size = 128;
+  machines[2].l1d_size = 64 * KB;
+  machines[2].l2_size = 512 * KB;
+  machines[3].l1d_size = 8 * KB; // small enough to use a level 4
+  machines[3].l2_size = 256 * KB;
+  machines[3].l3_size = 1 * MB;
+  machines[4].l1d_size = 8 * KB; // level 4 without write combining
+  machines[4].l2_size = 256 * KB;
+
+  for (auto &caches : machines) {
+    auto gts = new CacheGuttering(nodes, data_workers, 1, GutteringConfiguration().gutter_bytes(KB),
+                                  caches);
+    gts->set_prefetch(true);
+    gts->print_fanouts();
+
+    shutdown = false;
+    upd_processed = 0;
+    std::thread query_threads[data_workers];
+    for (int t = 0; t < data_workers; t++)
+      query_threads[t] = std::thread(querier, gts, nodes);
+
+    for (int i = 0; i < num_updates; i++)
+      gts->insert({gutter_key_t(i % nodes), gutter_value_t(nodes - 1 - i % nodes)});
+
+    gts->force_flush();
+    shutdown = true;
+    gts->set_non_block(true); // switch to non-blocking calls in an effort to exit
+    for (int t = 0; t < data_workers; t++)
+      query_threads[t].join();
+
+    ASSERT_EQ(num_updates, upd_processed);
+    delete gts;
+  }
+}
+
+// many inserters on few level 3 gutters. Flushes whose lock is held are deferred
+TEST(CacheGutteringTest, ContendedLevel3) {
+  const int nodes = 4;
+  const int num_updates = 4000000;
+  const int data_workers = 2;
+  const int nthreads = 8;
+
+  auto gts = new CacheGuttering(nodes, data_workers, nthreads, GutteringConfiguration());
+  shutdown = false;
+  upd_processed = 0;
+
+  std::vector<std::thread> threads;
+  for (int j = 0; j < nthreads; j++) {
+    threads.emplace_back([&, j]() {
+      for (int i = j; i < num_updates; i += nthreads)
+        gts->insert({gutter_key_t(i % nodes), gutter_value_t(nodes - 1 - i % nodes)}, j);
+    });
+  }
+  // the consumers start late, so that an inserter blocks on the full work queue while holding
+  // a level 3 lock and the other inserters meet that lock held, however many cores there are
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  std::thread query_threads[data_workers];
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t] = std::thread(querier, gts, nodes);
+  for (auto &thr : threads)
+    thr.join();
+
+  gts->force_flush();
+  shutdown = true;
+  gts->set_non_block(true); // switch to non-blocking calls in an effort to exit
+  for (int t = 0; t < data_workers; t++)
+    query_threads[t].join();
+
+  auto stats = gts->get_level3_stats();
+  ASSERT_GT(stats.deferred, size_t(0));
+  ASSERT_EQ(num_updates, upd_processed);
+  delete gts;
+}
+
+// leaf gutters take buffers from a pool on first write. With a cap on the pool partially full
+// leaves are emitted early to make room
+TEST(CacheGutteringTest, LeafPoolCap) {
+  const int nodes = 4096;
+  const int num_updates = 2000000;
+  const int data_workers = 2;
+  const size_t cap = 256 * KB;
+
+  for (size_t pool_bytes : {size_t(0), cap}) {
+    auto gts = new CacheGuttering(nodes, data_workers, 1,
+                                  GutteringConfiguration().gutter_bytes(KB).leaf_pool_bytes(pool_bytes));
+    ASSERT_EQ(0, gts->leaf_buffer_bytes());
+
+    shutdown = false;
+    upd_processed = 0;
+    std::thread query_threads[data_workers];
+    for (int t = 0; t < data_workers; t++)
+      query_threads[t] = std::thread(querier, gts, nodes);
+
+    for (int i = 0; i < num_updates; i++) {
+      gutter_key_t key = (gutter_key_t(i) * 7919) % nodes;
+      gts->insert({key, gutter_value_t(nodes - 1 - key)});
+    }
+    gts->force_flush();
+    shutdown = true;
+    gts->set_non_block(true); // switch to non-blocking calls in an effort to exit
+    for (int t = 0; t < data_workers; t++)
+      query_threads[t].join();
+
+    ASSERT_EQ(num_updates, upd_processed);
+    printf("leaf buffer bytes = %lu\n", gts->leaf_buffer_bytes());
+    if (pool_bytes != 0) {
+      ASSERT_LE(gts->leaf_buffer_bytes(), pool_bytes);
+    }
+    delete gts;
+  }
+}
+
+// with adaptive leaves a hot node gets batches larger than the average leaf
+TEST(CacheGutteringTest, AdaptiveLeaves) {
+  const int nodes = 4096;
+  const int num_updates = 1 << 21;
+  const size_t avg_bytes = KB / 4;
+
+  auto gts = new CacheGuttering(nodes, 1, 1, GutteringConfiguration().gutter_bytes(KB)
+                                                 .adaptive_leaf_bytes(avg_bytes));
+  const size_t max_elms = gts->gutter_size() / sizeof(gutter_value_t);
+  const size_t avg_elms = avg_bytes / sizeof(gutter_value_t);
+
+  shutdown = false;
+  upd_processed = 0;
+  size_t hot_max = 0, cold_max = 0;
+  std::thread query_thread([&]() {
+    WorkQueue::DataNode *data;
+    while (true) {
+      if (gts->get_data(data)) {
+        for (auto &batch : data->get_batches()) {
+          for (auto upd : batch.upd_vec) ASSERT_EQ(nodes - (batch.node_idx + 1), upd);
+          upd_processed += batch.upd_vec.size();
+          size_t &max = batch.node_idx == 3 ? hot_max : cold_max;
+          max = std::max(max, batch.upd_vec.size());
+        }
+        gts->get_data_callback(data);
+      }
+      else if (shutdown)
+        return;
+    }
+  });
+
+  // half of the updates go to node 3
+  for (int i = 0; i < num_updates; i++) {
+    gutter_key_t key = i % 2 == 0 ? 3 : (gutter_key_t(i) * 7919) % nodes;
+    gts->insert({key, gutter_value_t(nodes - 1 - key)});
+  }
+  gts->force_flush();
+  shutdown = true;
+  gts->set_non_block(true);
+  query_thread.join();
+
+  ASSERT_EQ(num_updates, upd_processed);
+  ASSERT_EQ(max_elms, hot_max);
+  ASSERT_LE(cold_max, max_elms);
+  ASSERT_GT(hot_max, avg_elms);
+  delete gts;
+}
+
+TEST(HubGuttersTest, DetectsHubs) {
+  const size_t gutter_elms = 64;
+  WorkQueue wq(64, gutter_elms, 1);
+  HubGutters hubs(4, gutter_elms);
+
+  // nodes 7 and 1000 take a quarter of the updates each, the rest are spread over many nodes
+  size_t taken = 0;
+  for (size_t i = 0; i < (1 << 22); i++) {
+    gutter_key_t key = i % 4 == 0 ? 7 : i % 4 == 1 ? 1000 : gutter_key_t(i * 7919 % 100000);
+    if (hubs.insert({key, gutter_value_t(i)}, wq)) taken++;
+
+    WorkQueue::DataNode *data;
+    wq.set_non_block(true);
+    while (wq.peek(data)) {
+      for (auto &batch : data->get_batches()) {
+        ASSERT_TRUE(batch.node_idx == 7 || batch.node_idx == 1000);
+        ASSERT_LE(batch.upd_vec.size(), gutter_elms);
+      }
+      wq.peek_callback(data);
+    }
+  }
+  std::vector<gutter_key_t> found = hubs.get_hubs();
+  std::sort(found.begin(), found.end());
+  ASSERT_EQ(std::vector<gutter_key_t>({7, 1000}), found);
+  ASSERT_GT(taken, size_t(1 << 20)); // most of the hubs' updates skipped the other buffers
+}
+
+// a skewed stream from several inserters with hub gutters arrives complete
+TEST(HubGuttersTest, SkewedStream) {
+  const int nodes = 1 << 14;
+  const int num_updates = 1 << 21;
+  const int data_workers = 4;
+  const int nthreads = 4;
+
+  for (SystemEnum gts_enum : {STANDALONE, CACHETREE}) {
+    auto conf = GutteringConfiguration().gutter_bytes(KB).hub_gutters(8);
+    GutteringSystem *gts;
+    if (gts_enum == STANDALONE)
+      gts = new StandAloneGutters(nodes, data_workers, nthreads, conf);
+    else
+      gts = new CacheGuttering(nodes, data_workers, nthreads, conf);
+
+    shutdown = false;
+    upd_processed = 0;
+    std::thread query_threads[data_workers];
+    for (int t = 0; t < data_workers; t++)
+      query_threads[t] = std::thread(querier, gts, nodes);
+
+    // half of the updates go to node 3 and an eighth to node 5000
+    auto task = [&](const int j) {
+      for (int i = j; i < num_updates; i += nthreads) {
+        gutter_key_t key = i % 2 == 0 ? 3 : i % 8 == 1 ? 5000 : (gutter_key_t(i) * 7919) % nodes;
+        gts->insert({key, gutter_value_t(nodes - 1 - key)}, j);
+      }
+    };
+    std::vector<std::thread> threads;
+    for (int j = 0; j < nthreads; j++)
+      threads.emplace_back(task, j);
+    for (int j = 0; j < nthreads; j++)
+      threads[j].join();
+
+    gts->force_flush();
+    shutdown = true;
+    gts->set_non_block(true);
+    for (int t = 0; t < data_workers; t++)
+      query_threads[t].join();
+
+    ASSERT_EQ(uint32_t(num_updates), upd_processed);
+    delete gts;
+  }
+}
+
+// updates routed to worker processes reach the consumers of their partition, and a worker that
+// dies only takes its own partition down
+TEST(PartitionedGutteringTest, RoutesToWorkers) {
+  const int nodes = 1 << 12;
+  const size_t partitions = 4;
+  const int num_updates = 1 << 20;
+  const gutter_key_t part_nodes = nodes / partitions;
+
+  for (bool kill_worker : {false, true}) {
+    // updates received per partition and misrouted updates, shared with the workers
+    auto *counts = static_cast<std::atomic<uint64_t> *>(mmap(nullptr, 4096,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(MAP_FAILED, (void *) counts);
+    for (size_t p = 0; p <= partitions; p++) new (&counts[p]) std::atomic<uint64_t>(0);
+
+    auto consume = [=](const update_batch &batch) {
+      const size_t p = batch.node_idx / part_nodes;
+      if (kill_worker && p == 2) _exit(3);
+      for (auto upd : batch.upd_vec)
+        if (upd != gutter_value_t(nodes - 1 - batch.node_idx)) ++counts[partitions];
+      counts[p] += batch.upd_vec.size();
+    };
+    PartitionedGuttering router(nodes, partitions,
+                                PartitionedGuttering::cache_guttering(2,
+                                    GutteringConfiguration().gutter_bytes(KB)),
+                                consume, 2);
+    ASSERT_EQ(partitions, router.num_partitions());
+
+    for (int i = 0; i < num_updates; i++) {
+      gutter_key_t key = (gutter_key_t(i) * 7919) % nodes;
+      router.insert({key, gutter_value_t(nodes - 1 - key)});
+      if (i == num_updates / 2) router.force_flush();
+    }
+    ASSERT_EQ(kill_worker ? 1 : 0, router.finish());
+
+    ASSERT_EQ(0, counts[partitions]);
+    for (size_t p = 0; p < partitions; p++) {
+      if (kill_worker && p == 2) continue;
+      ASSERT_EQ(num_updates / partitions, counts[p]) << "partition " << p;
+    }
+    if (kill_worker) {
+      ASSERT_EQ(std::vector<size_t>({2}), router.failed_partitions());
+      ASSERT_GT(router.dropped_updates(), size_t(0));
+    }
+    munmap(counts, 4096);
+  }
+}
+
+// a consumer process attached to a shared memory work queue by name reads every batch in place
+TEST(ShmWorkQueueTest, ConsumerProcess) {
+  const int nodes = 1 << 10;
+  const int num_updates = 1 << 20;
+  const std::string name = "/gutter_test_wq_" + std::to_string(getpid());
+
+  // updates received and wrong updates, shared with the consumer
+  auto *counts = static_cast<std::atomic<uint64_t> *>(mmap(nullptr, 4096,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(MAP_FAILED, (void *) counts);
+  for (size_t i = 0; i < 2; i++) new (&counts[i]) std::atomic<uint64_t>(0);
+
+  StandAloneGutters gts(nodes, 1, 1, GutteringConfiguration().gutter_bytes(KB));
+  ShmWorkQueue shm(name, 16, gts.gutter_size() / sizeof(gutter_value_t));
+  gts.set_shm_queue(shm);
+  // the segment is in use by this process, so a second creator may not replace it
+  ASSERT_THROW(ShmWorkQueue(name, 16, 1), std::runtime_error);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    int status = 0;
+    try {
+      ShmWorkQueue consumer(name);
+      ShmWorkQueue::Batch batch;
+      while (consumer.peek(batch)) {
+        for (size_t i = 0; i < batch.count; i++)
+          if (batch.values[i] != gutter_value_t(nodes - 1 - batch.node_idx)) ++counts[1];
+        counts[0] += batch.count;
+        consumer.peek_callback(batch);
+      }
+    } catch (std::exception &e) {
+      status = 1;
+    }
+    _exit(status);
+  }
+
+  for (int i = 0; i < num_updates; i++) {
+    gutter_key_t key = (gutter_key_t(i) * 7919) % nodes;
+    gts.insert({key, gutter_value_t(nodes - 1 - key)}, 0);
+  }
+  gts.force_flush();
+  shm.close();
+
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  ASSERT_EQ(0, counts[1]);
+  ASSERT_EQ(num_updates, counts[0]);
+
+  // the local queue got nothing
+  gts.set_non_block(true);
+  WorkQueue::DataNode *data;
+  ASSERT_FALSE(gts.get_data(data));
+  munmap(counts, 4096);
+
+  // a segment that is not set up yet can be retried, one whose slots lie outside it cannot
+  const std::string raw = name + "_raw";
+  int fd = shm_open(raw.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT_NE(-1, fd);
+  ASSERT_THROW(ShmWorkQueue{raw}, ShmNotReady);
+  ASSERT_EQ(0, ftruncate(fd, 4096));
+  ASSERT_THROW(ShmWorkQueue{raw}, ShmNotReady);
+  void *mem = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ASSERT_NE(MAP_FAILED, mem);
+  auto *header = new (mem) ShmWorkQueue::Header();
+  header->version = ShmWorkQueue::layout_version;
+  header->key_bytes = sizeof(gutter_key_t);
+  header->value_bytes = sizeof(gutter_value_t);
+  header->num_slots = 1 << 10;
+  header->slot_values = 1;
+  header->slot_bytes = 64;
+  header->cells_offset = 4096;
+  header->slots_offset = 1 << 20;
+  header->magic.store(ShmWorkQueue::magic_number);
+  bool bad_geometry = false;
+  try {
+    ShmWorkQueue truncated(raw);
+  } catch (ShmNotReady &) {
+  } catch (std::runtime_error &) {
+    bad_geometry = true;
+  }
+  ASSERT_TRUE(bad_geometry);
+  munmap(mem, 4096);
+  ::close(fd);
+  shm_unlink(raw.c_str());
+}
+
+// a binary edge file is ingested by several threads, read or mapped, with every edge reaching
+// both of its endpoints
+TEST(EdgeStreamTest, IngestFile) {
+  const int nodes = 1 << 10;
+  const uint64_t num_edges = 1 << 19;
+  const std::string path = "./test_edges.data";
+
+  // a GraphZeppelin stream: node and edge counts, then flagged records of 4 byte ids
+  std::vector<uint64_t> degree(nodes);
+  uint64_t deletions = 0;
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    uint32_t num_nodes = nodes;
+    out.write(reinterpret_cast<const char *>(&num_nodes), sizeof(num_nodes));
+    out.write(reinterpret_cast<const char *>(&num_edges), sizeof(num_edges));
+    for (uint64_t i = 0; i < num_edges; i++) {
+      uint8_t flag = i % 5 == 0;
+      uint32_t src = i % nodes;
+      uint32_t dst = (i * 7919 + 1) % nodes;
+      out.write(reinterpret_cast<const char *>(&flag), 1);
+      out.write(reinterpret_cast<const char *>(&src), 4);
+      out.write(reinterpret_cast<const char *>(&dst), 4);
+      deletions += flag;
+      ++degree[src];
+      ++degree[dst];
+    }
+  }
+
+  EdgeStreamIngestor ingestor(path, EdgeStreamIngestor::Format::graph_zeppelin());
+  ASSERT_EQ(num_edges, ingestor.num_edges());
+  for (bool use_mmap : {false, true}) {
+    StandAloneGutters gts(nodes, 1, 2, GutteringConfiguration().gutter_bytes(KB));
+    std::vector<uint64_t> received(nodes);
+    std::atomic<bool> done{false};
+    std::thread consumer([&]() {
+      WorkQueue::DataNode *data;
+      while (true) {
+        if (gts.get_data(data)) {
+          for (auto &batch : data->get_batches())
+            received[batch.node_idx] += batch.upd_vec.size();
+          gts.get_data_callback(data);
+        }
+        else if (done)
+          return;
+      }
+    });
+
+    EdgeStreamIngestor::Stats stats = ingestor.ingest(gts, 2, use_mmap);
+    gts.force_flush();
+    done = true;
+    gts.set_non_block(true);
+    consumer.join();
+
+    ASSERT_EQ(num_edges, stats.edges);
+    ASSERT_EQ(deletions, stats.deletions);
+    ASSERT_EQ(2 * num_edges, stats.updates);
+    ASSERT_EQ(num_edges * 9, stats.bytes);
+    ASSERT_GT(stats.gb_per_sec(), 0);
+    ASSERT_EQ(degree, received) << (use_mmap ? "mmap" : "read");
+  }
+
+  // the system needs the header's nodes and an inserter per thread, and without a node count
+  // in the format every endpoint is still checked against the system's nodes
+  ASSERT_EQ(uint64_t(nodes), ingestor.num_nodes());
+  StandAloneGutters one_inserter(nodes, 1, 1, GutteringConfiguration().gutter_bytes(KB));
+  ASSERT_THROW(ingestor.ingest(one_inserter, 2), std::runtime_error);
+  StandAloneGutters half(nodes / 2, 1, 2, GutteringConfiguration().gutter_bytes(KB));
+  ASSERT_THROW(ingestor.ingest(half, 2), std::runtime_error);
+  EdgeStreamIngestor uncounted(path, EdgeStreamIngestor::Format().header(12).flags(true));
+  ASSERT_EQ(uint64_t(0), uncounted.num_nodes());
+  ASSERT_THROW(uncounted.ingest(half, 2), std::runtime_error);
+  remove(path.c_str());
+}
+
+TEST(StreamGeneratorTest, Reproducible) {
+  const int nodes = 1 << 12;
+  const uint64_t num_edges = 1 << 18;
+
+  // every record depends only on the seed and its index, whatever the number of threads
+  auto opts = StreamGenerator::Options().churn(0.25, 1 << 12).bursts(4, 1 << 14, 0.3);
+  StreamGenerator gen(nodes, num_edges, opts);
+  for (size_t threads : {1, 3}) {
+    std::vector<StreamGenerator::Edge> edges(num_edges);
+    gen.generate(threads, [&](size_t, uint64_t first, const StreamGenerator::Edge *chunk,
+                              size_t count) {
+      std::copy(chunk, chunk + count, edges.begin() + first);
+    });
+    for (uint64_t i = 0; i < num_edges; i += 997) {
+      StreamGenerator::Edge e = gen.edge(i);
+      ASSERT_EQ(e.src, edges[i].src);
+      ASSERT_EQ(e.dst, edges[i].dst);
+      ASSERT_EQ(e.deletion, edges[i].deletion);
+    }
+  }
+
+  // churn only deletes edges that are present
+  std::map<std::pair<gutter_key_t, gutter_key_t>, int64_t> present;
+  uint64_t deletions = 0;
+  for (uint64_t i = 0; i < num_edges; i++) {
+    StreamGenerator::Edge e = gen.edge(i);
+    ASSERT_NE(e.src, e.dst);
+    ASSERT_LT(e.src, gutter_key_t(nodes));
+    ASSERT_LT(e.dst, gutter_key_t(nodes));
+    if (e.deletion) {
+      ASSERT_GT((present[std::make_pair(e.src, e.dst)]--), 0) << "record " << i;
+      ++deletions;
+    }
+    else
+      ++present[std::make_pair(e.src, e.dst)];
+  }
+  ASSERT_NEAR(0.25, double(deletions) / num_edges, 0.01);
+
+  // R-MAT and Zipf streams are skewed, a different seed gives a different stream
+  for (auto dist : {StreamGenerator::RMAT, StreamGenerator::ZIPF}) {
+    StreamGenerator skewed(nodes, num_edges, StreamGenerator::Options().dist(dist));
+    std::vector<uint64_t> degree(nodes);
+    for (uint64_t i = 0; i < num_edges; i++) {
+      StreamGenerator::Edge e = skewed.edge(i);
+      ++degree[e.src];
+      ++degree[e.dst];
+    }
+    const double average = 2.0 * num_edges / nodes;
+    ASSERT_GT(*std::max_element(degree.begin(), degree.end()), 20 * average);
+  }
+  StreamGenerator other(nodes, num_edges, StreamGenerator::Options().seeded(2));
+  size_t same = 0;
+  for (uint64_t i = 0; i < 1000; i++)
+    same += other.edge(i).src == gen.edge(i).src && other.edge(i).dst == gen.edge(i).dst;
+  ASSERT_LT(same, size_t(100));
+
+  // a written stream reads back through EdgeStreamIngestor
+  const std::string path = "./test_generated.data";
+  gen.write_file(path, 2);
+  EdgeStreamIngestor ingestor(path, EdgeStreamIngestor::Format::graph_zeppelin());
+  ASSERT_EQ(num_edges, ingestor.num_edges());
+  StandAloneGutters gts(nodes, 1, 1, GutteringConfiguration().gutter_bytes(KB));
+  std::atomic<bool> done{false};
+  std::atomic<uint64_t> received{0};
+  std::thread consumer([&]() {
+    WorkQueue::DataNode *data;
+    while (true) {
+      if (gts.get_data(data)) {
+        for (auto &batch : data->get_batches()) received += batch.upd_vec.size();
+        gts.get_data_callback(data);
+      }
+      else if (done)
+        return;
+    }
+  });
+  EdgeStreamIngestor::Stats stats = ingestor.ingest(gts, 1);
+  gts.force_flush();
+  done = true;
+  gts.set_non_block(true);
+  consumer.join();
+  ASSERT_EQ(deletions, stats.deletions);
+  ASSERT_EQ(2 * num_edges, received.load());
+  remove(path.c_str());
+}